@@ -0,0 +1,95 @@
+// Table engine benchmark, see `make bench`
+#define MEL_IMPLEMENTATION
+#include "mel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef MEL_TABLE_SWISS
+#define ENGINE "swiss"
+#elif defined(MEL_TABLE_ORDERED)
+#define ENGINE "ordered"
+#else
+#define ENGINE "robinhood"
+#endif
+
+#define LOOKUPS 4000000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static mel_string_t** make_symbols(mel_vm_t *vm, const char *prefix, int count) {
+    mel_string_t **symbols = malloc(sizeof(mel_string_t*) * count);
+    char buf[64];
+    for (int i = 0; i < count; i++) {
+        int length = snprintf(buf, sizeof(buf), "%s%d", prefix, i);
+        symbols[i] = mel_intern(vm, buf, length);
+    }
+    return symbols;
+}
+
+static void run(mel_vm_t *vm, int size) {
+    mel_value_t table = mel_obj(mel_table_new());
+    mel_string_t **present = make_symbols(vm, "key", size);
+    mel_string_t **missing = make_symbols(vm, "absent", size);
+    int *order = malloc(sizeof(int) * LOOKUPS);
+    srand(size);
+    for (int i = 0; i < LOOKUPS; i++)
+        order[i] = rand() % size;
+
+    double start = now();
+    for (int i = 0; i < size; i++)
+        mel_table_set_symbol(table, present[i], mel_number(i));
+    double insert = now() - start;
+
+    double sum = 0;
+    start = now();
+    for (int i = 0; i < LOOKUPS; i++)
+        sum += mel_as_number(*mel_table_get_symbol(table, present[order[i]]));
+    double hit = now() - start;
+
+    int misses = 0;
+    start = now();
+    for (int i = 0; i < LOOKUPS; i++)
+        misses += !mel_table_get_symbol(table, missing[order[i]]);
+    double miss = now() - start;
+
+    start = now();
+    for (int i = 0; i < LOOKUPS; i++)
+        misses += !mel_table_get(table, missing[order[i]]->chars);
+    double chars = now() - start;
+
+    int walked = 0;
+    start = now();
+    while (walked < LOOKUPS) {
+        size_t cursor = 0;
+        mel_value_t value;
+        while (mel_table_next(table, &cursor, NULL, &value)) {
+            sum += mel_as_number(value);
+            walked++;
+        }
+    }
+    double iterate = now() - start;
+
+    printf("%-10s %8d  insert %6.1f  hit %6.1f  miss %6.1f  miss(chars) %6.1f  iterate %6.1f ns/op  [%g %d]\n",
+           ENGINE, size,
+           insert / size * 1e9, hit / LOOKUPS * 1e9, miss / LOOKUPS * 1e9, chars / LOOKUPS * 1e9,
+           iterate / walked * 1e9, sum, misses);
+    mel_obj_destroy((mel_object_t*)mel_as_table(table));
+    free(present);
+    free(missing);
+    free(order);
+}
+
+int main(void) {
+    mel_vm_t vm;
+    mel_init(&vm);
+    int sizes[] = { 8, 64, 1024, 65536, 1 << 20 };
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        run(&vm, sizes[i]);
+    mel_destroy(&vm);
+    return 0;
+}
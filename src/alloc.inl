@@ -0,0 +1,153 @@
+#ifndef MEL_ARENA_CHUNK
+#define MEL_ARENA_CHUNK (1024 * 1024)
+#endif
+
+static void* default_alloc(void *ud, size_t size) {
+    (void)ud;
+    return malloc(size);
+}
+
+static void* default_realloc(void *ud, void *ptr, size_t size) {
+    (void)ud;
+    return realloc(ptr, size);
+}
+
+static void default_free(void *ud, void *ptr) {
+    (void)ud;
+    free(ptr);
+}
+
+static const mel_allocator_t mel_default_allocator = {
+    .alloc = default_alloc,
+    .realloc = default_realloc,
+    .free = default_free,
+    .reset = NULL,
+    .ud = NULL
+};
+
+static inline void* mem_alloc(const mel_allocator_t *allocator, size_t size) {
+    return allocator->alloc(allocator->ud, size);
+}
+
+static inline void* mem_calloc(const mel_allocator_t *allocator, size_t count, size_t size) {
+    void *result = allocator->alloc(allocator->ud, count * size);
+    if (result)
+        memset(result, 0, count * size);
+    return result;
+}
+
+static inline void* mem_realloc(const mel_allocator_t *allocator, void *ptr, size_t size) {
+    return allocator->realloc(allocator->ud, ptr, size);
+}
+
+static inline void mem_free(const mel_allocator_t *allocator, void *ptr) {
+    if (ptr)
+        allocator->free(allocator->ud, ptr);
+}
+
+// Each block is preceded by its size so realloc knows how much to copy
+#define ARENA_HEADER sizeof(max_align_t)
+#define ARENA_ALIGN(SIZE) (((SIZE) + ARENA_HEADER - 1) & ~(size_t)(ARENA_HEADER - 1))
+
+typedef struct mel_arena_chunk {
+    struct mel_arena_chunk *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+} mel_arena_chunk_t;
+
+static inline unsigned char* arena_top(mel_arena_chunk_t *chunk) {
+    return (unsigned char*)chunk->data + chunk->used;
+}
+
+static void* arena_alloc(void *ud, size_t size) {
+    mel_arena_t *arena = ud;
+    size_t need = ARENA_HEADER + ARENA_ALIGN(size);
+    mel_arena_chunk_t *chunk = arena->current;
+    while (!chunk || chunk->size - chunk->used < need) {
+        // Chunks kept from before a reset are reused in order
+        mel_arena_chunk_t *next = chunk ? chunk->next : arena->first;
+        if (!next || next->size < need) {
+            size_t size = need > arena->chunk_size ? need : arena->chunk_size;
+            mel_arena_chunk_t *fresh = malloc(sizeof(mel_arena_chunk_t) + size);
+            if (!fresh)
+                return NULL;
+            fresh->size = size;
+            fresh->next = next;
+            if (chunk)
+                chunk->next = fresh;
+            else
+                arena->first = fresh;
+            next = fresh;
+        }
+        next->used = 0;
+        chunk = next;
+    }
+    arena->current = chunk;
+    unsigned char *block = arena_top(chunk);
+    chunk->used += need;
+    *(size_t*)block = size;
+    return block + ARENA_HEADER;
+}
+
+static inline bool arena_is_last(mel_arena_t *arena, unsigned char *block, size_t size) {
+    return arena->current && block + ARENA_ALIGN(size) == arena_top(arena->current);
+}
+
+static void* arena_realloc(void *ud, void *ptr, size_t size) {
+    mel_arena_t *arena = ud;
+    if (!ptr)
+        return arena_alloc(ud, size);
+    unsigned char *block = ptr;
+    size_t *header = (size_t*)(block - ARENA_HEADER);
+    size_t old = *header;
+    // The latest block can grow or shrink in place
+    if (arena_is_last(arena, block, old) &&
+        arena->current->size - arena->current->used + ARENA_ALIGN(old) >= ARENA_ALIGN(size)) {
+        arena->current->used += ARENA_ALIGN(size) - ARENA_ALIGN(old);
+        *header = size;
+        return ptr;
+    }
+    void *result = arena_alloc(ud, size);
+    if (result)
+        memcpy(result, ptr, old < size ? old : size);
+    return result;
+}
+
+static void arena_free(void *ud, void *ptr) {
+    mel_arena_t *arena = ud;
+    unsigned char *block = ptr;
+    size_t size = *(size_t*)(block - ARENA_HEADER);
+    if (arena_is_last(arena, block, size))
+        arena->current->used -= ARENA_HEADER + ARENA_ALIGN(size);
+}
+
+static void arena_reset(void *ud) {
+    mel_arena_t *arena = ud;
+    arena->current = NULL;
+}
+
+void mel_arena_init(mel_arena_t *arena, size_t chunk_size) {
+    arena->first = arena->current = NULL;
+    arena->chunk_size = chunk_size ? chunk_size : MEL_ARENA_CHUNK;
+}
+
+mel_allocator_t mel_arena_allocator(mel_arena_t *arena) {
+    return (mel_allocator_t) {
+        .alloc = arena_alloc,
+        .realloc = arena_realloc,
+        .free = arena_free,
+        .reset = arena_reset,
+        .ud = arena
+    };
+}
+
+void mel_arena_free(mel_arena_t *arena) {
+    mel_arena_chunk_t *chunk = arena->first;
+    while (chunk) {
+        mel_arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->first = arena->current = NULL;
+}
@@ -0,0 +1,469 @@
+typedef struct mel_aot_unit {
+    mel_vm_t *vm;
+    FILE *out;
+    mel_function_t **functions;
+    const mel_allocator_t *allocator;
+} mel_aot_unit_t;
+
+// UTF-8 bytes go out as octal escapes, they are always 3 digits
+static void aot_literal(FILE *out, const char *chars, int length) {
+    fputc('"', out);
+    for (int i = 0; i < length; i++) {
+        unsigned char c = chars[i];
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c >= 0x20 && c < 0x7F)
+            fputc(c, out);
+        else
+            fprintf(out, "\\%03o", c);
+    }
+    fputc('"', out);
+}
+
+static void aot_name(FILE *out, mel_function_t *function) {
+    if (function->name)
+        aot_literal(out, function->name->chars, function->name->length);
+    else
+        fputs("\"lambda\"", out);
+}
+
+static int aot_index(mel_aot_unit_t *unit, mel_function_t *function) {
+    for (int i = 0; i < garry_count(unit->functions); i++)
+        if (unit->functions[i] == function)
+            return i;
+    return -1;
+}
+
+static int aot_global(int *globals, int slot) {
+    for (int i = 0; i < garry_count(globals); i++)
+        if (globals[i] == slot)
+            return i;
+    return -1;
+}
+
+static int aot_operand(unsigned char *pc, int size) {
+    switch (size) {
+        case 1:
+            return pc[1];
+        case 2:
+            return (pc[1] << 8) | pc[2];
+        default:
+            return 0;
+    }
+}
+
+// Slot numbers only mean something in the VM that compiled the code. Each
+// global a function uses is looked up again when the module is loaded and
+// its slot passed in as an extra constant, in order of first use
+static int* aot_globals(mel_aot_unit_t *unit, mel_function_t *function) {
+    static const int operands[] = {
+#define X(_, __, OPERANDS) OPERANDS,
+        OPCODES
+#undef X
+    };
+    unsigned char *code = function->code;
+    int *globals;
+    garry_with(globals, unit->allocator);
+    for (int i = 0; i < garry_count(code); i += 1 + operands[code[i]])
+        if ((code[i] == MEL_OP_GET_GLOBAL || code[i] == MEL_OP_SET_GLOBAL) &&
+            aot_global(globals, aot_operand(code + i, 2)) < 0)
+            garry_append(globals, aot_operand(code + i, 2));
+    return globals;
+}
+
+static void aot_function(mel_aot_unit_t *unit, mel_function_t *function) {
+    static const int operands[] = {
+#define X(_, __, OPERANDS) OPERANDS,
+        OPCODES
+#undef X
+    };
+    static const int effects[] = {
+#define X(_, EFFECT, __) EFFECT,
+        OPCODES
+#undef X
+    };
+    for (int i = 0; i < garry_count(function->constants); i++)
+        if (mel_is_function(function->constants[i]))
+            aot_function(unit, mel_as_function(function->constants[i]));
+    garry_append(unit->functions, function);
+    FILE *out = unit->out;
+    unsigned char *code = function->code;
+    int length = garry_count(code);
+    int *heights = mem_alloc(unit->allocator, sizeof(int) * (length + 1));
+    bool *targets = mem_calloc(unit->allocator, length + 1, sizeof(bool));
+    for (int i = 0; i <= length; i++)
+        heights[i] = -1;
+    // Operand stack heights are static, so every slot becomes a C local
+    int height = 1 + function->arity, max = height;
+    int *globals = aot_globals(unit, function);
+    // A closure's cells come after its constants and global slots
+    int cells = garry_count(function->constants) + garry_count(globals);
+    // Self tail calls loop back to entry, calls and sends that aren't tail
+    // calls nest and need r
+    bool calls = false, loops = false, nests = false, entry = false;
+    for (int i = 0; i < length; i += 1 + operands[code[i]]) {
+        if (heights[i] >= 0)
+            height = heights[i];
+        heights[i] = height;
+        int arg = aot_operand(code + i, operands[code[i]]);
+        int next = i + 1 + operands[code[i]];
+        switch (code[i]) {
+            case MEL_OP_JUMP:
+                heights[next + arg] = height;
+                targets[next + arg] = true;
+                height = -1;
+                continue;
+            case MEL_OP_JUMP_IF_FALSE:
+                heights[next + arg] = height - 1;
+                targets[next + arg] = true;
+                break;
+            case MEL_OP_JUMP_IF_FALSE_OR_POP:
+            case MEL_OP_JUMP_IF_TRUE_OR_POP:
+                heights[next + arg] = height;
+                targets[next + arg] = true;
+                break;
+            case MEL_OP_LOOP:
+                loops = true;
+                targets[next - arg] = true;
+                height = -1;
+                continue;
+            case MEL_OP_CALL:
+            case MEL_OP_TAIL_CALL:
+                calls = true;
+                nests |= code[i] == MEL_OP_CALL;
+                entry |= code[i] == MEL_OP_TAIL_CALL && arg == function->arity;
+                height -= arg;
+                break;
+            case MEL_OP_SEND:
+            case MEL_OP_TAIL_SEND:
+                calls = true;
+                nests |= code[i] == MEL_OP_SEND;
+                height -= code[i + 3];
+                break;
+            case MEL_OP_LEAVE:
+            case MEL_OP_ARRAY:
+            case MEL_OP_TABLE:
+                height -= arg;
+                break;
+            case MEL_OP_RETURN:
+                height = -1;
+                continue;
+        }
+        height += effects[code[i]];
+        if (height > max)
+            max = height;
+    }
+
+    fprintf(out, "\nstatic mel_result mel_fn_%d(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {\n",
+            garry_count(unit->functions) - 1);
+    fprintf(out, "    mel_value_t *K = mel_as_native(argv[-1])->constants;\n");
+    if (calls || loops) {
+        // Calls and loops are safe points, the locals have to be visible to
+        // the collector
+        fprintf(out, "    mel_value_t s[%d] = {0};\n", max + 1);
+        if (nests)
+            fprintf(out, "    mel_result r;\n");
+        fprintf(out, "    mel_gc_push(vm, s, %d);\n", max + 1);
+    } else
+        fprintf(out, "    mel_value_t s[%d];\n", max + 1);
+    if (garry_count(globals))
+        fprintf(out, "    mel_global_t *g;\n");
+    fprintf(out, "    (void)K;\n");
+    fprintf(out, "    if (argc != %d)\n", function->arity);
+    fprintf(out, "        return mel_error(vm, \"expected %%d arguments but got %%d\", %d, argc);\n", function->arity);
+    fprintf(out, "    s[0] = argv[-1];\n");
+    for (int i = 0; i < function->arity; i++)
+        fprintf(out, "    s[%d] = argv[%d];\n", i + 1, i);
+    if (entry)
+        fprintf(out, "entry:;\n");
+    for (int i = 0; i < length; i += 1 + operands[code[i]]) {
+        int h = heights[i];
+        int arg = aot_operand(code + i, operands[code[i]]);
+        int next = i + 1 + operands[code[i]];
+        if (targets[i])
+            fprintf(out, "L%d:;\n", i);
+        if (h < 0)
+            continue;
+        switch (code[i]) {
+            case MEL_OP_CONSTANT: {
+                mel_value_t constant = function->constants[arg];
+                if (mel_is_number(constant))
+                    fprintf(out, "    s[%d] = mel_number(%.17g);\n", h, mel_as_number(constant));
+                else
+                    fprintf(out, "    s[%d] = K[%d];\n", h, arg);
+                break;
+            }
+            case MEL_OP_NIL:
+                fprintf(out, "    s[%d] = mel_nil();\n", h);
+                break;
+            case MEL_OP_TRUE:
+                fprintf(out, "    s[%d] = mel_boolean(true);\n", h);
+                break;
+            case MEL_OP_POP:
+                break;
+            case MEL_OP_LEAVE:
+                fprintf(out, "    s[%d] = s[%d];\n", h - 1 - arg, h - 1);
+                break;
+            case MEL_OP_GET_LOCAL:
+                fprintf(out, "    s[%d] = s[%d];\n", h, arg);
+                break;
+            case MEL_OP_SET_LOCAL:
+            case MEL_OP_STORE_LOCAL:
+                fprintf(out, "    s[%d] = s[%d];\n", arg, h - 1);
+                break;
+            case MEL_OP_BOX:
+                fprintf(out, "    s[%d] = mel_new_cell(vm, s[%d]);\n", arg, arg);
+                break;
+            case MEL_OP_GET_CELL:
+                fprintf(out, "    s[%d] = mel_as_cell(s[%d])->value;\n", h, arg);
+                break;
+            case MEL_OP_SET_CELL:
+                fprintf(out, "    mel_cell_set(vm, s[%d], s[%d]);\n", arg, h - 1);
+                break;
+            case MEL_OP_GET_UPVALUE:
+                fprintf(out, "    s[%d] = mel_as_cell(K[%d])->value;\n", h, cells + arg);
+                break;
+            case MEL_OP_SET_UPVALUE:
+                fprintf(out, "    mel_cell_set(vm, K[%d], s[%d]);\n", cells + arg, h - 1);
+                break;
+            case MEL_OP_GET_GLOBAL: {
+                mel_string_t *name = unit->vm->global_slots[arg].name;
+                fprintf(out, "    g = &vm->global_slots[(int)mel_as_number(K[%d])];\n",
+                        garry_count(function->constants) + aot_global(globals, arg));
+                fprintf(out, "    if (!g->defined)\n");
+                fprintf(out, "        return mel_error(vm, \"undefined variable '%%s'\", ");
+                aot_literal(out, name->chars, name->length);
+                fprintf(out, ");\n    s[%d] = g->value;\n", h);
+                break;
+            }
+            case MEL_OP_SET_GLOBAL:
+                fprintf(out, "    g = &vm->global_slots[(int)mel_as_number(K[%d])];\n",
+                        garry_count(function->constants) + aot_global(globals, arg));
+                fprintf(out, "    g->value = s[%d];\n    g->defined = true;\n", h - 1);
+                break;
+#define X(OPCODE, OP, RESULT) \
+            case MEL_OP_##OPCODE: \
+                fprintf(out, "    if (!mel_is_number(s[%d]) || !mel_is_number(s[%d]))\n", h - 2, h - 1); \
+                fprintf(out, "        return mel_error(vm, \"operands must be numbers\");\n"); \
+                fprintf(out, "    s[%d] = " #RESULT "(mel_as_number(s[%d]) " #OP " mel_as_number(s[%d]));\n", h - 2, h - 2, h - 1); \
+                break;
+            X(ADD, +, mel_number)
+            X(SUB, -, mel_number)
+            X(MUL, *, mel_number)
+            X(DIV, /, mel_number)
+            X(LESS, <, mel_boolean)
+            X(GREATER, >, mel_boolean)
+            X(LESS_EQUAL, <=, mel_boolean)
+            X(GREATER_EQUAL, >=, mel_boolean)
+#undef X
+#define X(OPCODE, _, OP, RESULT) \
+            case MEL_OP_##OPCODE##_LOCAL: \
+                fprintf(out, "    if (!mel_is_number(s[%d]) || !mel_is_number(s[%d]))\n", h - 1, arg); \
+                fprintf(out, "        return mel_error(vm, \"operands must be numbers\");\n"); \
+                fprintf(out, "    s[%d] = " #RESULT "(mel_as_number(s[%d]) " #OP " mel_as_number(s[%d]));\n", h - 1, h - 1, arg); \
+                break; \
+            case MEL_OP_##OPCODE##_CONSTANT: \
+                fprintf(out, "    if (!mel_is_number(s[%d]))\n", h - 1); \
+                fprintf(out, "        return mel_error(vm, \"operands must be numbers\");\n"); \
+                fprintf(out, "    s[%d] = " #RESULT "(mel_as_number(s[%d]) " #OP " %.17g);\n", \
+                        h - 1, h - 1, mel_as_number(function->constants[arg])); \
+                break;
+            FUSED_OPS
+#undef X
+            case MEL_OP_NEGATE:
+                fprintf(out, "    if (!mel_is_number(s[%d]))\n", h - 1);
+                fprintf(out, "        return mel_error(vm, \"operand must be a number\");\n");
+                fprintf(out, "    s[%d] = mel_number(-mel_as_number(s[%d]));\n", h - 1, h - 1);
+                break;
+            case MEL_OP_NOT:
+                fprintf(out, "    s[%d] = mel_boolean(mel_is_falsey(s[%d]));\n", h - 1, h - 1);
+                break;
+            case MEL_OP_EQUAL:
+                fprintf(out, "    s[%d] = mel_boolean(mel_equal(s[%d], s[%d]));\n", h - 2, h - 2, h - 1);
+                break;
+            case MEL_OP_JUMP:
+                fprintf(out, "    goto L%d;\n", next + arg);
+                break;
+            case MEL_OP_JUMP_IF_FALSE:
+            case MEL_OP_JUMP_IF_FALSE_OR_POP:
+                fprintf(out, "    if (mel_is_falsey(s[%d]))\n        goto L%d;\n", h - 1, next + arg);
+                break;
+            case MEL_OP_JUMP_IF_TRUE_OR_POP:
+                fprintf(out, "    if (!mel_is_falsey(s[%d]))\n        goto L%d;\n", h - 1, next + arg);
+                break;
+            case MEL_OP_LOOP:
+                fprintf(out, "    mel_gc_check(vm);\n    goto L%d;\n", next - arg);
+                break;
+            case MEL_OP_ARRAY:
+                fprintf(out, "    s[%d] = mel_new_array(vm, %d, &s[%d]);\n", h - arg, arg, h - arg);
+                break;
+            case MEL_OP_TABLE:
+                fprintf(out, "    {\n        mel_value_t t = mel_new_table(vm);\n");
+                for (int j = h - arg; j < h; j += 2)
+                    fprintf(out, "        if (mel_table_set_value(t, s[%d], s[%d]) < 0)\n"
+                                 "            return mel_error(vm, \"table keys cannot be nil or NaN\");\n", j, j + 1);
+                fprintf(out, "        s[%d] = t;\n    }\n", h - arg);
+                break;
+            case MEL_OP_CLOSURE: {
+                // A copy of the prototype native with the cells added to
+                // its constants
+                mel_function_t *child = mel_as_function(function->constants[arg]);
+                int *child_globals = aot_globals(unit, child);
+                int n = garry_count(child->constants) + garry_count(child_globals);
+                int count = garry_count(child->upvalues);
+                garry_free(child_globals);
+                fprintf(out, "    {\n        mel_native_t *p = mel_as_native(K[%d]);\n", arg);
+                fprintf(out, "        mel_value_t c[%d];\n", n + count);
+                if (n)
+                    fprintf(out, "        for (int j = 0; j < %d; j++)\n            c[j] = p->constants[j];\n", n);
+                for (int j = 0; j < count; j++) {
+                    mel_upvalue_t upvalue = child->upvalues[j];
+                    if (upvalue.local)
+                        fprintf(out, "        c[%d] = s[%d];\n", n + j, upvalue.index);
+                    else
+                        fprintf(out, "        c[%d] = K[%d];\n", n + j, cells + upvalue.index);
+                }
+                fprintf(out, "        s[%d] = mel_new_native(vm, p->name, p->fn, %d, c);\n    }\n", h, n + count);
+                break;
+            }
+            case MEL_OP_CALL: {
+                int callee = h - arg - 1;
+                fprintf(out, "    if ((r = mel_call(vm, s[%d], %d, &s[%d], &s[%d])) != MEL_OK)\n        return r;\n",
+                        callee, arg, callee + 1, callee);
+                break;
+            }
+            case MEL_OP_TAIL_CALL: {
+                // Calling itself starts over in place, anything else is left
+                // to the VM once this returns
+                int callee = h - arg - 1, self = garry_count(unit->functions) - 1;
+                if (arg == function->arity) {
+                    fprintf(out, "    if (mel_is_native(s[%d]) && mel_as_native(s[%d])->fn == mel_fn_%d) {\n",
+                            callee, callee, self);
+                    fprintf(out, "        K = mel_as_native(s[%d])->constants;\n", callee);
+                    for (int j = 0; j <= arg; j++)
+                        fprintf(out, "        s[%d] = s[%d];\n", j, callee + j);
+                    fprintf(out, "        mel_gc_check(vm);\n        goto entry;\n    }\n");
+                }
+                fprintf(out, "    return mel_tail_call(vm, s[%d], %d, &s[%d]);\n", callee, arg, callee + 1);
+                break;
+            }
+            case MEL_OP_SEND: {
+                // Without the VM's caches, each send looks the method up
+                int name = (code[i + 1] << 8) | code[i + 2], argc = code[i + 3], slot = h - argc - 1;
+                fprintf(out, "    if ((r = mel_send(vm, mel_as_string(K[%d]), %d, &s[%d], &s[%d])) != MEL_OK)\n        return r;\n",
+                        name, argc, slot + 1, slot);
+                break;
+            }
+            case MEL_OP_TAIL_SEND: {
+                int name = (code[i + 1] << 8) | code[i + 2], argc = code[i + 3], slot = h - argc - 1;
+                fprintf(out, "    return mel_tail_send(vm, mel_as_string(K[%d]), %d, &s[%d]);\n", name, argc, slot + 1);
+                break;
+            }
+            case MEL_OP_RETURN:
+                fprintf(out, "    *out = s[%d];\n    return MEL_OK;\n", h - 1);
+                break;
+        }
+    }
+    fprintf(out, "}\n");
+    garry_free(globals);
+    mem_free(unit->allocator, heights);
+    mem_free(unit->allocator, targets);
+}
+
+static void aot_register(mel_aot_unit_t *unit, mel_function_t **toplevel, const char *module) {
+    FILE *out = unit->out;
+    int count = garry_count(unit->functions);
+    fprintf(out, "\nmel_result mel_aot_%s(mel_vm_t *vm) {\n", module);
+    fprintf(out, "    mel_value_t f[%d];\n", count);
+    fprintf(out, "    mel_result r;\n");
+    for (int i = 0; i < count; i++) {
+        mel_function_t *function = unit->functions[i];
+        int *globals = aot_globals(unit, function);
+        int nconstants = garry_count(function->constants), nglobals = garry_count(globals);
+        if (!nconstants && !nglobals) {
+            garry_free(globals);
+            fprintf(out, "    f[%d] = mel_new_native(vm, ", i);
+            aot_name(out, function);
+            fprintf(out, ", mel_fn_%d, 0, NULL);\n", i);
+            continue;
+        }
+        fprintf(out, "    {\n        mel_value_t k[] = {\n");
+        for (int j = 0; j < nconstants; j++) {
+            mel_value_t constant = function->constants[j];
+            fprintf(out, "            ");
+            if (mel_is_number(constant))
+                fprintf(out, "mel_number(%.17g)", mel_as_number(constant));
+            else if (mel_is_string(constant)) {
+                mel_string_t *str = mel_as_string(constant);
+                fprintf(out, str->interned ? "mel_obj(mel_intern(vm, " : "mel_new_string(vm, ");
+                aot_literal(out, str->chars, str->length);
+                fprintf(out, str->interned ? ", %d))" : ", %d)", str->length);
+            } else if (mel_is_function(constant))
+                fprintf(out, "f[%d]", aot_index(unit, mel_as_function(constant)));
+            else
+                fprintf(out, "mel_nil()");
+            fprintf(out, "%s\n", j + 1 < nconstants + nglobals ? "," : "");
+        }
+        for (int j = 0; j < nglobals; j++) {
+            mel_string_t *name = unit->vm->global_slots[globals[j]].name;
+            fprintf(out, "            mel_number(mel_global_slot(vm, ");
+            aot_literal(out, name->chars, name->length);
+            fprintf(out, ", %d))%s\n", name->length, j + 1 < nglobals ? "," : "");
+        }
+        garry_free(globals);
+        fprintf(out, "        };\n        f[%d] = mel_new_native(vm, ", i);
+        aot_name(out, function);
+        fprintf(out, ", mel_fn_%d, %d, k);\n    }\n", i, nconstants + nglobals);
+    }
+    fprintf(out, "    mel_gc_push(vm, f, %d);\n", count);
+    for (int i = 0; i < garry_count(toplevel); i++)
+        fprintf(out, "    if ((r = mel_call(vm, f[%d], 0, NULL, NULL)) != MEL_OK)\n        goto done;\n",
+                aot_index(unit, toplevel[i]));
+    fprintf(out, "done:\n    mel_gc_pop(vm);\n    return r;\n}\n");
+}
+
+mel_result mel_aot(mel_vm_t *vm, const char *path, FILE *out, const char *module) {
+    size_t src_length;
+    unsigned char *src = read_file(&vm->allocator, path, &src_length);
+    if (!src || !src_length) {
+        mem_free(&vm->allocator, src);
+        return MEL_COMPILE_ERROR;
+    }
+    mel_lexer_t lexer;
+    lexer_init(&lexer, (const char*)src, src_length);
+    mel_parser_t parser = {
+        .vm = vm,
+        .lexer = &lexer,
+        .line = 0,
+        .had_error = false
+    };
+    mel_function_t **toplevel;
+    garry_with(toplevel, &vm->allocator);
+    mel_aot_unit_t unit = {
+        .vm = vm,
+        .out = out,
+        .allocator = &vm->allocator
+    };
+    garry_with(unit.functions, &vm->allocator);
+    mel_result ret = MEL_COMPILE_ERROR;
+    lexer_consume(&lexer);
+    while (lexer.current.type != MEL_TOKEN_EOF) {
+        mel_function_t *function = compile(&parser);
+        if (!function)
+            goto BAIL;
+        function->name = NULL;
+        garry_append(toplevel, function);
+    }
+    fprintf(out, "// Generated by mel from %s, do not edit\n", path);
+    fprintf(out, "#include \"mel.h\"\n");
+    for (int i = 0; i < garry_count(toplevel); i++)
+        aot_function(&unit, toplevel[i]);
+    aot_register(&unit, toplevel, module);
+    ret = MEL_OK;
+BAIL:
+    garry_free(toplevel);
+    garry_free(unit.functions);
+    lexer_free(&lexer);
+    mem_free(&vm->allocator, src);
+    return ret;
+}
@@ -0,0 +1,96 @@
+#ifndef MEL_ARRAY_MIN
+#define MEL_ARRAY_MIN 8
+#endif
+
+static inline size_t array_stride(mel_array_t *array) {
+    return array->packed ? sizeof(mel_float) : sizeof(mel_value_t);
+}
+
+static bool array_reserve(mel_array_t *array, int capacity) {
+    if (capacity <= array->capacity)
+        return true;
+    int size = array->capacity ? array->capacity : MEL_ARRAY_MIN;
+    while (size < capacity)
+        size *= 2;
+    void *buffer = mem_realloc(array->allocator, array->values, array_stride(array) * size);
+    if (!buffer)
+        return false;
+    array->values = buffer;
+    array->capacity = size;
+    return true;
+}
+
+// Boxes every element, done once when the first non-number is stored
+static bool array_unpack(mel_array_t *array) {
+    mel_value_t *values = NULL;
+    if (array->capacity && !(values = mem_alloc(array->allocator, sizeof(mel_value_t) * array->capacity)))
+        return false;
+    for (int i = 0; i < array->count; i++)
+        values[i] = mel_number(array->numbers[i]);
+    mem_free(array->allocator, array->numbers);
+    array->values = values;
+    array->packed = false;
+    return true;
+}
+
+static bool array_store(mel_array_t *array, int index, mel_value_t value) {
+    if (array->packed) {
+        if (mel_is_number(value)) {
+            array->numbers[index] = mel_as_number(value);
+            return true;
+        }
+        if (!array_unpack(array))
+            return false;
+    }
+    gc_array_write(array, value);
+    array->values[index] = value;
+    return true;
+}
+
+mel_value_t mel_new_array(mel_vm_t *vm, int count, const mel_value_t *values) {
+    mel_array_t *array = (mel_array_t*)obj_new(&vm->allocator, MEL_OBJECT_ARRAY, sizeof(mel_array_t));
+    array->count = array->capacity = 0;
+    array->packed = true;
+    array->remembered = false;
+    array->values = NULL;
+    array->vm = vm;
+    array->allocator = &vm->allocator;
+    track_object(vm, &array->obj);
+    if (!array_reserve(array, count))
+        return mel_obj(array);
+    if (values)
+        for (int i = 0; i < count; i++)
+            if (array_store(array, i, values[i]))
+                array->count++;
+    return mel_obj(array);
+}
+
+int mel_array_count(mel_value_t melv) {
+    assert(mel_is_array(melv));
+    return mel_as_array(melv)->count;
+}
+
+mel_value_t mel_array_get(mel_value_t melv, int index) {
+    assert(mel_is_array(melv));
+    mel_array_t *array = mel_as_array(melv);
+    if (index < 0 || index >= array->count)
+        return mel_nil();
+    return array->packed ? mel_number(array->numbers[index]) : array->values[index];
+}
+
+bool mel_array_set(mel_value_t melv, int index, mel_value_t val) {
+    assert(mel_is_array(melv));
+    mel_array_t *array = mel_as_array(melv);
+    if (index < 0 || index >= array->count)
+        return false;
+    return array_store(array, index, val);
+}
+
+bool mel_array_push(mel_value_t melv, mel_value_t val) {
+    assert(mel_is_array(melv));
+    mel_array_t *array = mel_as_array(melv);
+    if (!array_reserve(array, array->count + 1) || !array_store(array, array->count, val))
+        return false;
+    array->count++;
+    return true;
+}
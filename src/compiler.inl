@@ -0,0 +1,913 @@
+#define OPCODES \
+    X(CONSTANT, 1, 2) \
+    X(NIL, 1, 0) \
+    X(TRUE, 1, 0) \
+    X(POP, -1, 0) \
+    X(LEAVE, 0, 1) \
+    X(GET_LOCAL, 1, 1) \
+    X(SET_LOCAL, 0, 1) \
+    X(STORE_LOCAL, -1, 1) \
+    X(BOX, 0, 1) \
+    X(GET_CELL, 1, 1) \
+    X(SET_CELL, 0, 1) \
+    X(GET_UPVALUE, 1, 1) \
+    X(SET_UPVALUE, 0, 1) \
+    X(GET_GLOBAL, 1, 2) \
+    X(SET_GLOBAL, 0, 2) \
+    X(ADD, -1, 0) \
+    X(SUB, -1, 0) \
+    X(MUL, -1, 0) \
+    X(DIV, -1, 0) \
+    X(NEGATE, 0, 0) \
+    X(NOT, 0, 0) \
+    X(EQUAL, -1, 0) \
+    X(LESS, -1, 0) \
+    X(GREATER, -1, 0) \
+    X(LESS_EQUAL, -1, 0) \
+    X(GREATER_EQUAL, -1, 0) \
+    X(ADD_LOCAL, 0, 1) \
+    X(SUB_LOCAL, 0, 1) \
+    X(MUL_LOCAL, 0, 1) \
+    X(DIV_LOCAL, 0, 1) \
+    X(LESS_LOCAL, 0, 1) \
+    X(GREATER_LOCAL, 0, 1) \
+    X(LESS_EQUAL_LOCAL, 0, 1) \
+    X(GREATER_EQUAL_LOCAL, 0, 1) \
+    X(ADD_CONSTANT, 0, 2) \
+    X(SUB_CONSTANT, 0, 2) \
+    X(MUL_CONSTANT, 0, 2) \
+    X(DIV_CONSTANT, 0, 2) \
+    X(LESS_CONSTANT, 0, 2) \
+    X(GREATER_CONSTANT, 0, 2) \
+    X(LESS_EQUAL_CONSTANT, 0, 2) \
+    X(GREATER_EQUAL_CONSTANT, 0, 2) \
+    X(JUMP, 0, 2) \
+    X(JUMP_IF_FALSE, -1, 2) \
+    X(JUMP_IF_FALSE_OR_POP, -1, 2) \
+    X(JUMP_IF_TRUE_OR_POP, -1, 2) \
+    X(LOOP, 0, 2) \
+    X(ARRAY, 1, 2) \
+    X(TABLE, 1, 2) \
+    X(CLOSURE, 1, 2) \
+    X(CALL, 0, 1) \
+    X(SEND, 0, 5) \
+    X(TAIL_CALL, 0, 1) \
+    X(TAIL_SEND, 0, 5) \
+    X(RETURN, -1, 0)
+
+typedef enum mel_opcode {
+#define X(OP, ...) MEL_OP_##OP,
+    OPCODES
+#undef X
+} mel_opcode;
+
+// Binary operators whose right operand can be read straight from a local
+// slot (OP_LOCAL) or a number constant (OP_CONSTANT) instead of the stack
+#define FUSED_OPS \
+    X(ADD, add, +, mel_number) \
+    X(SUB, sub, -, mel_number) \
+    X(MUL, mul, *, mel_number) \
+    X(DIV, div, /, mel_number) \
+    X(LESS, less, <, mel_boolean) \
+    X(GREATER, greater, >, mel_boolean) \
+    X(LESS_EQUAL, less_equal, <=, mel_boolean) \
+    X(GREATER_EQUAL, greater_equal, >=, mel_boolean)
+
+#ifndef MEL_MAX_LOCALS
+#define MEL_MAX_LOCALS 256
+#endif
+
+typedef struct mel_local {
+    const char *name;
+    int length;
+    int slot;
+    // Some closure uses it, the slot holds a cell
+    bool captured;
+} mel_local_t;
+
+typedef struct mel_parser {
+    mel_vm_t *vm;
+    mel_lexer_t *lexer;
+    int line;
+    bool had_error;
+} mel_parser_t;
+
+typedef struct mel_compiler {
+    struct mel_compiler *enclosing;
+    mel_parser_t *parser;
+    mel_function_t *function;
+    mel_local_t locals[MEL_MAX_LOCALS];
+    int nlocals;
+    int height;
+    // Start of the last instruction and the latest jump target, an
+    // instruction can only be folded into the next one with no target
+    // in between
+    int last;
+    int label;
+} mel_compiler_t;
+
+static void compiler_init(mel_compiler_t *c, mel_parser_t *parser, mel_compiler_t *enclosing, mel_string_t *name) {
+    c->enclosing = enclosing;
+    c->parser = parser;
+    c->function = function_new(&parser->vm->allocator, name);
+    track_object(parser->vm, (mel_object_t*)c->function);
+    c->nlocals = 0;
+    c->last = -1;
+    c->label = 0;
+    // Slot 0 holds the function being called
+    c->height = c->function->slots = 1;
+}
+
+static void compile_error(mel_compiler_t *c, mel_token_t *token, const char *message) {
+    if (c->parser->had_error)
+        return;
+    c->parser->had_error = true;
+    fprintf(stderr, "[%d:%d] Error", token->line + 1, token->position + 1);
+    switch (token->type) {
+        case MEL_TOKEN_EOF:
+            fprintf(stderr, " at end");
+            break;
+        case MEL_TOKEN_ERROR:
+            break;
+        default:
+            fprintf(stderr, " at '%.*s'", token->length, token->cursor);
+            break;
+    }
+    fprintf(stderr, ": %s\n", message);
+}
+
+static inline mel_token_t* peek(mel_compiler_t *c) {
+    return &c->parser->lexer->current;
+}
+
+static inline bool check(mel_compiler_t *c, mel_token_type type) {
+    return peek(c)->type == type;
+}
+
+static mel_token_t advance(mel_compiler_t *c) {
+    mel_token_t token = lexer_consume(c->parser->lexer);
+    c->parser->line = token.line;
+    return token;
+}
+
+static bool expect(mel_compiler_t *c, mel_token_type type, const char *message) {
+    if (c->parser->had_error)
+        return false;
+    if (!check(c, type)) {
+        compile_error(c, peek(c), message);
+        return false;
+    }
+    advance(c);
+    return true;
+}
+
+static bool token_is_number(mel_token_t *token) {
+    return token->type == MEL_TOKEN_NUMBER;
+}
+
+static double token_number(mel_token_t *token) {
+    // Tokens aren't terminated, the source may end right after one
+    char buf[64];
+    int length = token->length < (int)sizeof(buf) - 1 ? token->length : (int)sizeof(buf) - 1;
+    memcpy(buf, token->cursor, length);
+    buf[length] = '\0';
+    return strtod(buf, NULL);
+}
+
+static void emit_byte(mel_compiler_t *c, unsigned char byte) {
+    garry_append(c->function->code, byte);
+    garry_append(c->function->lines, c->parser->line);
+}
+
+static void emit_op(mel_compiler_t *c, mel_opcode op) {
+    static const int effects[] = {
+#define X(_, EFFECT, __) EFFECT,
+        OPCODES
+#undef X
+    };
+    unsigned char *code = c->function->code;
+    // A value set and then dropped is stored straight away
+    if (op == MEL_OP_POP && c->last >= c->label && code[c->last] == MEL_OP_SET_LOCAL) {
+        code[c->last] = MEL_OP_STORE_LOCAL;
+        c->height--;
+        return;
+    }
+    c->last = garry_count(code);
+    emit_byte(c, (unsigned char)op);
+    c->height += effects[op];
+    if (c->height > c->function->slots)
+        c->function->slots = c->height;
+}
+
+static void emit_short(mel_compiler_t *c, int value) {
+    emit_byte(c, (value >> 8) & 0xFF);
+    emit_byte(c, value & 0xFF);
+}
+
+static int make_constant(mel_compiler_t *c, mel_value_t value) {
+    int count = garry_count(c->function->constants);
+    for (int i = 0; i < count; i++)
+        if (mel_equal(c->function->constants[i], value))
+            return i;
+    if (count > UINT16_MAX) {
+        compile_error(c, peek(c), "too many constants in one function");
+        return 0;
+    }
+    garry_append(c->function->constants, value);
+    return count;
+}
+
+// Literals are ordinary strings, symbols are never collected
+static int string_constant(mel_compiler_t *c, const char *chars, int length) {
+    int count = garry_count(c->function->constants);
+    for (int i = 0; i < count; i++) {
+        mel_value_t constant = c->function->constants[i];
+        if (!mel_is_string(constant))
+            continue;
+        mel_string_t *str = mel_as_string(constant);
+        if (str->length == length && !memcmp(str->chars, chars, length))
+            return i;
+    }
+    mel_string_t *str = string_new(&c->parser->vm->allocator, chars, length);
+    track_object(c->parser->vm, (mel_object_t*)str);
+    return make_constant(c, mel_obj(str));
+}
+
+static int symbol_constant(mel_compiler_t *c, const char *chars, int length) {
+    mel_string_t *symbol = mel_intern(c->parser->vm, chars, length);
+    int count = garry_count(c->function->constants);
+    for (int i = 0; i < count; i++)
+        if (mel_is_obj(c->function->constants[i]) && mel_as_obj(c->function->constants[i]) == symbol)
+            return i;
+    if (count > UINT16_MAX) {
+        compile_error(c, peek(c), "too many constants in one function");
+        return 0;
+    }
+    garry_append(c->function->constants, mel_obj(symbol));
+    return count;
+}
+
+static void emit_constant(mel_compiler_t *c, mel_value_t value) {
+    emit_op(c, MEL_OP_CONSTANT);
+    emit_short(c, make_constant(c, value));
+}
+
+static int emit_jump(mel_compiler_t *c, mel_opcode op) {
+    emit_op(c, op);
+    emit_short(c, 0xFFFF);
+    return garry_count(c->function->code) - 2;
+}
+
+static void patch_jump(mel_compiler_t *c, int offset) {
+    int jump = garry_count(c->function->code) - offset - 2;
+    if (jump > UINT16_MAX)
+        compile_error(c, peek(c), "too much code to jump over");
+    c->function->code[offset] = (jump >> 8) & 0xFF;
+    c->function->code[offset + 1] = jump & 0xFF;
+    c->label = garry_count(c->function->code);
+}
+
+static void emit_loop(mel_compiler_t *c, int start) {
+    emit_op(c, MEL_OP_LOOP);
+    int offset = garry_count(c->function->code) - start + 2;
+    if (offset > UINT16_MAX)
+        compile_error(c, peek(c), "loop body too large");
+    emit_short(c, offset);
+}
+
+static inline bool local_is(mel_local_t *local, mel_token_t *name) {
+    return local->length == name->length && !memcmp(local->name, name->cursor, name->length);
+}
+
+static mel_local_t* find_local(mel_compiler_t *c, mel_token_t *name) {
+    for (int i = c->nlocals - 1; i >= 0; i--)
+        if (local_is(&c->locals[i], name))
+            return &c->locals[i];
+    return NULL;
+}
+
+static bool find_enclosing(mel_compiler_t *c, mel_token_t *name) {
+    for (mel_compiler_t *e = c->enclosing; e; e = e->enclosing)
+        if (find_local(e, name))
+            return true;
+    return false;
+}
+
+static int add_upvalue(mel_compiler_t *c, mel_token_t *name, bool local, int index) {
+    mel_upvalue_t *upvalues = c->function->upvalues;
+    int count = garry_count(upvalues);
+    for (int i = 0; i < count; i++)
+        if (upvalues[i].local == local && upvalues[i].index == index)
+            return i;
+    if (count > UINT8_MAX) {
+        compile_error(c, name, "too many captured variables in function");
+        return 0;
+    }
+    garry_append(c->function->upvalues, ((mel_upvalue_t) {
+        .local = local,
+        .index = (uint8_t)index
+    }));
+    return count;
+}
+
+// Captures go through every function in between, each one passes the
+// cell down from its own closure
+static int find_upvalue(mel_compiler_t *c, mel_token_t *name) {
+    if (!c->enclosing)
+        return -1;
+    mel_local_t *local = find_local(c->enclosing, name);
+    if (local) {
+        assert(local->captured);
+        return add_upvalue(c, name, true, local->slot);
+    }
+    int upvalue = find_upvalue(c->enclosing, name);
+    return upvalue < 0 ? -1 : add_upvalue(c, name, false, upvalue);
+}
+
+// Reads ahead to the end of the scope and marks the locals whose names
+// turn up inside a lambda or defun there. Shadowing is ignored, at worst a
+// variable is boxed that didn't need to be. outer is how many enclosing
+// forms the scope still runs on through
+static void scan_captures(mel_compiler_t *c, mel_local_t *locals, int count, int outer) {
+    if (!count)
+        return;
+    mel_lexer_t lexer = *c->parser->lexer;
+    int depth = 0, inner = 0;
+    bool nested = false, open = false;
+    for (;;) {
+        mel_token_t token = lexer_consume(&lexer);
+        switch (token.type) {
+            case MEL_TOKEN_LPAREN:
+            case MEL_TOKEN_SQR_LPAREN:
+            case MEL_TOKEN_CRL_LPAREN:
+                depth++;
+                break;
+            case MEL_TOKEN_RPAREN:
+            case MEL_TOKEN_SQR_RPAREN:
+            case MEL_TOKEN_CRL_RPAREN:
+                if (--depth < -outer)
+                    return;
+                if (depth < inner)
+                    nested = false;
+                break;
+            case MEL_TOKEN_EOF:
+            case MEL_TOKEN_ERROR:
+                return;
+            default:
+                // Nothing was read, the next token would be the same
+                if (!token.length)
+                    return;
+                if (nested) {
+                    for (int i = 0; i < count; i++)
+                        if (local_is(&locals[i], &token))
+                            locals[i].captured = true;
+                } else if (open && (token.type == MEL_TOKEN_LAMBDA || token.type == MEL_TOKEN_DEFUN)) {
+                    nested = true;
+                    inner = depth;
+                }
+                break;
+        }
+        open = token.type == MEL_TOKEN_LPAREN;
+    }
+}
+
+static bool check_variable(mel_compiler_t *c, mel_token_t *name) {
+    if (!token_is_atom(name->type) || !name->length || token_is_number(name)) {
+        compile_error(c, name, "expected variable name");
+        return false;
+    }
+    if (name->type == MEL_TOKEN_NIL || name->type == MEL_TOKEN_T) {
+        compile_error(c, name, "cannot bind a constant");
+        return false;
+    }
+    return true;
+}
+
+static void declare_local(mel_compiler_t *c, mel_token_t *name, int slot) {
+    if (!check_variable(c, name))
+        return;
+    if (c->nlocals == MEL_MAX_LOCALS || slot > UINT8_MAX) {
+        compile_error(c, name, "too many local variables in function");
+        return;
+    }
+    mel_local_t *local = &c->locals[c->nlocals++];
+    local->name = name->cursor;
+    local->length = name->length;
+    local->slot = slot;
+    local->captured = false;
+}
+
+// Moves the captured ones among the locals declared since from into cells
+static void box_locals(mel_compiler_t *c, int from, int outer) {
+    scan_captures(c, &c->locals[from], c->nlocals - from, outer);
+    for (int i = from; i < c->nlocals; i++)
+        if (c->locals[i].captured) {
+            emit_op(c, MEL_OP_BOX);
+            emit_byte(c, c->locals[i].slot);
+        }
+}
+
+static void emit_global(mel_compiler_t *c, mel_token_t *name, bool set) {
+    int slot = mel_global_slot(c->parser->vm, name->cursor, name->length);
+    if (slot > UINT16_MAX) {
+        compile_error(c, name, "too many global variables");
+        return;
+    }
+    emit_op(c, set ? MEL_OP_SET_GLOBAL : MEL_OP_GET_GLOBAL);
+    emit_short(c, slot);
+}
+
+static void emit_variable(mel_compiler_t *c, mel_token_t *name, bool set) {
+    mel_local_t *local = find_local(c, name);
+    int upvalue;
+    if (local) {
+        if (local->captured)
+            emit_op(c, set ? MEL_OP_SET_CELL : MEL_OP_GET_CELL);
+        else
+            emit_op(c, set ? MEL_OP_SET_LOCAL : MEL_OP_GET_LOCAL);
+        emit_byte(c, local->slot);
+    } else if ((upvalue = find_upvalue(c, name)) >= 0) {
+        emit_op(c, set ? MEL_OP_SET_UPVALUE : MEL_OP_GET_UPVALUE);
+        emit_byte(c, upvalue);
+    } else
+        emit_global(c, name, set);
+}
+
+static void compile_expr(mel_compiler_t *c);
+
+static void compile_body(mel_compiler_t *c) {
+    if (check(c, MEL_TOKEN_RPAREN))
+        emit_op(c, MEL_OP_NIL);
+    else
+        for (;;) {
+            compile_expr(c);
+            if (c->parser->had_error || check(c, MEL_TOKEN_RPAREN))
+                break;
+            emit_op(c, MEL_OP_POP);
+        }
+    expect(c, MEL_TOKEN_RPAREN, "expected ')' after body");
+}
+
+static void compile_setq(mel_compiler_t *c) {
+    int pairs = 0;
+    while (!check(c, MEL_TOKEN_RPAREN) && !c->parser->had_error) {
+        mel_token_t name = advance(c);
+        if (!check_variable(c, &name))
+            return;
+        if (pairs++)
+            emit_op(c, MEL_OP_POP);
+        if (check(c, MEL_TOKEN_RPAREN)) {
+            compile_error(c, peek(c), "odd number of arguments to setq");
+            return;
+        }
+        compile_expr(c);
+        emit_variable(c, &name, true);
+    }
+    if (expect(c, MEL_TOKEN_RPAREN, "expected ')' after setq") && !pairs)
+        emit_op(c, MEL_OP_NIL);
+}
+
+static void compile_if(mel_compiler_t *c) {
+    compile_expr(c);
+    int else_jump = emit_jump(c, MEL_OP_JUMP_IF_FALSE);
+    compile_expr(c);
+    int end_jump = emit_jump(c, MEL_OP_JUMP);
+    patch_jump(c, else_jump);
+    c->height--;
+    if (check(c, MEL_TOKEN_RPAREN))
+        emit_op(c, MEL_OP_NIL);
+    else
+        compile_expr(c);
+    patch_jump(c, end_jump);
+    expect(c, MEL_TOKEN_RPAREN, "expected ')' after if");
+}
+
+static void compile_progn(mel_compiler_t *c) {
+    compile_body(c);
+}
+
+static void compile_let(mel_compiler_t *c, bool sequential) {
+    int height = c->height;
+    int nlocals = c->nlocals;
+    mel_token_t names[MEL_MAX_LOCALS];
+    int count = 0;
+    if (!expect(c, MEL_TOKEN_LPAREN, "expected binding list"))
+        return;
+    while (!check(c, MEL_TOKEN_RPAREN) && !c->parser->had_error) {
+        mel_token_t name;
+        if (token_is_atom(peek(c)->type)) {
+            name = advance(c);
+            emit_op(c, MEL_OP_NIL);
+        } else {
+            if (!expect(c, MEL_TOKEN_LPAREN, "expected binding"))
+                return;
+            name = advance(c);
+            if (check(c, MEL_TOKEN_RPAREN))
+                emit_op(c, MEL_OP_NIL);
+            else
+                compile_expr(c);
+            expect(c, MEL_TOKEN_RPAREN, "expected ')' after binding");
+        }
+        if (sequential) {
+            int from = c->nlocals;
+            declare_local(c, &name, c->height - 1);
+            // The rest of the bindings and then the body
+            box_locals(c, from, 1);
+        } else if (count == MEL_MAX_LOCALS) {
+            compile_error(c, &name, "too many bindings");
+            return;
+        } else
+            names[count++] = name;
+    }
+    if (!expect(c, MEL_TOKEN_RPAREN, "expected ')' after bindings"))
+        return;
+    for (int i = 0; i < count; i++)
+        declare_local(c, &names[i], height + i);
+    if (!sequential)
+        box_locals(c, nlocals, 0);
+    compile_body(c);
+    int n = c->height - 1 - height;
+    if (n > 0) {
+        emit_op(c, MEL_OP_LEAVE);
+        emit_byte(c, n);
+        c->height -= n;
+    }
+    c->nlocals = nlocals;
+}
+
+static void compile_let_parallel(mel_compiler_t *c) {
+    compile_let(c, false);
+}
+
+static void compile_let_sequential(mel_compiler_t *c) {
+    compile_let(c, true);
+}
+
+// A call whose result goes straight to RETURN, through jumps and LEAVEs,
+// doesn't need the caller's frame any more. Top-level code is left alone,
+// it never recurses and keeps its line in error traces
+static void mark_tail_calls(mel_function_t *function) {
+    static const int operands[] = {
+#define X(_, __, OPERANDS) OPERANDS,
+        OPCODES
+#undef X
+    };
+    unsigned char *code = function->code;
+    for (int i = 0; i < garry_count(code); i += 1 + operands[code[i]]) {
+        if (code[i] != MEL_OP_CALL && code[i] != MEL_OP_SEND)
+            continue;
+        int j = i + 1 + operands[code[i]];
+        for (;;)
+            if (code[j] == MEL_OP_JUMP)
+                j += 3 + ((code[j + 1] << 8) | code[j + 2]);
+            else if (code[j] == MEL_OP_LEAVE)
+                j += 2;
+            else
+                break;
+        if (code[j] == MEL_OP_RETURN)
+            code[i] = code[i] == MEL_OP_CALL ? MEL_OP_TAIL_CALL : MEL_OP_TAIL_SEND;
+    }
+}
+
+static void compile_function(mel_compiler_t *c, mel_token_t *name) {
+    mel_string_t *fname = NULL;
+    if (name)
+        fname = mel_intern(c->parser->vm, name->cursor, name->length);
+    mel_compiler_t fc;
+    compiler_init(&fc, c->parser, c, fname);
+    if (!expect(c, MEL_TOKEN_LPAREN, "expected parameter list"))
+        return;
+    while (token_is_atom(peek(c)->type) && !c->parser->had_error) {
+        mel_token_t param = advance(c);
+        if (fc.function->arity == UINT8_MAX) {
+            compile_error(c, &param, "too many parameters");
+            return;
+        }
+        declare_local(&fc, &param, fc.height++);
+        fc.function->arity++;
+    }
+    if (!expect(c, MEL_TOKEN_RPAREN, "expected ')' after parameters"))
+        return;
+    fc.function->slots = fc.height;
+    box_locals(&fc, 0, 0);
+    compile_body(&fc);
+    emit_op(&fc, MEL_OP_RETURN);
+    mark_tail_calls(fc.function);
+    if (garry_count(fc.function->upvalues)) {
+        emit_op(c, MEL_OP_CLOSURE);
+        emit_short(c, make_constant(c, mel_obj(fc.function)));
+    } else
+        emit_constant(c, mel_obj(fc.function));
+}
+
+static void compile_lambda(mel_compiler_t *c) {
+    compile_function(c, NULL);
+}
+
+static void compile_defun(mel_compiler_t *c) {
+    mel_token_t name = advance(c);
+    if (!check_variable(c, &name))
+        return;
+    compile_function(c, &name);
+    emit_global(c, &name, true);
+}
+
+static void compile_while(mel_compiler_t *c) {
+    int start = garry_count(c->function->code);
+    compile_expr(c);
+    int exit_jump = emit_jump(c, MEL_OP_JUMP_IF_FALSE);
+    while (!check(c, MEL_TOKEN_RPAREN) && !check(c, MEL_TOKEN_EOF) && !c->parser->had_error) {
+        compile_expr(c);
+        emit_op(c, MEL_OP_POP);
+    }
+    emit_loop(c, start);
+    patch_jump(c, exit_jump);
+    if (expect(c, MEL_TOKEN_RPAREN, "expected ')' after while"))
+        emit_op(c, MEL_OP_NIL);
+}
+
+static void compile_logical(mel_compiler_t *c, mel_opcode op, mel_opcode empty) {
+    if (check(c, MEL_TOKEN_RPAREN)) {
+        advance(c);
+        emit_op(c, empty);
+        return;
+    }
+    int *jumps;
+    garry_with(jumps, &c->parser->vm->allocator);
+    compile_expr(c);
+    while (!check(c, MEL_TOKEN_RPAREN) && !check(c, MEL_TOKEN_EOF) && !c->parser->had_error) {
+        garry_append(jumps, emit_jump(c, op));
+        compile_expr(c);
+    }
+    for (int i = 0; i < garry_count(jumps); i++)
+        patch_jump(c, jumps[i]);
+    garry_free(jumps);
+    expect(c, MEL_TOKEN_RPAREN, "expected ')'");
+}
+
+// (send object name args...) calls the method name found in the metatables
+// of object with object as the first argument. A nil is pushed first for
+// the method to go in, and each send gets its own cache
+static void compile_send(mel_compiler_t *c) {
+    emit_op(c, MEL_OP_NIL);
+    compile_expr(c);
+    mel_token_t name = advance(c);
+    if (!check_variable(c, &name))
+        return;
+    int argc = 1;
+    while (!check(c, MEL_TOKEN_RPAREN) && !check(c, MEL_TOKEN_EOF) && !c->parser->had_error) {
+        compile_expr(c);
+        argc++;
+    }
+    if (!expect(c, MEL_TOKEN_RPAREN, "expected ')' after arguments"))
+        return;
+    int cache = garry_count(c->function->caches);
+    if (argc > UINT8_MAX || cache > UINT16_MAX) {
+        compile_error(c, &name, argc > UINT8_MAX ? "too many arguments" : "too many sends in one function");
+        return;
+    }
+    garry_append(c->function->caches, (mel_cache_t) {0});
+    emit_op(c, MEL_OP_SEND);
+    emit_short(c, symbol_constant(c, name.cursor, name.length));
+    emit_byte(c, argc);
+    emit_short(c, cache);
+    c->height -= argc;
+}
+
+static void compile_and(mel_compiler_t *c) {
+    compile_logical(c, MEL_OP_JUMP_IF_FALSE_OR_POP, MEL_OP_TRUE);
+}
+
+static void compile_or(mel_compiler_t *c) {
+    compile_logical(c, MEL_OP_JUMP_IF_TRUE_OR_POP, MEL_OP_NIL);
+}
+
+#define SPECIAL_FORMS \
+    X(SETQ, compile_setq) \
+    X(IF, compile_if) \
+    X(PROGN, compile_progn) \
+    X(LET, compile_let_parallel) \
+    X(LET_STAR, compile_let_sequential) \
+    X(LAMBDA, compile_lambda) \
+    X(DEFUN, compile_defun) \
+    X(WHILE, compile_while) \
+    X(AND, compile_and) \
+    X(OR, compile_or) \
+    X(SEND, compile_send)
+
+#define PRIMITIVES \
+    X(ADD, MEL_OP_ADD, 0, -1) \
+    X(SUB, MEL_OP_SUB, 1, -1) \
+    X(MUL, MEL_OP_MUL, 0, -1) \
+    X(DIV, MEL_OP_DIV, 2, -1) \
+    X(EQUAL, MEL_OP_EQUAL, 2, 2) \
+    X(LESS, MEL_OP_LESS, 2, 2) \
+    X(GREATER, MEL_OP_GREATER, 2, 2) \
+    X(LESS_EQUAL, MEL_OP_LESS_EQUAL, 2, 2) \
+    X(GREATER_EQUAL, MEL_OP_GREATER_EQUAL, 2, 2) \
+    X(NOT, MEL_OP_NOT, 1, 1)
+
+static mel_opcode fused_op(mel_opcode op, mel_opcode operand) {
+    switch (op) {
+#define X(OP, ...) \
+        case MEL_OP_##OP: \
+            return operand == MEL_OP_GET_LOCAL ? MEL_OP_##OP##_LOCAL : MEL_OP_##OP##_CONSTANT;
+        FUSED_OPS
+#undef X
+        default:
+            return op;
+    }
+}
+
+// A right operand that is only a local or a number is folded into the
+// operator, which then reads it in place instead of from the stack
+static void emit_binary(mel_compiler_t *c, mel_opcode op) {
+    unsigned char *code = c->function->code;
+    if (c->last >= c->label) {
+        mel_opcode operand = code[c->last];
+        if (operand == MEL_OP_GET_LOCAL || (operand == MEL_OP_CONSTANT &&
+            mel_is_number(c->function->constants[(code[c->last + 1] << 8) | code[c->last + 2]]))) {
+            mel_opcode fused = fused_op(op, operand);
+            if (fused != op) {
+                code[c->last] = fused;
+                c->height--;
+                return;
+            }
+        }
+    }
+    emit_op(c, op);
+}
+
+static void compile_primitive(mel_compiler_t *c, mel_token_t *name, mel_opcode op, int min, int max) {
+    int argc = 0;
+    while (!check(c, MEL_TOKEN_RPAREN) && !check(c, MEL_TOKEN_EOF) && !c->parser->had_error) {
+        compile_expr(c);
+        if (++argc > 1)
+            emit_binary(c, op);
+    }
+    if (!expect(c, MEL_TOKEN_RPAREN, "expected ')' after arguments"))
+        return;
+    if (argc < min || (max >= 0 && argc > max))
+        compile_error(c, name, "wrong number of arguments");
+    else if (!argc)
+        emit_constant(c, mel_number(op == MEL_OP_MUL ? 1 : 0));
+    else if (argc == 1 && op == MEL_OP_SUB)
+        emit_op(c, MEL_OP_NEGATE);
+    else if (argc == 1 && op == MEL_OP_NOT)
+        emit_op(c, MEL_OP_NOT);
+}
+
+static bool compile_special(mel_compiler_t *c, mel_token_t *head) {
+    if (head->type < MEL_TOKEN_KEYWORD || find_local(c, head) || find_enclosing(c, head))
+        return false;
+    switch (head->type) {
+#define X(KIND, FN) \
+        case MEL_TOKEN_##KIND: \
+            advance(c); \
+            FN(c); \
+            return true;
+        SPECIAL_FORMS
+#undef X
+#define X(KIND, OP, MIN, MAX) \
+        case MEL_TOKEN_##KIND: { \
+            mel_token_t name = advance(c); \
+            compile_primitive(c, &name, OP, MIN, MAX); \
+            return true; \
+        }
+        PRIMITIVES
+#undef X
+        default:
+            return false;
+    }
+}
+
+static void compile_call(mel_compiler_t *c) {
+    compile_expr(c);
+    int argc = 0;
+    while (!check(c, MEL_TOKEN_RPAREN) && !check(c, MEL_TOKEN_EOF) && !c->parser->had_error) {
+        compile_expr(c);
+        argc++;
+    }
+    if (!expect(c, MEL_TOKEN_RPAREN, "expected ')' after arguments"))
+        return;
+    if (argc > UINT8_MAX) {
+        compile_error(c, peek(c), "too many arguments");
+        return;
+    }
+    emit_op(c, MEL_OP_CALL);
+    emit_byte(c, argc);
+    c->height -= argc;
+}
+
+static void compile_list(mel_compiler_t *c) {
+    mel_token_t *head = peek(c);
+    if (head->type == MEL_TOKEN_RPAREN) {
+        advance(c);
+        emit_op(c, MEL_OP_NIL);
+    } else if (!compile_special(c, head))
+        compile_call(c);
+}
+
+static void compile_array(mel_compiler_t *c) {
+    int count = 0;
+    while (!check(c, MEL_TOKEN_SQR_RPAREN) && !check(c, MEL_TOKEN_EOF) && !c->parser->had_error) {
+        compile_expr(c);
+        count++;
+    }
+    if (!expect(c, MEL_TOKEN_SQR_RPAREN, "expected ']' after elements"))
+        return;
+    if (count > UINT16_MAX) {
+        compile_error(c, peek(c), "too many elements");
+        return;
+    }
+    emit_op(c, MEL_OP_ARRAY);
+    emit_short(c, count);
+    c->height -= count;
+}
+
+static void compile_table(mel_compiler_t *c) {
+    int count = 0;
+    while (!check(c, MEL_TOKEN_CRL_RPAREN) && !check(c, MEL_TOKEN_EOF) && !c->parser->had_error) {
+        // Literal keys are interned, the table can keep them as they are
+        if (count % 2 == 0 && check(c, MEL_TOKEN_STRING)) {
+            mel_token_t token = advance(c);
+            emit_op(c, MEL_OP_CONSTANT);
+            emit_short(c, symbol_constant(c, token.cursor, token.length));
+        } else
+            compile_expr(c);
+        count++;
+    }
+    if (!expect(c, MEL_TOKEN_CRL_RPAREN, "expected '}' after entries"))
+        return;
+    if (count % 2) {
+        compile_error(c, peek(c), "expected a value for every key");
+        return;
+    }
+    if (count > UINT16_MAX) {
+        compile_error(c, peek(c), "too many entries");
+        return;
+    }
+    emit_op(c, MEL_OP_TABLE);
+    emit_short(c, count);
+    c->height -= count;
+}
+
+static void compile_atom(mel_compiler_t *c, mel_token_t *token) {
+    if (!token->length)
+        compile_error(c, token, "unexpected character");
+    else if (token->type == MEL_TOKEN_NIL)
+        emit_op(c, MEL_OP_NIL);
+    else if (token->type == MEL_TOKEN_T)
+        emit_op(c, MEL_OP_TRUE);
+    else if (token_is_number(token))
+        emit_constant(c, mel_number(token_number(token)));
+    else
+        emit_variable(c, token, false);
+}
+
+static void compile_expr(mel_compiler_t *c) {
+    if (c->parser->had_error)
+        return;
+    mel_token_t token = advance(c);
+    switch (token.type) {
+        case MEL_TOKEN_NUMBER:
+            emit_constant(c, mel_number(token_number(&token)));
+            break;
+        case MEL_TOKEN_STRING:
+            emit_op(c, MEL_OP_CONSTANT);
+            emit_short(c, string_constant(c, token.cursor, token.length));
+            break;
+        case MEL_TOKEN_LPAREN:
+            compile_list(c);
+            break;
+        case MEL_TOKEN_SQR_LPAREN:
+            compile_array(c);
+            break;
+        case MEL_TOKEN_CRL_LPAREN:
+            compile_table(c);
+            break;
+        case MEL_TOKEN_ERROR:
+            if (*token.cursor == '"')
+                compile_error(c, &token, "unterminated string");
+            else
+                compile_error(c, &token, token.length ? "malformed number" : "unexpected character");
+            break;
+        case MEL_TOKEN_EOF:
+            compile_error(c, &token, "unexpected end of input");
+            break;
+        default:
+            if (token_is_atom(token.type))
+                compile_atom(c, &token);
+            else
+                compile_error(c, &token, "unexpected token");
+            break;
+    }
+}
+
+static mel_function_t* compile(mel_parser_t *parser) {
+    mel_compiler_t c;
+    compiler_init(&c, parser, NULL, NULL);
+    compile_expr(&c);
+    emit_op(&c, MEL_OP_RETURN);
+    return parser->had_error ? NULL : c.function;
+}
@@ -0,0 +1,515 @@
+// Incremental mark-sweep. Objects are marked with the current epoch, so
+// nothing has to be cleared between cycles, and each step does at most
+// gc.budget units of work before handing back to the mutator. Steps only
+// run at safe points (calls, which includes starting each top-level form,
+// and loop back-edges), where every live value is reachable from the roots
+//
+// Strings and tables made at run time are bump allocated in a nursery
+// first. A minor collection copies the survivors out into the tracked heap
+// and throws the rest of the nursery away. Young objects count as marked
+// for the major collector, and the nursery is emptied before a cycle starts
+// and before it sweeps
+enum {
+    MEL_GC_IDLE,
+    MEL_GC_MARK,
+    MEL_GC_SWEEP
+};
+
+static void gc_init(mel_vm_t *vm) {
+    vm->gc.state = MEL_GC_IDLE;
+    vm->gc.epoch = 1;
+    vm->gc.budget = MEL_GC_BUDGET;
+    vm->gc.pause = MEL_GC_PAUSE;
+    vm->gc.threshold = MEL_GC_MIN;
+    garry_with(vm->gc.gray, &vm->allocator);
+    garry_with(vm->gc.roots, &vm->allocator);
+    garry_with(vm->gc.ranges, &vm->allocator);
+    garry_with(vm->gc.remembered, &vm->allocator);
+    garry_with(vm->gc.promoted, &vm->allocator);
+#if MEL_GC_NURSERY
+    if ((vm->gc.nursery = mem_alloc(&vm->allocator, MEL_GC_NURSERY))) {
+        vm->gc.top = vm->gc.nursery;
+        vm->gc.end = vm->gc.nursery + MEL_GC_NURSERY;
+    }
+#endif
+}
+
+#define NURSERY_ALIGN(SIZE) (((SIZE) + 7) & ~(size_t)7)
+
+// Only the part of the nursery in use counts
+static inline bool gc_young(mel_vm_t *vm, mel_object_t *obj) {
+    return (uintptr_t)obj - (uintptr_t)vm->gc.nursery < (uintptr_t)(vm->gc.top - vm->gc.nursery);
+}
+
+static inline bool gc_young_value(mel_vm_t *vm, mel_value_t value) {
+    return mel_is_obj(value) && gc_young(vm, mel_as_obj(value));
+}
+
+// Returns NULL when the object doesn't fit, the caller allocates it in the
+// heap instead and the nursery is collected at the next safe point
+static void* nursery_alloc(mel_vm_t *vm, size_t size) {
+    size = NURSERY_ALIGN(size);
+    if (size > (size_t)(vm->gc.end - vm->gc.top)) {
+        vm->gc.full = vm->gc.top != vm->gc.nursery;
+        return NULL;
+    }
+    void *result = vm->gc.top;
+    vm->gc.top += size;
+    return result;
+}
+
+static size_t young_size(mel_object_t *obj) {
+    if (obj->type == MEL_OBJECT_STRING)
+        return NURSERY_ALIGN(string_size(((mel_string_t*)obj)->length));
+    return NURSERY_ALIGN(table_size());
+}
+
+// Frees whatever young objects were not copied out, a forwarded object
+// has its copy in next
+static void nursery_release(mel_vm_t *vm) {
+    for (char *p = vm->gc.nursery; p < vm->gc.top;) {
+        mel_object_t *obj = (mel_object_t*)p;
+        p += young_size(obj);
+        // Send caches compare metatables by address
+        if (obj->type == MEL_OBJECT_TABLE && ((mel_table_t*)obj)->ismeta)
+            vm->meta_version++;
+        if (obj->next)
+            continue;
+        if (obj->type == MEL_OBJECT_STRING)
+            mem_free(&vm->allocator, ((mel_string_t*)obj)->wide);
+        else {
+            free_table_keys((mel_table_t*)obj, false);
+            table_discard((mel_table_t*)obj);
+        }
+    }
+    vm->gc.top = vm->gc.nursery;
+    vm->gc.full = false;
+}
+
+static void gc_free(mel_vm_t *vm) {
+    nursery_release(vm);
+    mem_free(&vm->allocator, vm->gc.nursery);
+    garry_free(vm->gc.gray);
+    garry_free(vm->gc.roots);
+    garry_free(vm->gc.ranges);
+    garry_free(vm->gc.remembered);
+    garry_free(vm->gc.promoted);
+}
+
+static void track_object(mel_vm_t *vm, mel_object_t *obj) {
+    obj->next = vm->objects;
+    obj->mark = vm->gc.epoch;
+    vm->objects = obj;
+    vm->gc.count++;
+}
+
+static inline bool gc_marked(mel_vm_t *vm, mel_object_t *obj) {
+    return obj->mark == vm->gc.epoch || gc_young(vm, obj);
+}
+
+static void gc_mark_object(mel_vm_t *vm, mel_object_t *obj) {
+    if (gc_marked(vm, obj))
+        return;
+    obj->mark = vm->gc.epoch;
+    // Strings and ropes hold no references, there is nothing to scan
+    if (obj->type != MEL_OBJECT_STRING && obj->type != MEL_OBJECT_ROPE)
+        garry_append(vm->gc.gray, obj);
+}
+
+static inline void gc_mark_value(mel_vm_t *vm, mel_value_t value) {
+    if (mel_is_obj(value))
+        gc_mark_object(vm, mel_as_obj(value));
+}
+
+static void gc_mark_values(mel_vm_t *vm, mel_value_t *values, int count) {
+    for (int i = 0; i < count; i++)
+        gc_mark_value(vm, values[i]);
+}
+
+static void gc_mark_roots(mel_vm_t *vm) {
+    for (mel_segment_t *segment = vm->stack.segment; segment; segment = segment->prev)
+        gc_mark_values(vm, segment->values, segment_count(vm, segment));
+    // A frame's closure is its callee, which is on the stack already
+    for (int i = 0; i < garry_count(vm->frames); i++)
+        gc_mark_object(vm, (mel_object_t*)vm->frames[i].function);
+    for (int i = 0; i < garry_count(vm->gc.roots); i++)
+        gc_mark_value(vm, *vm->gc.roots[i]);
+    for (int i = 0; i < garry_count(vm->gc.ranges); i++)
+        gc_mark_values(vm, vm->gc.ranges[i].values, vm->gc.ranges[i].count);
+    gc_mark_value(vm, vm->current);
+    gc_mark_value(vm, vm->previous);
+    gc_mark_values(vm, vm->tail, garry_count(vm->tail));
+    gc_mark_object(vm, (mel_object_t*)vm->globals);
+    for (int i = 0; i < garry_count(vm->global_slots); i++)
+        gc_mark_value(vm, vm->global_slots[i].value);
+}
+
+// Scans obj until it is done or *work reaches limit. Tables resume from
+// gc.cursor, which runs over the array part and then the hash part.
+// Everything else is scanned in one go
+static bool gc_scan(mel_vm_t *vm, mel_object_t *obj, size_t *work, size_t limit) {
+    switch (obj->type) {
+        case MEL_OBJECT_TABLE: {
+            mel_table_t *table = (mel_table_t*)obj;
+            if (table->meta)
+                gc_mark_object(vm, &table->meta->obj);
+            while (*work < limit) {
+                if (vm->gc.cursor < table->asize) {
+                    gc_mark_value(vm, table->array[vm->gc.cursor++]);
+                    *work += 1;
+                    continue;
+                }
+                size_t from = vm->gc.cursor - table->asize, i = from;
+                struct entry *item = table_next(table, &i);
+                vm->gc.cursor = table->asize + i;
+                *work += i - from;
+                if (!item)
+                    return true;
+                gc_mark_value(vm, item->key);
+                gc_mark_value(vm, item->value);
+            }
+            return false;
+        }
+        case MEL_OBJECT_FUNCTION: {
+            mel_function_t *function = (mel_function_t*)obj;
+            if (function->name)
+                gc_mark_object(vm, (mel_object_t*)function->name);
+            gc_mark_values(vm, function->constants, garry_count(function->constants));
+            *work += 1 + garry_count(function->constants);
+            return true;
+        }
+        case MEL_OBJECT_NATIVE: {
+            mel_native_t *native = (mel_native_t*)obj;
+            gc_mark_values(vm, native->constants, native->nconstants);
+            *work += 1 + native->nconstants;
+            return true;
+        }
+        case MEL_OBJECT_ARRAY: {
+            mel_array_t *array = (mel_array_t*)obj;
+            if (!array->packed)
+                gc_mark_values(vm, array->values, array->count);
+            *work += 1 + (array->packed ? 0 : array->count);
+            return true;
+        }
+        case MEL_OBJECT_CELL:
+            gc_mark_value(vm, ((mel_cell_t*)obj)->value);
+            *work += 1;
+            return true;
+        case MEL_OBJECT_CLOSURE: {
+            mel_closure_t *closure = (mel_closure_t*)obj;
+            gc_mark_object(vm, &closure->function->obj);
+            for (int i = 0; i < closure->ncells; i++)
+                gc_mark_object(vm, &closure->cells[i]->obj);
+            *work += 1 + closure->ncells;
+            return true;
+        }
+        default:
+            *work += 1;
+            return true;
+    }
+}
+
+static bool gc_propagate(mel_vm_t *vm, size_t *work, size_t limit) {
+    if (vm->gc.partial) {
+        if (!gc_scan(vm, vm->gc.partial, work, limit))
+            return false;
+        vm->gc.partial = NULL;
+    }
+    while (garry_count(vm->gc.gray)) {
+        if (*work >= limit)
+            return false;
+        mel_object_t *obj = vm->gc.gray[garry_count(vm->gc.gray) - 1];
+        garry_pop(vm->gc.gray);
+        vm->gc.cursor = 0;
+        if (!gc_scan(vm, obj, work, limit)) {
+            vm->gc.partial = obj;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Called before a table is written to or its entries are moved
+static void gc_table_write(mel_table_t *table, mel_value_t value) {
+    mel_vm_t *vm = table->vm;
+    if (!vm)
+        return;
+    if (!table->remembered && gc_young_value(vm, value) && !gc_young(vm, &table->obj)) {
+        table->remembered = true;
+        garry_append(vm->gc.remembered, &table->obj);
+    }
+    if (vm->gc.state != MEL_GC_MARK || !gc_marked(vm, &table->obj))
+        return;
+    // A half scanned table is finished first, its entries may be about to
+    // move behind the cursor
+    if (vm->gc.partial == &table->obj) {
+        size_t work = 0;
+        gc_scan(vm, vm->gc.partial, &work, SIZE_MAX);
+        vm->gc.partial = NULL;
+    }
+    gc_mark_value(vm, value);
+}
+
+// Arrays are never young and are scanned in one go, so only the value has
+// to be looked at
+static void gc_array_write(mel_array_t *array, mel_value_t value) {
+    mel_vm_t *vm = array->vm;
+    if (!array->remembered && gc_young_value(vm, value)) {
+        array->remembered = true;
+        garry_append(vm->gc.remembered, &array->obj);
+    }
+    if (vm->gc.state == MEL_GC_MARK && gc_marked(vm, &array->obj))
+        gc_mark_value(vm, value);
+}
+
+// Cells are never young either, closures only point at cells and functions
+// so they need no barrier at all
+static void gc_cell_write(mel_vm_t *vm, mel_cell_t *cell, mel_value_t value) {
+    if (!cell->remembered && gc_young_value(vm, value)) {
+        cell->remembered = true;
+        garry_append(vm->gc.remembered, &cell->obj);
+    }
+    if (vm->gc.state == MEL_GC_MARK && gc_marked(vm, &cell->obj))
+        gc_mark_value(vm, value);
+}
+
+// Copies a survivor out of the nursery and leaves a forwarding pointer in
+// its next field. The copy is tracked, and so marked if a cycle is running
+static mel_object_t* gc_promote(mel_vm_t *vm, mel_object_t *obj) {
+    mel_object_t *copy;
+    if (obj->type == MEL_OBJECT_STRING) {
+        size_t size = string_size(((mel_string_t*)obj)->length);
+        copy = mem_alloc(&vm->allocator, size);
+        memcpy(copy, obj, size);
+    } else {
+        copy = mem_alloc(&vm->allocator, table_size());
+        memcpy(copy, obj, table_size());
+        table_relocate((mel_table_t*)copy);
+        // Its values may still be young
+        garry_append(vm->gc.promoted, copy);
+    }
+    obj->next = copy;
+    track_object(vm, copy);
+    return copy;
+}
+
+static void gc_evacuate(mel_vm_t *vm, mel_value_t *slot) {
+    if (!gc_young_value(vm, *slot))
+        return;
+    mel_object_t *obj = mel_as_obj(*slot);
+    *slot = mel_obj(obj->next ? obj->next : gc_promote(vm, obj));
+}
+
+static void gc_evacuate_values(mel_vm_t *vm, mel_value_t *values, int count) {
+    for (int i = 0; i < count; i++)
+        gc_evacuate(vm, &values[i]);
+}
+
+// Keys other than strings hash by address, so young ones are taken out and
+// put back under the address they move to
+static void gc_rekey_table(mel_vm_t *vm, mel_table_t *table) {
+    gc_table_write(table, mel_nil());
+#ifdef MEL_TABLE_ORDERED
+    // Taking entries out would lose their place in the order
+    size_t i = 0;
+    struct entry *item;
+    while ((item = table_next(table, &i)))
+        gc_evacuate(vm, &item->key);
+    table_reindex(table);
+#else
+    mel_value_t *moved;
+    garry_with(moved, &vm->allocator);
+    size_t i = 0;
+    struct entry *item;
+    while ((item = table_next(table, &i)))
+        if (gc_young_value(vm, item->key)) {
+            garry_append(moved, item->key);
+            garry_append(moved, item->value);
+        }
+    for (int k = 0; k < garry_count(moved); k += 2)
+        table_remove(table, table_find_value(table, moved[k]));
+    for (int k = 0; k < garry_count(moved); k += 2) {
+        gc_evacuate(vm, &moved[k]);
+        table_insert(table, value_hash(moved[k]), moved[k], moved[k + 1]);
+    }
+    garry_free(moved);
+#endif
+}
+
+static void gc_evacuate_table(mel_vm_t *vm, mel_table_t *table) {
+    if (table->meta) {
+        mel_value_t meta = mel_obj(table->meta);
+        gc_evacuate(vm, &meta);
+        table->meta = mel_as_table(meta);
+    }
+    gc_evacuate_values(vm, table->array, (int)table->asize);
+    bool rekey = false;
+    size_t i = 0;
+    struct entry *item;
+    while ((item = table_next(table, &i))) {
+        gc_evacuate(vm, &item->value);
+        if (mel_is_string(item->key))
+            gc_evacuate(vm, &item->key);
+        else
+            rekey |= gc_young_value(vm, item->key);
+    }
+    if (rekey)
+        gc_rekey_table(vm, table);
+}
+
+static void gc_minor(mel_vm_t *vm) {
+    if (vm->gc.top == vm->gc.nursery)
+        return;
+    for (mel_segment_t *segment = vm->stack.segment; segment; segment = segment->prev)
+        gc_evacuate_values(vm, segment->values, segment_count(vm, segment));
+    for (int i = 0; i < garry_count(vm->gc.roots); i++)
+        gc_evacuate(vm, vm->gc.roots[i]);
+    for (int i = 0; i < garry_count(vm->gc.ranges); i++)
+        gc_evacuate_values(vm, vm->gc.ranges[i].values, vm->gc.ranges[i].count);
+    gc_evacuate(vm, &vm->current);
+    gc_evacuate(vm, &vm->previous);
+    gc_evacuate_values(vm, vm->tail, garry_count(vm->tail));
+    for (int i = 0; i < garry_count(vm->global_slots); i++)
+        gc_evacuate(vm, &vm->global_slots[i].value);
+    for (int i = 0; i < garry_count(vm->gc.remembered); i++) {
+        mel_object_t *obj = vm->gc.remembered[i];
+        switch (obj->type) {
+            case MEL_OBJECT_TABLE:
+                ((mel_table_t*)obj)->remembered = false;
+                gc_evacuate_table(vm, (mel_table_t*)obj);
+                break;
+            case MEL_OBJECT_ARRAY: {
+                mel_array_t *array = (mel_array_t*)obj;
+                array->remembered = false;
+                if (!array->packed)
+                    gc_evacuate_values(vm, array->values, array->count);
+                break;
+            }
+            case MEL_OBJECT_CELL: {
+                mel_cell_t *cell = (mel_cell_t*)obj;
+                cell->remembered = false;
+                gc_evacuate(vm, &cell->value);
+                break;
+            }
+            default: {
+                mel_native_t *native = (mel_native_t*)obj;
+                gc_evacuate_values(vm, native->constants, native->nconstants);
+                break;
+            }
+        }
+    }
+    __garry_n(vm->gc.remembered) = 0;
+    while (garry_count(vm->gc.promoted)) {
+        mel_table_t *table = (mel_table_t*)vm->gc.promoted[garry_count(vm->gc.promoted) - 1];
+        garry_pop(vm->gc.promoted);
+        gc_evacuate_table(vm, table);
+    }
+    nursery_release(vm);
+}
+
+static bool gc_sweep(mel_vm_t *vm, size_t limit) {
+    for (size_t work = 0; *vm->gc.sweep; work++) {
+        if (work >= limit)
+            return false;
+        mel_object_t *obj = *vm->gc.sweep;
+        if (gc_marked(vm, obj))
+            vm->gc.sweep = &obj->next;
+        else {
+            *vm->gc.sweep = obj->next;
+            if (obj->type == MEL_OBJECT_TABLE && ((mel_table_t*)obj)->ismeta)
+                vm->meta_version++;
+            obj_destroy(&vm->allocator, obj);
+            vm->gc.count--;
+        }
+    }
+    return true;
+}
+
+static bool gc_step(mel_vm_t *vm, size_t limit) {
+    size_t work = 0;
+    switch (vm->gc.state) {
+        case MEL_GC_IDLE:
+            gc_minor(vm);
+            vm->gc.epoch++;
+            vm->gc.state = MEL_GC_MARK;
+            // Keep stepping at every safe point until the cycle is done
+            vm->gc.threshold = 0;
+            gc_mark_roots(vm);
+            // fallthrough
+        case MEL_GC_MARK:
+            if (!gc_propagate(vm, &work, limit))
+                return false;
+            // Roots are written without a barrier, so they are marked again
+            // before the cycle commits to sweeping
+            gc_mark_roots(vm);
+            if (garry_count(vm->gc.gray))
+                return false;
+            // Remembered tables may be garbage by now, the sweep must not
+            // free them while they are still queued
+            gc_minor(vm);
+            vm->gc.state = MEL_GC_SWEEP;
+            vm->gc.sweep = &vm->objects;
+            return false;
+        case MEL_GC_SWEEP:
+            if (!gc_sweep(vm, limit))
+                return false;
+            vm->gc.state = MEL_GC_IDLE;
+            vm->gc.threshold = vm->gc.count / 100 * vm->gc.pause;
+            if (vm->gc.threshold < MEL_GC_MIN)
+                vm->gc.threshold = MEL_GC_MIN;
+            return true;
+    }
+    return true;
+}
+
+static inline void gc_check(mel_vm_t *vm) {
+    if (vm->gc.full)
+        gc_minor(vm);
+    if (vm->gc.count >= vm->gc.threshold)
+        gc_step(vm, vm->gc.budget);
+}
+
+void mel_gc_check(mel_vm_t *vm) {
+    gc_check(vm);
+}
+
+bool mel_gc_step(mel_vm_t *vm) {
+    return gc_step(vm, vm->gc.budget);
+}
+
+void mel_gc_collect(mel_vm_t *vm) {
+    // Finish any cycle in progress, then run a whole new one
+    if (vm->gc.state != MEL_GC_IDLE)
+        while (!gc_step(vm, SIZE_MAX));
+    while (!gc_step(vm, SIZE_MAX));
+}
+
+void mel_gc_config(mel_vm_t *vm, size_t budget, int pause) {
+    vm->gc.budget = budget ? budget : MEL_GC_BUDGET;
+    vm->gc.pause = pause > 100 ? pause : MEL_GC_PAUSE;
+}
+
+void mel_gc_root(mel_vm_t *vm, mel_value_t *slot) {
+    garry_append(vm->gc.roots, slot);
+}
+
+void mel_gc_unroot(mel_vm_t *vm, mel_value_t *slot) {
+    for (int i = garry_count(vm->gc.roots) - 1; i >= 0; i--)
+        if (vm->gc.roots[i] == slot) {
+            vm->gc.roots[i] = vm->gc.roots[garry_count(vm->gc.roots) - 1];
+            garry_pop(vm->gc.roots);
+            return;
+        }
+}
+
+void mel_gc_push(mel_vm_t *vm, mel_value_t *values, int count) {
+    garry_append(vm->gc.ranges, ((mel_gc_range_t) {
+        .values = values,
+        .count = count
+    }));
+}
+
+void mel_gc_pop(mel_vm_t *vm) {
+    if (garry_count(vm->gc.ranges))
+        garry_pop(vm->gc.ranges);
+}
@@ -0,0 +1,821 @@
+#ifdef MEL_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MEL_JIT_THRESHOLD
+#define MEL_JIT_THRESHOLD 1000
+#endif
+
+#ifndef MEL_JIT_PAGE_SIZE
+#define MEL_JIT_PAGE_SIZE 65536
+#endif
+
+typedef mel_result(*mel_jit_entry)(mel_vm_t *vm, void *target, mel_value_t *base);
+
+// A page goes back to the system once every function compiled into it has
+// been collected. link is whatever points at it, vm->jit_pages or the next
+// field of the page before it
+typedef struct mel_jit_page {
+    struct mel_jit_page *next;
+    struct mel_jit_page **link;
+    unsigned char *base;
+    size_t size;
+    size_t used;
+    int live;
+} mel_jit_page_t;
+
+typedef struct mel_jit {
+    mel_jit_entry entry;
+    mel_jit_page_t *page;
+    uint32_t offsets[];
+} mel_jit_t;
+
+static void *jit_alloc(mel_vm_t *vm, mel_jit_t *jit, const unsigned char *code, size_t size) {
+    mel_jit_page_t *page = vm->jit_pages;
+    if (!page || page->size - page->used < size) {
+        long pagesz = sysconf(_SC_PAGESIZE);
+        size_t want = size > MEL_JIT_PAGE_SIZE ? size : MEL_JIT_PAGE_SIZE;
+        want = (want + pagesz - 1) & ~(size_t)(pagesz - 1);
+        void *base = mmap(NULL, want, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return NULL;
+        if (!(page = mem_alloc(&vm->allocator, sizeof(mel_jit_page_t)))) {
+            munmap(base, want);
+            return NULL;
+        }
+        if ((page->next = vm->jit_pages))
+            page->next->link = &page->next;
+        page->link = &vm->jit_pages;
+        page->base = base;
+        page->size = want;
+        page->used = 0;
+        page->live = 0;
+        vm->jit_pages = page;
+    }
+    // Pages are only ever writable while code is being copied in
+    if (mprotect(page->base, page->size, PROT_READ | PROT_WRITE))
+        return NULL;
+    unsigned char *result = page->base + page->used;
+    memcpy(result, code, size);
+    page->used += (size + 15) & ~(size_t)15;
+    if (page->used > page->size)
+        page->used = page->size;
+    mprotect(page->base, page->size, PROT_READ | PROT_EXEC);
+    page->live++;
+    jit->page = page;
+    return result;
+}
+
+// When the function owning jit is freed
+static void jit_release(const mel_allocator_t *allocator, void *jit) {
+    mel_jit_page_t *page = ((mel_jit_t*)jit)->page;
+    mem_free(allocator, jit);
+    if (--page->live > 0)
+        return;
+    if ((*page->link = page->next))
+        page->next->link = page->link;
+    munmap(page->base, page->size);
+    mem_free(allocator, page);
+}
+
+static void jit_free(mel_vm_t *vm) {
+    mel_jit_page_t *page = vm->jit_pages;
+    while (page) {
+        mel_jit_page_t *next = page->next;
+        munmap(page->base, page->size);
+        mem_free(&vm->allocator, page);
+        page = next;
+    }
+    vm->jit_pages = NULL;
+}
+
+#define JIT_FRAME(VM) ((mel_frame_t*)garry_last((VM)->frames))
+
+static void jit_set_pc(mel_vm_t *vm, unsigned char *pc) {
+    JIT_FRAME(vm)->pc = vm->pc = pc;
+}
+
+static void jit_box(mel_vm_t *vm, int slot) {
+    mel_value_t *value = &JIT_FRAME(vm)->base[slot];
+    *value = mel_new_cell(vm, *value);
+}
+
+static void jit_get_cell(mel_vm_t *vm, int slot) {
+    mel_value_t value = mel_as_cell(JIT_FRAME(vm)->base[slot])->value;
+    vm_push(vm, value);
+}
+
+static void jit_set_cell(mel_vm_t *vm, int slot) {
+    cell_set(vm, mel_as_cell(JIT_FRAME(vm)->base[slot]), vm->stack.top[-1]);
+}
+
+static void jit_get_upvalue(mel_vm_t *vm, int index) {
+    vm_push(vm, JIT_FRAME(vm)->closure->cells[index]->value);
+}
+
+static void jit_set_upvalue(mel_vm_t *vm, int index) {
+    cell_set(vm, JIT_FRAME(vm)->closure->cells[index], vm->stack.top[-1]);
+}
+
+static mel_result jit_get_global(mel_vm_t *vm, int slot, unsigned char *pc) {
+    mel_global_t *global = &vm->global_slots[slot];
+    if (!global->defined) {
+        jit_set_pc(vm, pc);
+        return runtime_error(vm, "undefined variable '%s'", global->name->chars);
+    }
+    vm_push(vm, global->value);
+    return MEL_OK;
+}
+
+#define X(NAME, OP, RESULT) \
+static mel_result jit_##NAME(mel_vm_t *vm, unsigned char *pc) { \
+    mel_value_t *top = vm->stack.top - 1; \
+    mel_value_t a = top[-1], b = *top; \
+    if (!mel_is_number(a) || !mel_is_number(b)) { \
+        jit_set_pc(vm, pc); \
+        return runtime_error(vm, "operands must be numbers"); \
+    } \
+    vm_pop(vm); \
+    top[-1] = RESULT(mel_as_number(a) OP mel_as_number(b)); \
+    return MEL_OK; \
+}
+#define JIT_BINARY_OPS \
+    X(add, +, mel_number) \
+    X(sub, -, mel_number) \
+    X(mul, *, mel_number) \
+    X(div, /, mel_number) \
+    X(less, <, mel_boolean) \
+    X(greater, >, mel_boolean) \
+    X(less_equal, <=, mel_boolean) \
+    X(greater_equal, >=, mel_boolean)
+JIT_BINARY_OPS
+#undef X
+
+#define X(_, NAME, OP, RESULT) \
+static mel_result jit_##NAME##_with(mel_vm_t *vm, mel_value_t b, unsigned char *pc) { \
+    mel_value_t *top = &vm->stack.top[-1]; \
+    if (!mel_is_number(*top) || !mel_is_number(b)) { \
+        jit_set_pc(vm, pc); \
+        return runtime_error(vm, "operands must be numbers"); \
+    } \
+    *top = RESULT(mel_as_number(*top) OP mel_as_number(b)); \
+    return MEL_OK; \
+} \
+static mel_result jit_##NAME##_local(mel_vm_t *vm, int slot, unsigned char *pc) { \
+    return jit_##NAME##_with(vm, JIT_FRAME(vm)->base[slot], pc); \
+} \
+static mel_result jit_##NAME##_constant(mel_vm_t *vm, mel_value_t *constant, unsigned char *pc) { \
+    return jit_##NAME##_with(vm, *constant, pc); \
+}
+FUSED_OPS
+#undef X
+
+static mel_result jit_negate(mel_vm_t *vm, unsigned char *pc) {
+    mel_value_t *top = &vm->stack.top[-1];
+    if (!mel_is_number(*top)) {
+        jit_set_pc(vm, pc);
+        return runtime_error(vm, "operand must be a number");
+    }
+    *top = mel_number(-mel_as_number(*top));
+    return MEL_OK;
+}
+
+static void jit_not(mel_vm_t *vm) {
+    mel_value_t *top = &vm->stack.top[-1];
+    *top = mel_boolean(mel_is_falsey(*top));
+}
+
+static void jit_equal(mel_vm_t *vm) {
+    mel_value_t b = vm_pop(vm);
+    mel_value_t *top = &vm->stack.top[-1];
+    *top = mel_boolean(mel_equal(*top, b));
+}
+
+static void jit_array(mel_vm_t *vm, int count) {
+    mel_value_t *top = vm->stack.top - count;
+    mel_value_t array = mel_new_array(vm, count, top);
+    vm_truncate(vm, top);
+    vm_push(vm, array);
+}
+
+static void jit_closure(mel_vm_t *vm, mel_value_t *constant) {
+    mel_value_t closure = make_closure(vm, mel_as_function(*constant), JIT_FRAME(vm));
+    vm_push(vm, closure);
+}
+
+static mel_result jit_table(mel_vm_t *vm, int count, unsigned char *pc) {
+    jit_set_pc(vm, pc);
+    return table_literal(vm, count);
+}
+
+static mel_result jit_call(mel_vm_t *vm, int argc, unsigned char *pc) {
+    jit_set_pc(vm, pc);
+    int depth = garry_count(vm->frames);
+    mel_result ret = call_value(vm, argc);
+    // Compiled code returns early when it hands its frame to a tail call
+    while (ret == MEL_OK && garry_count(vm->frames) > depth) {
+        mel_function_t *callee = vm->frames[depth].function;
+        if (!vm->jit_enabled || !jit_hot(vm, callee))
+            return vm_run(vm, depth);
+        ret = jit_enter(vm, callee, callee->code);
+    }
+    return ret;
+}
+
+// Takes the whole instruction, it has more operands than fit the others
+static mel_result jit_send(mel_vm_t *vm, const unsigned char *op, unsigned char *pc) {
+    mel_function_t *function = JIT_FRAME(vm)->function;
+    mel_string_t *name = mel_as_string(function->constants[(op[1] << 8) | op[2]]);
+    int argc = op[3];
+    mel_cache_t *cache = &function->caches[(op[4] << 8) | op[5]];
+    mel_value_t *top = vm->stack.top - 1;
+    jit_set_pc(vm, pc);
+    mel_result ret = find_method(vm, top[1 - argc], name, cache, &top[-argc]);
+    return ret != MEL_OK ? ret : jit_call(vm, argc, pc);
+}
+
+// -1 carries on with the next instruction, anything else leaves the
+// compiled code with that result. Calling a function reuses the frame and
+// leaves, whoever entered the compiled code runs the callee from there
+static int jit_tail_call(mel_vm_t *vm, int argc, unsigned char *pc) {
+    mel_value_t callee = vm->stack.top[-argc - 1];
+    if (mel_is_function(callee) || mel_is_closure(callee)) {
+        jit_set_pc(vm, pc);
+        return tail_call(vm, argc);
+    }
+    mel_result ret = jit_call(vm, argc, pc);
+    return ret != MEL_OK ? (int)ret : -1;
+}
+
+static int jit_tail_send(mel_vm_t *vm, const unsigned char *op, unsigned char *pc) {
+    mel_function_t *function = JIT_FRAME(vm)->function;
+    mel_string_t *name = mel_as_string(function->constants[(op[1] << 8) | op[2]]);
+    int argc = op[3];
+    mel_cache_t *cache = &function->caches[(op[4] << 8) | op[5]];
+    mel_value_t *top = vm->stack.top - 1;
+    jit_set_pc(vm, pc);
+    mel_result ret = find_method(vm, top[1 - argc], name, cache, &top[-argc]);
+    return ret != MEL_OK ? (int)ret : jit_tail_call(vm, argc, pc);
+}
+
+static void jit_return(mel_vm_t *vm) {
+    mel_value_t result = vm_pop(vm);
+    stack_unwind(vm, JIT_FRAME(vm)->ret);
+    garry_pop(vm->frames);
+    vm_push(vm, result);
+}
+
+typedef struct mel_assembler {
+    unsigned char *code;
+    int *patches;
+} mel_assembler_t;
+
+// Compiled code keeps the VM in rbx, the frame's base in r12 and the top of
+// the stack in r13. Values are copied through rax, and rcx when they don't
+// fit a register
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R12 = 12, R13
+};
+
+// Condition codes, JMP stands for an unconditional jump
+enum {
+    JMP = -1, CC_B = 2, CC_AE, CC_E, CC_NE, CC_BE, CC_A
+};
+
+#define JIT_VALUE ((int)sizeof(mel_value_t))
+#define JIT_TOP ((int)(offsetof(mel_vm_t, stack) + offsetof(mel_stack_t, top)))
+#define JIT_GC(FIELD) ((int)(offsetof(mel_vm_t, gc) + offsetof(mel_gc_t, FIELD)))
+#ifdef MEL_NAN_BOXING
+#define JIT_PAYLOAD 0
+#else
+#define JIT_PAYLOAD ((int)offsetof(mel_value_t, as))
+#endif
+
+static void emit8(mel_assembler_t *a, unsigned char byte) {
+    garry_append(a->code, byte);
+}
+
+static void emit32(mel_assembler_t *a, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        emit8(a, (value >> (i * 8)) & 0xFF);
+}
+
+static void emit64(mel_assembler_t *a, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+        emit8(a, (value >> (i * 8)) & 0xFF);
+}
+
+static void emit_bytes(mel_assembler_t *a, const char *bytes, int count) {
+    for (int i = 0; i < count; i++)
+        emit8(a, (unsigned char)bytes[i]);
+}
+
+// [prefix] [rex] op reg, [base + disp32]
+static void emit_mem(mel_assembler_t *a, int prefix, bool wide, const char *op, int reg, int base, int disp) {
+    if (prefix)
+        emit8(a, prefix);
+    int rex = (wide ? 8 : 0) | (reg >> 3) << 2 | base >> 3;
+    if (rex)
+        emit8(a, 0x40 | rex);
+    emit_bytes(a, op, (int)strlen(op));
+    emit8(a, 0x80 | (reg & 7) << 3 | (base & 7));
+    // r12 as a base needs a SIB byte
+    if ((base & 7) == RSP)
+        emit8(a, 0x24);
+    emit32(a, (uint32_t)disp);
+}
+
+// mov reg, imm64
+static void emit_imm(mel_assembler_t *a, int reg, uint64_t value) {
+    emit8(a, 0x48 | reg >> 3);
+    emit8(a, 0xb8 | (reg & 7));
+    emit64(a, value);
+}
+
+// add r13, count values, sub when count is negative
+static void emit_top(mel_assembler_t *a, int count) {
+    emit_bytes(a, "\x49\x81", 2);
+    emit8(a, count < 0 ? 0xed : 0xc5);
+    emit32(a, (uint32_t)((count < 0 ? -count : count) * JIT_VALUE));
+}
+
+// Copies the value at [src + sdisp] to [dst + ddisp]
+static void emit_copy(mel_assembler_t *a, int dst, int ddisp, int src, int sdisp) {
+#ifdef MEL_NAN_BOXING
+    emit_mem(a, 0, true, "\x8b", RAX, src, sdisp);
+    emit_mem(a, 0, true, "\x89", RAX, dst, ddisp);
+#else
+    // Two qwords, every store of a value is made of qwords too so a load
+    // right after it can always be forwarded from it
+    emit_mem(a, 0, true, "\x8b", RAX, src, sdisp);
+    emit_mem(a, 0, true, "\x8b", RCX, src, sdisp + JIT_PAYLOAD);
+    emit_mem(a, 0, true, "\x89", RAX, dst, ddisp);
+    emit_mem(a, 0, true, "\x89", RCX, dst, ddisp + JIT_PAYLOAD);
+#endif
+}
+
+// Stores value at [dst + disp]
+static void emit_store(mel_assembler_t *a, int dst, int disp, mel_value_t value) {
+#ifdef MEL_NAN_BOXING
+    emit_imm(a, RAX, value);
+    emit_mem(a, 0, true, "\x89", RAX, dst, disp);
+#else
+    uint64_t payload = 0;
+    memcpy(&payload, &value.as, sizeof(value.as) < sizeof(payload) ? sizeof(value.as) : sizeof(payload));
+    // mov qword [dst + disp], type
+    emit_mem(a, 0, true, "\xc7", 0, dst, disp);
+    emit32(a, (uint32_t)value.type);
+    emit_imm(a, RAX, payload);
+    emit_mem(a, 0, true, "\x89", RAX, dst, disp + JIT_PAYLOAD);
+#endif
+}
+
+// rel32 to a bytecode offset, -1 for the error exit
+static void emit_target(mel_assembler_t *a, int target) {
+    garry_append(a->patches, garry_count(a->code));
+    garry_append(a->patches, target);
+    emit32(a, 0);
+}
+
+// jcc rel32 to a bytecode offset
+static void emit_jcc(mel_assembler_t *a, int cc, int target) {
+    if (cc == JMP)
+        emit8(a, 0xe9);
+    else {
+        emit8(a, 0x0f);
+        emit8(a, 0x80 | cc);
+    }
+    emit_target(a, target);
+}
+
+// jcc rel32 to a label further on, which emit_label places
+static int emit_forward(mel_assembler_t *a, int cc) {
+    if (cc == JMP)
+        emit8(a, 0xe9);
+    else {
+        emit8(a, 0x0f);
+        emit8(a, 0x80 | cc);
+    }
+    emit32(a, 0);
+    return garry_count(a->code);
+}
+
+static void emit_label(mel_assembler_t *a, int from) {
+    int32_t rel = garry_count(a->code) - from;
+    memcpy(a->code + from - 4, &rel, sizeof(int32_t));
+}
+
+// mov esi, imm32
+static void emit_int_arg(mel_assembler_t *a, int value) {
+    emit8(a, 0xbe);
+    emit32(a, (uint32_t)value);
+}
+
+// mov rsi, imm64
+static void emit_ptr_arg(mel_assembler_t *a, const void *ptr) {
+    emit_imm(a, RSI, (uint64_t)(uintptr_t)ptr);
+}
+
+// mov rdx, imm64
+static void emit_ptr_arg2(mel_assembler_t *a, const void *ptr) {
+    emit_imm(a, RDX, (uint64_t)(uintptr_t)ptr);
+}
+
+// Helpers go through vm->stack.top, r13 is written back before the call and
+// picked up again after it. mov [rbx + top], r13; mov rdi, rbx;
+// mov rax, imm64; call rax; mov r13, [rbx + top]
+static void emit_call(mel_assembler_t *a, const void *fn) {
+    emit_mem(a, 0, true, "\x89", R13, RBX, JIT_TOP);
+    emit_bytes(a, "\x48\x89\xdf", 3);
+    emit_imm(a, RAX, (uint64_t)(uintptr_t)fn);
+    emit_bytes(a, "\xff\xd0", 2);
+    emit_mem(a, 0, true, "\x8b", R13, RBX, JIT_TOP);
+}
+
+// test eax, eax; jnz/jz rel32 to a bytecode offset (-1 for the error exit)
+static void emit_branch(mel_assembler_t *a, bool nonzero, int target) {
+    emit_bytes(a, "\x85\xc0", 2);
+    emit_jcc(a, nonzero ? CC_NE : CC_E, target);
+}
+
+// cmp eax, -1; jne rel32 to the exit, which hands eax back as the result
+static void emit_exit_unless_next(mel_assembler_t *a) {
+    emit_bytes(a, "\x83\xf8\xff", 3);
+    emit_jcc(a, CC_NE, -1);
+}
+
+// [xor eax, eax]; pop r13; pop r12; pop rbx; ret
+static void emit_exit(mel_assembler_t *a, bool success) {
+    if (success)
+        emit_bytes(a, "\x31\xc0", 2);
+    emit_bytes(a, "\x41\x5d\x41\x5c\x5b\xc3", 6);
+}
+
+// Jumps to target when the value at [r13 + disp] is falsey, or truthy
+static void emit_test(mel_assembler_t *a, int disp, bool truthy, int target) {
+#ifdef MEL_NAN_BOXING
+    // nil and false are next to each other, both are at most 1 past nil
+    emit_mem(a, 0, true, "\x8b", RAX, R13, disp);
+    emit_imm(a, RCX, mel_nil());
+    // sub rax, rcx; cmp rax, 1
+    emit_bytes(a, "\x48\x29\xc8\x48\x83\xf8\x01", 7);
+    emit_jcc(a, truthy ? CC_A : CC_BE, target);
+#else
+    emit_mem(a, 0, false, "\x8b", RAX, R13, disp);
+    // cmp eax, imm8
+    emit_bytes(a, "\x83\xf8", 2);
+    emit8(a, MEL_VALUE_NIL);
+    int skip = truthy ? emit_forward(a, CC_E) : 0;
+    if (!truthy)
+        emit_jcc(a, CC_E, target);
+    emit_bytes(a, "\x83\xf8", 2);
+    emit8(a, MEL_VALUE_BOOLEAN);
+    if (truthy)
+        emit_jcc(a, CC_NE, target);
+    else
+        skip = emit_forward(a, CC_NE);
+    // cmp byte [r13 + disp + payload], 0
+    emit_mem(a, 0, false, "\x80", 7, R13, disp + JIT_PAYLOAD);
+    emit8(a, 0);
+    emit_jcc(a, truthy ? CC_NE : CC_E, target);
+    emit_label(a, skip);
+#endif
+}
+
+// Numbers only, a is at [r13 + adisp] and gets the result, b is at
+// [breg + bdisp]. slow gets the jumps taken when either one isn't a number
+static void emit_arith(mel_assembler_t *a, mel_opcode op, int adisp, int breg, int bdisp, int slow[2]) {
+    int regs[2] = { R13, breg }, disps[2] = { adisp, bdisp };
+#ifdef MEL_NAN_BOXING
+    emit_imm(a, RCX, MEL_QNAN);
+#endif
+    for (int i = 0; i < 2; i++) {
+#ifdef MEL_NAN_BOXING
+        // and rax, rcx; cmp rax, rcx
+        emit_mem(a, 0, true, "\x8b", RAX, regs[i], disps[i]);
+        emit_bytes(a, "\x48\x21\xc8\x48\x39\xc8", 6);
+        slow[i] = emit_forward(a, CC_E);
+#else
+        // cmp dword [reg + disp], imm8
+        emit_mem(a, 0, false, "\x83", 7, regs[i], disps[i]);
+        emit8(a, MEL_VALUE_NUMBER);
+        slow[i] = emit_forward(a, CC_NE);
+#endif
+    }
+    // movsd xmm0, a; movsd xmm1, b
+    emit_mem(a, 0xf2, false, "\x0f\x10", 0, R13, adisp + JIT_PAYLOAD);
+    emit_mem(a, 0xf2, false, "\x0f\x10", 1, breg, bdisp + JIT_PAYLOAD);
+    switch (op) {
+        case MEL_OP_ADD:
+        case MEL_OP_SUB:
+        case MEL_OP_MUL:
+        case MEL_OP_DIV:
+            // addsd/subsd/mulsd/divsd xmm0, xmm1; movsd a, xmm0
+            emit_bytes(a, "\xf2\x0f", 2);
+            emit8(a, op == MEL_OP_ADD ? 0x58 : op == MEL_OP_SUB ? 0x5c : op == MEL_OP_MUL ? 0x59 : 0x5e);
+            emit8(a, 0xc1);
+            emit_mem(a, 0xf2, false, "\x0f\x11", 0, R13, adisp + JIT_PAYLOAD);
+            return;
+        default:
+            break;
+    }
+    // ucomisd, a < b is b > a so NaN comes out false either way
+    bool swap = op == MEL_OP_LESS || op == MEL_OP_LESS_EQUAL;
+    emit_bytes(a, "\x66\x0f\x2e", 3);
+    emit8(a, swap ? 0xc8 : 0xc1);
+    // seta/setae al; movzx eax, al
+    emit_bytes(a, "\x0f", 1);
+    emit8(a, op == MEL_OP_LESS || op == MEL_OP_GREATER ? 0x97 : 0x93);
+    emit_bytes(a, "\xc0\x0f\xb6\xc0", 4);
+#ifdef MEL_NAN_BOXING
+    // add rax, rcx with rcx = false, true is one past it
+    emit_imm(a, RCX, mel_boolean(false));
+    emit_bytes(a, "\x48\x01\xc8", 3);
+    emit_mem(a, 0, true, "\x89", RAX, R13, adisp);
+#else
+    emit_mem(a, 0, true, "\xc7", 0, R13, adisp);
+    emit32(a, MEL_VALUE_BOOLEAN);
+    emit_mem(a, 0, true, "\x89", RAX, R13, adisp + JIT_PAYLOAD);
+#endif
+}
+
+// Ends a fast path and starts its slow one, returns the jump past the slow
+// path for emit_label
+static int emit_slow_path(mel_assembler_t *a, const int slow[2]) {
+    int done = emit_forward(a, JMP);
+    emit_label(a, slow[0]);
+    emit_label(a, slow[1]);
+    return done;
+}
+
+static bool jit_compile(mel_vm_t *vm, mel_function_t *function) {
+    static const int operands[] = {
+#define X(_, __, OPERANDS) OPERANDS,
+        OPCODES
+#undef X
+    };
+    int length = garry_count(function->code);
+    mel_jit_t *jit = mem_alloc(&vm->allocator, sizeof(mel_jit_t) + sizeof(uint32_t) * (length + 1));
+    if (!jit)
+        return false;
+    mel_assembler_t a;
+    garry_with(a.code, &vm->allocator);
+    garry_with(a.patches, &vm->allocator);
+    // push rbx; push r12; push r13; mov rbx, rdi; mov r12, rdx;
+    // mov r13, [rbx + top]; jmp rsi
+    emit_bytes(&a, "\x53\x41\x54\x41\x55\x48\x89\xfb\x49\x89\xd4", 11);
+    emit_mem(&a, 0, true, "\x8b", R13, RBX, JIT_TOP);
+    emit_bytes(&a, "\xff\xe6", 2);
+    int error_exit = garry_count(a.code);
+    emit_exit(&a, false);
+    unsigned char *code = function->code;
+    for (int i = 0; i < length; i++) {
+        unsigned char *pc = code + i;
+        mel_opcode op = (mel_opcode)*pc;
+        unsigned char *next = pc + 1 + operands[op];
+        int arg = operands[op] == 1 ? pc[1] : operands[op] == 2 ? (pc[1] << 8) | pc[2] : 0;
+        int slow[2], done;
+        jit->offsets[i] = garry_count(a.code);
+        switch (op) {
+            case MEL_OP_CONSTANT:
+                emit_imm(&a, RDX, (uint64_t)(uintptr_t)&function->constants[arg]);
+                emit_copy(&a, R13, 0, RDX, 0);
+                emit_top(&a, 1);
+                break;
+            case MEL_OP_NIL:
+                emit_store(&a, R13, 0, mel_nil());
+                emit_top(&a, 1);
+                break;
+            case MEL_OP_TRUE:
+                emit_store(&a, R13, 0, mel_boolean(true));
+                emit_top(&a, 1);
+                break;
+            case MEL_OP_POP:
+                emit_top(&a, -1);
+                break;
+            case MEL_OP_LEAVE:
+                emit_copy(&a, R13, -(arg + 1) * JIT_VALUE, R13, -JIT_VALUE);
+                emit_top(&a, -arg);
+                break;
+            case MEL_OP_GET_LOCAL:
+                emit_copy(&a, R13, 0, R12, arg * JIT_VALUE);
+                emit_top(&a, 1);
+                break;
+            case MEL_OP_SET_LOCAL:
+                emit_copy(&a, R12, arg * JIT_VALUE, R13, -JIT_VALUE);
+                break;
+            case MEL_OP_STORE_LOCAL:
+                emit_top(&a, -1);
+                emit_copy(&a, R12, arg * JIT_VALUE, R13, 0);
+                break;
+#define X(NAME, OPCODE) \
+            case MEL_OP_##OPCODE: \
+                emit_int_arg(&a, arg); \
+                emit_call(&a, jit_##NAME); \
+                break;
+            X(box, BOX)
+            X(get_cell, GET_CELL)
+            X(set_cell, SET_CELL)
+            X(get_upvalue, GET_UPVALUE)
+            X(set_upvalue, SET_UPVALUE)
+#undef X
+            case MEL_OP_GET_GLOBAL: {
+                int global = arg * (int)sizeof(mel_global_t);
+                // mov rdx, [rbx + global_slots]; cmp byte [rdx + defined], 0
+                emit_mem(&a, 0, true, "\x8b", RDX, RBX, (int)offsetof(mel_vm_t, global_slots));
+                emit_mem(&a, 0, false, "\x80", 7, RDX, global + (int)offsetof(mel_global_t, defined));
+                emit8(&a, 0);
+                slow[0] = slow[1] = emit_forward(&a, CC_E);
+                emit_copy(&a, R13, 0, RDX, global + (int)offsetof(mel_global_t, value));
+                emit_top(&a, 1);
+                done = emit_slow_path(&a, slow);
+                // Only to raise the error
+                emit_int_arg(&a, arg);
+                emit_ptr_arg2(&a, next);
+                emit_call(&a, jit_get_global);
+                emit_jcc(&a, JMP, -1);
+                emit_label(&a, done);
+                break;
+            }
+            case MEL_OP_SET_GLOBAL: {
+                int global = arg * (int)sizeof(mel_global_t);
+                emit_mem(&a, 0, true, "\x8b", RDX, RBX, (int)offsetof(mel_vm_t, global_slots));
+                emit_copy(&a, RDX, global + (int)offsetof(mel_global_t, value), R13, -JIT_VALUE);
+                // mov byte [rdx + defined], 1
+                emit_mem(&a, 0, false, "\xc6", 0, RDX, global + (int)offsetof(mel_global_t, defined));
+                emit8(&a, 1);
+                break;
+            }
+#define X(NAME, OPCODE) \
+            case MEL_OP_##OPCODE: \
+                emit_arith(&a, op, -2 * JIT_VALUE, R13, -JIT_VALUE, slow); \
+                emit_top(&a, -1); \
+                done = emit_slow_path(&a, slow); \
+                emit_ptr_arg(&a, next); \
+                emit_call(&a, jit_##NAME); \
+                emit_branch(&a, true, -1); \
+                emit_label(&a, done); \
+                break;
+            X(add, ADD)
+            X(sub, SUB)
+            X(mul, MUL)
+            X(div, DIV)
+            X(less, LESS)
+            X(greater, GREATER)
+            X(less_equal, LESS_EQUAL)
+            X(greater_equal, GREATER_EQUAL)
+#undef X
+            case MEL_OP_NEGATE:
+                emit_ptr_arg(&a, next);
+                emit_call(&a, jit_negate);
+                emit_branch(&a, true, -1);
+                break;
+#define X(OPCODE, NAME, ...) \
+            case MEL_OP_##OPCODE##_LOCAL: \
+                emit_arith(&a, MEL_OP_##OPCODE, -JIT_VALUE, R12, arg * JIT_VALUE, slow); \
+                done = emit_slow_path(&a, slow); \
+                emit_int_arg(&a, arg); \
+                emit_ptr_arg2(&a, next); \
+                emit_call(&a, jit_##NAME##_local); \
+                emit_branch(&a, true, -1); \
+                emit_label(&a, done); \
+                break; \
+            case MEL_OP_##OPCODE##_CONSTANT: \
+                emit_ptr_arg2(&a, &function->constants[arg]); \
+                emit_arith(&a, MEL_OP_##OPCODE, -JIT_VALUE, RDX, 0, slow); \
+                done = emit_slow_path(&a, slow); \
+                emit_ptr_arg(&a, &function->constants[arg]); \
+                emit_ptr_arg2(&a, next); \
+                emit_call(&a, jit_##NAME##_constant); \
+                emit_branch(&a, true, -1); \
+                emit_label(&a, done); \
+                break;
+            FUSED_OPS
+#undef X
+            case MEL_OP_NOT:
+                emit_call(&a, jit_not);
+                break;
+            case MEL_OP_EQUAL:
+                emit_call(&a, jit_equal);
+                break;
+            case MEL_OP_JUMP:
+                emit_jcc(&a, JMP, (int)(next - code) + arg);
+                break;
+            case MEL_OP_JUMP_IF_FALSE:
+                emit_top(&a, -1);
+                emit_test(&a, 0, false, (int)(next - code) + arg);
+                break;
+            case MEL_OP_JUMP_IF_FALSE_OR_POP:
+                emit_test(&a, -JIT_VALUE, false, (int)(next - code) + arg);
+                emit_top(&a, -1);
+                break;
+            case MEL_OP_JUMP_IF_TRUE_OR_POP:
+                emit_test(&a, -JIT_VALUE, true, (int)(next - code) + arg);
+                emit_top(&a, -1);
+                break;
+            case MEL_OP_LOOP:
+                // gc_check, only called when it has something to do.
+                // cmp byte [rbx + full], 0; mov rax, [rbx + count];
+                // cmp rax, [rbx + threshold]
+                emit_mem(&a, 0, false, "\x80", 7, RBX, JIT_GC(full));
+                emit8(&a, 0);
+                slow[0] = emit_forward(&a, CC_NE);
+                emit_mem(&a, 0, true, "\x8b", RAX, RBX, JIT_GC(count));
+                emit_mem(&a, 0, true, "\x3b", RAX, RBX, JIT_GC(threshold));
+                done = emit_forward(&a, CC_B);
+                emit_label(&a, slow[0]);
+                emit_call(&a, gc_check);
+                emit_label(&a, done);
+                emit_jcc(&a, JMP, (int)(next - code) - arg);
+                break;
+            case MEL_OP_ARRAY:
+                emit_int_arg(&a, arg);
+                emit_call(&a, jit_array);
+                break;
+            case MEL_OP_CLOSURE:
+                emit_ptr_arg(&a, &function->constants[arg]);
+                emit_call(&a, jit_closure);
+                break;
+            case MEL_OP_TABLE:
+                emit_int_arg(&a, arg);
+                emit_ptr_arg2(&a, next);
+                emit_call(&a, jit_table);
+                emit_branch(&a, true, -1);
+                break;
+            case MEL_OP_CALL:
+                emit_int_arg(&a, arg);
+                emit_ptr_arg2(&a, next);
+                emit_call(&a, jit_call);
+                emit_branch(&a, true, -1);
+                break;
+            case MEL_OP_SEND:
+                emit_ptr_arg(&a, pc);
+                emit_ptr_arg2(&a, next);
+                emit_call(&a, jit_send);
+                emit_branch(&a, true, -1);
+                break;
+            case MEL_OP_TAIL_CALL:
+                emit_int_arg(&a, arg);
+                emit_ptr_arg2(&a, next);
+                emit_call(&a, jit_tail_call);
+                emit_exit_unless_next(&a);
+                break;
+            case MEL_OP_TAIL_SEND:
+                emit_ptr_arg(&a, pc);
+                emit_ptr_arg2(&a, next);
+                emit_call(&a, jit_tail_send);
+                emit_exit_unless_next(&a);
+                break;
+            case MEL_OP_RETURN:
+                emit_call(&a, jit_return);
+                emit_exit(&a, true);
+                break;
+            default:
+                goto BAIL;
+        }
+        i += operands[op];
+    }
+    for (int i = 0; i < garry_count(a.patches); i += 2) {
+        int at = a.patches[i], target = a.patches[i + 1];
+        int dest = target < 0 ? error_exit : (int)jit->offsets[target];
+        int32_t rel = dest - (at + 4);
+        memcpy(a.code + at, &rel, sizeof(int32_t));
+    }
+    unsigned char *native = jit_alloc(vm, jit, a.code, garry_count(a.code));
+    if (!native)
+        goto BAIL;
+    jit->entry = (mel_jit_entry)(void*)native;
+    function->jit = jit;
+    garry_free(a.code);
+    garry_free(a.patches);
+    return true;
+BAIL:
+    garry_free(a.code);
+    garry_free(a.patches);
+    mem_free(&vm->allocator, jit);
+    return false;
+}
+
+static bool jit_hot(mel_vm_t *vm, mel_function_t *function) {
+    if (function->jit)
+        return true;
+    if (function->hotness < 0 || ++function->hotness < MEL_JIT_THRESHOLD)
+        return false;
+    if (!jit_compile(vm, function)) {
+        function->hotness = -1;
+        return false;
+    }
+    return true;
+}
+
+static mel_result jit_enter(mel_vm_t *vm, mel_function_t *function, unsigned char *pc) {
+    mel_jit_t *jit = function->jit;
+    void *target = (unsigned char*)(void*)jit->entry + jit->offsets[pc - function->code];
+    return jit->entry(vm, target, JIT_FRAME(vm)->base);
+}
+#endif
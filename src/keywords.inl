@@ -0,0 +1,31 @@
+// Generated by tools/keywords.c, do not edit
+
+#define KEYWORD_BITS 6
+#define KEYWORD_MAX 6
+#define KEYWORD_HASH(FIRST, LAST, LENGTH) \
+    (((uint32_t)((FIRST) * 1u + (LAST) * 1u + (LENGTH) * 124u) * 0x9E3779B1u) >> (32 - KEYWORD_BITS))
+
+#define KEYWORDS \
+    X(NIL, "nil", 40) \
+    X(T, "t", 1) \
+    X(SETQ, "setq", 29) \
+    X(IF, "if", 13) \
+    X(PROGN, "progn", 24) \
+    X(LET, "let", 22) \
+    X(LET_STAR, "let*", 15) \
+    X(LAMBDA, "lambda", 32) \
+    X(DEFUN, "defun", 61) \
+    X(WHILE, "while", 9) \
+    X(AND, "and", 42) \
+    X(OR, "or", 21) \
+    X(SEND, "send", 27) \
+    X(ADD, "+", 50) \
+    X(SUB, "-", 16) \
+    X(MUL, "*", 35) \
+    X(DIV, "/", 46) \
+    X(EQUAL, "=", 2) \
+    X(LESS, "<", 51) \
+    X(GREATER, ">", 17) \
+    X(LESS_EQUAL, "<=", 3) \
+    X(GREATER_EQUAL, ">=", 18) \
+    X(NOT, "not", 37)
@@ -1,3 +1,5 @@
+#include "keywords.inl"
+
 typedef enum mel_token_type {
     MEL_TOKEN_ERROR = 0,
     MEL_TOKEN_EOF,
@@ -14,54 +16,63 @@ typedef enum mel_token_type {
     MEL_TOKEN_BACK_QUOTE = '`',
     MEL_TOKEN_AT = '@',
     MEL_TOKEN_HASH = '#',
-    MEL_TOKEN_COLON = ','
+    MEL_TOKEN_COLON = ',',
+    // Keywords come after this, they can still be used wherever an atom can
+    MEL_TOKEN_KEYWORD = 0x100,
+#define X(KIND, NAME, SLOT) MEL_TOKEN_##KIND,
+    KEYWORDS
+#undef X
 } mel_token_type;
 
 typedef struct mel_token {
     mel_token_type type;
-    const wchar_t *cursor;
+    const char *cursor;
     int length;
     int line;
     int position;
 } mel_token_t;
 
 typedef struct mel_lexer {
-    const wchar_t *source;
-    const wchar_t *cursor;
+    const char *source;
+    const char *cursor;
+    const char *end;
     int current_line;
     int line_position;
     mel_token_t current;
     mel_token_t previous;
 } mel_lexer_t;
 
-static void lexer_init(mel_lexer_t *l, const wchar_t *str, int str_length) {
+// Source is UTF-8 and needn't be NUL-terminated, everything past `end`
+// reads as '\0'
+static void lexer_init(mel_lexer_t *l, const char *str, size_t str_length) {
     memset(l, 0, sizeof(mel_lexer_t));
     l->source = str;
     l->cursor = str;
+    l->end = str + str_length;
 }
 
 static void lexer_free(mel_lexer_t *l) {
     
 }
 
-static wchar_t lexer_peek(mel_lexer_t *p) {
-    return *p->cursor;
+static char lexer_peek(mel_lexer_t *p) {
+    return p->cursor < p->end ? *p->cursor : '\0';
 }
 
-static wchar_t lexer_eof(mel_lexer_t *p) {
-    return lexer_peek(p) == L'\0';
+static int lexer_eof(mel_lexer_t *p) {
+    return p->cursor >= p->end;
 }
 
 static inline void lexer_update(mel_lexer_t *p) {
     p->source = p->cursor;
 }
 
-static inline wchar_t lexer_next(mel_lexer_t *p) {
-    return lexer_eof(p) ? L'\0' : *(p->cursor + 1);
+static inline char lexer_next(mel_lexer_t *p) {
+    return p->cursor + 1 < p->end ? *(p->cursor + 1) : '\0';
 }
 
-static inline wchar_t lexer_advance(mel_lexer_t *p) {
-    wchar_t current = *p->cursor;
+static inline char lexer_advance(mel_lexer_t *p) {
+    char current = lexer_peek(p);
     switch (current) {
         case '\r':
             if (lexer_next(p) == '\n') {
@@ -86,13 +97,13 @@ static inline wchar_t lexer_advance(mel_lexer_t *p) {
     return current;
 }
 
-static inline wchar_t lexer_skip(mel_lexer_t *p) {
-    wchar_t ret = lexer_advance(p);
+static inline char lexer_skip(mel_lexer_t *p) {
+    char ret = lexer_advance(p);
     lexer_update(p);
     return ret;
 }
 
-static inline mel_token_t make_token(mel_token_type type, const wchar_t *cursor, int length, int line, int line_position) {
+static inline mel_token_t make_token(mel_token_type type, const char *cursor, int length, int line, int line_position) {
     return (mel_token_t) {
         .type = type,
         .cursor = cursor,
@@ -122,7 +133,7 @@ static int lexer_peek_newline(mel_lexer_t *p) {
     X('\n') \
     X('\f')
 
-static int is_whitespace(wchar_t c) {
+static int is_whitespace(char c) {
     switch (c) {
 #define X(C) case C:
             WHITESPACE
@@ -149,8 +160,8 @@ static int is_whitespace(wchar_t c) {
     X(':') \
     X('"')
 
-static int lexer_peek_terminators(mel_lexer_t *p) {
-    switch (lexer_peek(p)) {
+static int is_terminator(char c) {
+    switch (c) {
 #define X(C) \
         case C:
             WHITESPACE
@@ -162,65 +173,213 @@ static int lexer_peek_terminators(mel_lexer_t *p) {
     }
 }
 
-static int lexer_peek_digit(mel_lexer_t *p) {
-    wchar_t c = lexer_peek(p);
-    return c >= L'0' && c <= L'9';
+// Bulk scanning, finds the next byte of interest a whole vector at a time
+// and falls back to a byte loop for the tail
+typedef enum {
+    SCAN_SPACE,  // first non-whitespace
+    SCAN_ATOM,   // first whitespace or terminator
+    SCAN_STRING, // closing quote
+    SCAN_LINE    // \r or \n
+} lexer_scan_t;
+
+#if !defined(MEL_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define LEXER_VECTOR 32
+typedef __m256i lexer_vec_t;
+#define VEC_LOAD(P) _mm256_loadu_si256((const __m256i*)(P))
+#define VEC_EQ(V, C) _mm256_cmpeq_epi8((V), _mm256_set1_epi8(C))
+#define VEC_OR(A, B) _mm256_or_si256((A), (B))
+#define VEC_ZERO() _mm256_setzero_si256()
+#define VEC_MASK(V) ((uint32_t)_mm256_movemask_epi8(V))
+#define VEC_FULL 0xFFFFFFFFu
+#elif !defined(MEL_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define LEXER_VECTOR 16
+typedef __m128i lexer_vec_t;
+#define VEC_LOAD(P) _mm_loadu_si128((const __m128i*)(P))
+#define VEC_EQ(V, C) _mm_cmpeq_epi8((V), _mm_set1_epi8(C))
+#define VEC_OR(A, B) _mm_or_si128((A), (B))
+#define VEC_ZERO() _mm_setzero_si128()
+#define VEC_MASK(V) ((uint32_t)_mm_movemask_epi8(V))
+#define VEC_FULL 0xFFFFu
+#endif
+
+#ifdef LEXER_VECTOR
+static inline uint32_t scan_mask(const char *s, lexer_scan_t kind) {
+    lexer_vec_t v = VEC_LOAD(s), m = VEC_ZERO();
+    switch (kind) {
+        case SCAN_SPACE:
+#define X(C) m = VEC_OR(m, VEC_EQ(v, C));
+            WHITESPACE
+            return ~VEC_MASK(m) & VEC_FULL;
+        case SCAN_ATOM:
+            WHITESPACE
+            TERMINATORS
+#undef X
+            return VEC_MASK(m);
+        case SCAN_STRING:
+            return VEC_MASK(VEC_EQ(v, '"'));
+        case SCAN_LINE:
+            return VEC_MASK(VEC_OR(VEC_EQ(v, '\r'), VEC_EQ(v, '\n')));
+    }
+    return 0;
 }
+#endif
 
-static void skip_line(mel_lexer_t *p) {
-    while (!lexer_peek_newline(p))
-        lexer_advance(p);
+static inline int scan_byte(char c, lexer_scan_t kind) {
+    switch (kind) {
+        case SCAN_SPACE:
+            return !is_whitespace(c);
+        case SCAN_ATOM:
+            return is_terminator(c);
+        case SCAN_STRING:
+            return c == '"';
+        case SCAN_LINE:
+            return c == '\r' || c == '\n';
+    }
+    return 1;
 }
 
-static inline int lexer_peek_whitespace(mel_lexer_t *p) {
-    return is_whitespace(lexer_peek(p));
+static inline const char* lexer_scan(mel_lexer_t *p, lexer_scan_t kind) {
+    const char *s = p->cursor;
+#ifdef LEXER_VECTOR
+    for (; p->end - s >= LEXER_VECTOR; s += LEXER_VECTOR) {
+        uint32_t mask = scan_mask(s, kind);
+        if (mask)
+            return s + __builtin_ctz(mask);
+    }
+#endif
+    while (s < p->end && !scan_byte(*s, kind))
+        s++;
+    return s;
+}
+
+// Moves the cursor to `stop`, counting the newlines in between. \r\n and
+// \n both end a line and the column restarts after the \n either way
+static void lexer_advance_to(mel_lexer_t *p, const char *stop) {
+    const char *s = p->cursor, *last = NULL;
+    int lines = 0;
+#ifdef LEXER_VECTOR
+    for (; stop - s >= LEXER_VECTOR; s += LEXER_VECTOR) {
+        uint32_t mask = VEC_MASK(VEC_EQ(VEC_LOAD(s), '\n'));
+        if (mask) {
+            lines += __builtin_popcount(mask);
+            last = s + 31 - __builtin_clz(mask);
+        }
+    }
+#endif
+    for (; s < stop; s++)
+        if (*s == '\n') {
+            lines++;
+            last = s;
+        }
+    if (lines) {
+        p->current_line += lines;
+        p->line_position = (int)(stop - last - 1);
+    } else
+        p->line_position += (int)(stop - p->cursor);
+    p->cursor = stop;
+}
+
+static int lexer_peek_digit(mel_lexer_t *p) {
+    char c = lexer_peek(p);
+    return c >= '0' && c <= '9';
+}
+
+static void skip_line(mel_lexer_t *p) {
+    for (;;) {
+        lexer_advance_to(p, lexer_scan(p, SCAN_LINE));
+        if (lexer_eof(p) || lexer_peek_newline(p))
+            break;
+        lexer_advance(p); // lone \r
+    }
 }
 
 static void skip_whitespace(mel_lexer_t *p) {
-    while (!lexer_eof(p) && lexer_peek_whitespace(p))
-        lexer_advance(p);
+    lexer_advance_to(p, lexer_scan(p, SCAN_SPACE));
     lexer_update(p);
 }
 
+// An optional sign, digits, then an optional fraction and exponent. A
+// number has to end at a terminator, with anything else after it the
+// whole atom is an error rather than a number and an atom
 static mel_token_t read_number(mel_lexer_t *p) {
-    while (!lexer_eof(p) && lexer_peek_digit(p))
+    bool valid = true;
+    if (lexer_peek(p) == '-' || lexer_peek(p) == '+')
+        lexer_advance(p);
+    while (lexer_peek_digit(p))
         lexer_advance(p);
-    return TOKEN(MEL_TOKEN_NUMBER);
+    if (lexer_peek(p) == '.' && lexer_next(p) >= '0' && lexer_next(p) <= '9') {
+        lexer_advance(p);
+        while (lexer_peek_digit(p))
+            lexer_advance(p);
+    }
+    if (lexer_peek(p) == 'e' || lexer_peek(p) == 'E') {
+        lexer_advance(p);
+        if (lexer_peek(p) == '-' || lexer_peek(p) == '+')
+            lexer_advance(p);
+        valid = lexer_peek_digit(p);
+        while (lexer_peek_digit(p))
+            lexer_advance(p);
+    }
+    if (!lexer_eof(p) && !is_terminator(lexer_peek(p))) {
+        valid = false;
+        lexer_advance_to(p, lexer_scan(p, SCAN_ATOM));
+    }
+    return TOKEN(valid ? MEL_TOKEN_NUMBER : MEL_TOKEN_ERROR);
 }
 
 static mel_token_t read_string(mel_lexer_t *p) {
     mel_token_t ret = TOKEN(MEL_TOKEN_ERROR);
     lexer_skip(p); // skip opening "
-    for (;;) {
-        if (lexer_eof(p))
-            goto BAIL; // error, unterminated "
-        if (lexer_peek(p) == L'"')
-            break;
-        else
-            lexer_advance(p);
-    }
+    lexer_advance_to(p, lexer_scan(p, SCAN_STRING));
+    if (lexer_eof(p))
+        goto BAIL; // error, unterminated "
     ret = TOKEN(MEL_TOKEN_STRING);
     lexer_skip(p); // skip terminating "
 BAIL:
     return ret;
 }
 
+static const struct keyword {
+    const char *name;
+    int length;
+    mel_token_type type;
+} keywords[1 << KEYWORD_BITS] = {
+#define X(KIND, NAME, SLOT) [SLOT] = { NAME, sizeof(NAME) - 1, MEL_TOKEN_##KIND },
+    KEYWORDS
+#undef X
+};
+
+#define KEYWORD_FOLD(C) ((C) >= 'A' && (C) <= 'Z' ? (C) | 0x20 : (C))
+
+// Keywords are matched case insensitively without copying the atom
 static mel_token_type identify(mel_lexer_t *l) {
-    int len = (int)(l->cursor - l->source);
-    char *buf = malloc(sizeof(char) * len + 1);
-    for (int i = 0; i < len; i++)
-        buf[i] = toupper(*(l->source + i));
-    buf[len] = '\0';
-    mel_token_type ret = MEL_TOKEN_ATOM;
-BAIL:
-    if (buf)
-        free(buf);
-    return ret;
+    const unsigned char *atom = (const unsigned char*)l->source;
+    int length = (int)(l->cursor - l->source);
+    if (!length || length > KEYWORD_MAX)
+        return MEL_TOKEN_ATOM;
+    const struct keyword *keyword = &keywords[KEYWORD_HASH(KEYWORD_FOLD(atom[0]), KEYWORD_FOLD(atom[length - 1]), length)];
+    if (keyword->length != length)
+        return MEL_TOKEN_ATOM;
+    for (int i = 0; i < length; i++)
+        if (KEYWORD_FOLD(atom[i]) != (unsigned char)keyword->name[i])
+            return MEL_TOKEN_ATOM;
+    return keyword->type;
+}
+
+static inline bool token_is_atom(mel_token_type type) {
+    return type == MEL_TOKEN_ATOM || type > MEL_TOKEN_KEYWORD;
 }
 
 static mel_token_t read_atom(mel_lexer_t *p) {
-    while (!lexer_eof(p) && !lexer_peek_terminators(p))
-        lexer_advance(p);
+    // Atoms can't contain a newline
+    const char *stop = lexer_scan(p, SCAN_ATOM);
+    // A terminator the other cases don't take, like '.' or ':'
+    if (stop == p->cursor)
+        return TOKEN(MEL_TOKEN_ERROR);
+    p->line_position += (int)(stop - p->cursor);
+    p->cursor = stop;
     return TOKEN(identify(p));
 }
 
@@ -232,17 +391,21 @@ static inline mel_token_t single_token(mel_lexer_t *p, mel_token_type type) {
 static mel_token_t next_token(mel_lexer_t *p) {
     lexer_update(p);
     skip_whitespace(p);
+    while (lexer_peek(p) == ';') {
+        skip_line(p);
+        skip_whitespace(p);
+    }
     if (lexer_eof(p))
         return TOKEN(MEL_TOKEN_EOF);
-    wchar_t c = lexer_peek(p);
+    char c = lexer_peek(p);
     switch (c) {
-        case ';':
-            skip_line(p);
-            return next_token(p);
         case '"':
             return read_string(p);
         case '0' ... '9':
             return read_number(p);
+        case '-':
+        case '+':
+            return lexer_next(p) >= '0' && lexer_next(p) <= '9' ? read_number(p) : read_atom(p);
         case '(':
         case ')':
         case '[':
@@ -261,45 +424,83 @@ static mel_token_t next_token(mel_lexer_t *p) {
     return TOKEN(MEL_TOKEN_ERROR);
 }
 
-static const char *token_type_str(mel_token_type type) {
-    switch (type) {
-        case MEL_TOKEN_ERROR:
-            return "ERROR";
-        case MEL_TOKEN_EOF:
-            return "EOF";
-        case MEL_TOKEN_ATOM:
-            return "ATOM";
-        case MEL_TOKEN_NUMBER:
-            return "NUMBER";
-        case MEL_TOKEN_STRING:
-            return "STRING";
-        case MEL_TOKEN_LPAREN:
-            return "LEFT_PAREN";
-        case MEL_TOKEN_RPAREN:
-            return "RIGHT_PAREN";
-        case MEL_TOKEN_SQR_LPAREN:
-            return "LEFT_SQUARE_PAREN";
-        case MEL_TOKEN_SQR_RPAREN:
-            return "RIGHT_SQUARE_PAREN";
-        case MEL_TOKEN_CRL_LPAREN:
-            return "LEFT_CURLY_PAREN";
-        case MEL_TOKEN_CRL_RPAREN:
-            return "RIGHT_CURLY_PAREN";
-        case MEL_TOKEN_SINGLE_QUOTE:
-            return "SINGLE_QUOTE";
-        case MEL_TOKEN_BACK_QUOTE:
-            return "BACK_QUOTE";
-        case MEL_TOKEN_AT:
-            return "AT";
-        case MEL_TOKEN_HASH:
-            return "HASH";
-        case MEL_TOKEN_COLON:
-            return "COLON";
-    }
-}
+// Tracks just enough syntax to tell where top-level forms end, so streamed
+// input can be handed to the compiler one complete form at a time
+typedef enum {
+    FORM_SPACE,
+    FORM_ATOM,
+    FORM_STRING,
+    FORM_COMMENT
+} mel_form_state;
+
+typedef struct mel_form_scanner {
+    mel_form_state state;
+    int depth;
+} mel_form_scanner_t;
 
-static void print_token(mel_token_t *token) {
-    wprintf(L"(MEL_TOKEN_%s, \"%.*ls\", %d:%d:%d)\n", token_type_str(token->type), token->length, token->cursor, token->line, token->position, token->length);
+// Scans str[from, length) and returns the end of the last complete
+// top-level form, 0 if none ended. Unbalanced closers are left for the
+// compiler to report
+static size_t scan_forms(mel_form_scanner_t *s, const char *str, size_t from, size_t length) {
+    size_t end = 0;
+    for (size_t i = from; i < length; i++) {
+        char c = str[i];
+        switch (s->state) {
+            case FORM_STRING: {
+                const char *quote = memchr(str + i, '"', length - i);
+                if (!quote)
+                    return end;
+                i = quote - str;
+                s->state = FORM_SPACE;
+                if (!s->depth)
+                    end = i + 1;
+                continue;
+            }
+            case FORM_COMMENT: {
+                const char *newline = memchr(str + i, '\n', length - i);
+                if (!newline)
+                    return end;
+                i = newline - str;
+                s->state = FORM_SPACE;
+                continue;
+            }
+            case FORM_ATOM:
+                if (!is_terminator(c))
+                    continue;
+                s->state = FORM_SPACE;
+                if (!s->depth)
+                    end = i;
+                break;
+            case FORM_SPACE:
+                break;
+        }
+        switch (c) {
+            case '"':
+                s->state = FORM_STRING;
+                break;
+            case ';':
+                s->state = FORM_COMMENT;
+                break;
+            case '(':
+            case '[':
+            case '{':
+                s->depth++;
+                break;
+            case ')':
+            case ']':
+            case '}':
+                if (s->depth)
+                    s->depth--;
+                if (!s->depth)
+                    end = i + 1;
+                break;
+            default:
+                if (!is_terminator(c))
+                    s->state = FORM_ATOM;
+                break;
+        }
+    }
+    return end;
 }
 
 static mel_token_t lexer_consume(mel_lexer_t *lexer) {
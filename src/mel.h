@@ -1,12 +1,20 @@
 #ifndef MEL_HEADER
 #define MEL_HEADER
+// mmap's MAP_ANONYMOUS and friends are hidden by a strict -std=c11
+#if defined(MEL_IMPLEMENTATION) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
 #ifdef __cplusplus
 extern "C" {
 #endif
+#include <stdio.h>
 #include <wchar.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#ifdef MEL_NAN_BOXING
+#include <string.h>
+#endif
 
 typedef double mel_float;
 
@@ -22,6 +30,17 @@ typedef enum mel_value_type {
 #undef X
 } mel_value_type;
 
+#ifdef MEL_NAN_BOXING
+// Numbers are stored as plain doubles, everything else hides in the
+// payload of a quiet NaN. Objects also set the sign bit.
+typedef uint64_t mel_value_t;
+
+#define MEL_QNAN ((uint64_t)0x7ffc000000000000)
+#define MEL_SIGN ((uint64_t)0x8000000000000000)
+#define MEL_TAG_NIL 1
+#define MEL_TAG_FALSE 2
+#define MEL_TAG_TRUE 3
+#else
 typedef struct {
     mel_value_type type;
     union {
@@ -30,22 +49,171 @@ typedef struct {
 #undef X
     } as;
 } mel_value_t;
+#endif
 
 typedef enum mel_object_type {
     MEL_OBJECT_STRING,
-    MEL_OBJECT_TABLE
+    MEL_OBJECT_TABLE,
+    MEL_OBJECT_FUNCTION,
+    MEL_OBJECT_NATIVE,
+    MEL_OBJECT_ROPE,
+    MEL_OBJECT_ARRAY,
+    MEL_OBJECT_CELL,
+    MEL_OBJECT_CLOSURE
 } mel_object_type;
 
 typedef struct mel_object {
     mel_object_type type;
+    uint32_t mark;
+    struct mel_object *next;
 } mel_object_t;
 
+// Every allocation a VM makes goes through its allocator. reset is
+// optional, with it mel_vm_reset drops the whole heap in one call
+typedef struct mel_allocator {
+    void*(*alloc)(void *ud, size_t size);
+    void*(*realloc)(void *ud, void *ptr, size_t size);
+    void(*free)(void *ud, void *ptr);
+    void(*reset)(void *ud);
+    void *ud;
+} mel_allocator_t;
+
+// Bump allocator over a list of chunks, see mel_arena_allocator
+typedef struct mel_arena {
+    struct mel_arena_chunk *first;
+    struct mel_arena_chunk *current;
+    size_t chunk_size;
+} mel_arena_t;
+
+#ifdef MEL_NAN_BOXING
+#define MEL_BOX_BOOLEAN(V) (MEL_QNAN | ((V) ? MEL_TAG_TRUE : MEL_TAG_FALSE))
+#define MEL_IS_BOOLEAN(V) (((V) | 1) == (MEL_QNAN | MEL_TAG_TRUE))
+#define MEL_UNBOX_BOOLEAN(V) ((V) == (MEL_QNAN | MEL_TAG_TRUE))
+#define MEL_BOX_NUMBER(V) mel_float_bits(V)
+#define MEL_IS_NUMBER(V) (((V) & MEL_QNAN) != MEL_QNAN)
+#define MEL_UNBOX_NUMBER(V) mel_bits_float(V)
+#define MEL_BOX_OBJECT(V) (MEL_SIGN | MEL_QNAN | (uint64_t)(uintptr_t)(V))
+#define MEL_IS_OBJECT(V) (((V) & (MEL_SIGN | MEL_QNAN)) == (MEL_SIGN | MEL_QNAN))
+#define MEL_UNBOX_OBJECT(V) ((void*)(uintptr_t)((V) & ~(MEL_SIGN | MEL_QNAN)))
+
+static inline mel_value_t mel_float_bits(mel_float f) {
+    mel_value_t v;
+    memcpy(&v, &f, sizeof(f));
+    return v;
+}
+
+static inline mel_float mel_bits_float(mel_value_t v) {
+    mel_float f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+static inline mel_value_t mel_nil(void) {
+    return MEL_QNAN | MEL_TAG_NIL;
+}
+
+#define X(T, N, TYPE) \
+static inline mel_value_t mel_##N(TYPE v) { \
+    return MEL_BOX_##T(v); \
+} \
+static inline bool mel_is_##N(mel_value_t v) { \
+    return MEL_IS_##T(v); \
+} \
+static inline TYPE mel_as_##N(mel_value_t v) { \
+    return (TYPE)MEL_UNBOX_##T(v); \
+}
+TYPES
+#undef X
+
+static inline bool mel_is_nil(mel_value_t v) {
+    return v == (MEL_QNAN | MEL_TAG_NIL);
+}
+
+static inline mel_value_type mel_type_of(mel_value_t v) {
+    if (mel_is_number(v))
+        return MEL_VALUE_NUMBER;
+    if (mel_is_obj(v))
+        return MEL_VALUE_OBJECT;
+    return mel_is_nil(v) ? MEL_VALUE_NIL : MEL_VALUE_BOOLEAN;
+}
+#else
+static inline mel_value_t mel_nil(void) {
+    return (mel_value_t) {
+        .type = MEL_VALUE_NIL
+    };
+}
+
+#define X(T, N, TYPE) \
+static inline mel_value_t mel_##N(TYPE v) { \
+    return (mel_value_t) { \
+        .type = MEL_VALUE_##T, \
+        .as.N = v \
+    }; \
+} \
+static inline bool mel_is_##N(mel_value_t v) { \
+    return v.type == MEL_VALUE_##T; \
+} \
+static inline TYPE mel_as_##N(mel_value_t v) { \
+    return (TYPE)v.as.N; \
+}
+TYPES
+#undef X
+
+static inline bool mel_is_nil(mel_value_t v) {
+    return v.type == MEL_VALUE_NIL;
+}
+
+static inline mel_value_type mel_type_of(mel_value_t v) {
+    return v.type;
+}
+#endif
+
+static inline bool mel_is_falsey(mel_value_t v) {
+    return mel_is_nil(v) || (mel_is_boolean(v) && !mel_as_boolean(v));
+}
+
+static inline bool mel_object_is(mel_value_t value, mel_object_type type) {
+    return mel_is_obj(value) && ((mel_object_t*)mel_as_obj(value))->type == type;
+}
+
+// Strings never change once made, so one copy can be shared by everything
+// that refers to it
 typedef struct {
     mel_object_t obj;
+    // UTF-8 bytes and code points
     int length;
-    wchar_t *chars;
+    int count;
+    // Only filled in for table keys and symbols, 0 otherwise
+    uint64_t hash;
+    wchar_t *wide;
+    // Where wide comes from
+    const mel_allocator_t *allocator;
+    bool interned;
+    // Stored inline, every string is a single allocation
+    char chars[];
 } mel_string_t;
 
+typedef struct mel_rope_chunk {
+    struct mel_rope_chunk *next;
+    int size;
+    int used;
+    char data[];
+} mel_rope_chunk_t;
+
+// String built up piece by piece. Appends copy into chunks that double in
+// size, a contiguous copy is only made when something asks for one
+typedef struct mel_rope {
+    mel_object_t obj;
+    // UTF-8 bytes and code points
+    int length;
+    int count;
+    mel_rope_chunk_t *first;
+    mel_rope_chunk_t *last;
+    // Dropped by the next append
+    mel_string_t *flat;
+    const mel_allocator_t *allocator;
+} mel_rope_t;
+
 typedef struct mel_table {
     mel_object_t obj;
     size_t cap;
@@ -57,56 +225,357 @@ typedef struct mel_table {
     size_t shrinkat;
     uint8_t loadfactor;
     uint8_t growpower;
+    // Queued in gc.remembered, see gc_table_write
+    bool remembered;
     void *buckets;
     void *spare;
     void *edata;
+    // Bucket array being drained by an incremental resize
+    void *oldbuckets;
+    size_t noldbuckets;
+    size_t rehashidx;
+    // Control bytes and tombstone count for MEL_TABLE_SWISS, the index and
+    // number of holes for MEL_TABLE_ORDERED
+    uint8_t *ctrl;
+    size_t deleted;
+    // Integer keys 1..asize, nil slots are absent keys. Resized along with
+    // the hash part, see table_rebalance
+    mel_value_t *array;
+    size_t asize;
+    size_t acount;
+    // Lookups that miss fall back to the metatable, see mel_table_set_meta.
+    // Writes to a table that is some other table's metatable invalidate
+    // the send caches
+    struct mel_table *meta;
+    bool ismeta;
+    // Owning VM for the write barrier, NULL for tables from mel_table_new
+    struct mel_vm *vm;
+    const mel_allocator_t *allocator;
 } mel_table_t;
 
-typedef struct mel_vm {
+// Growable array. While every element is a number they are kept unboxed in
+// numbers, the first element that isn't moves them all into values
+typedef struct mel_array {
+    mel_object_t obj;
+    int count;
+    int capacity;
+    bool packed;
+    // Queued in gc.remembered, see gc_array_write
+    bool remembered;
+    union {
+        mel_value_t *values;
+        mel_float *numbers;
+    };
+    struct mel_vm *vm;
+    const mel_allocator_t *allocator;
+} mel_array_t;
+
+typedef enum mel_result {
+    MEL_OK,
+    MEL_COMPILE_ERROR,
+    MEL_RUNTIME_ERROR
+} mel_result;
+
+typedef struct mel_vm mel_vm_t;
+
+// argv[-1] always holds the native being called
+typedef mel_result(*mel_native_fn)(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out);
+
+#ifndef MEL_CACHE_WAYS
+#define MEL_CACHE_WAYS 4
+#endif
+
+// Inline cache for one send, the methods found for the last few
+// metatables seen there. Only valid while version matches the VM's
+typedef struct mel_cache {
+    uint32_t version;
+    int next;
+    struct mel_table *metas[MEL_CACHE_WAYS];
+    mel_value_t methods[MEL_CACHE_WAYS];
+} mel_cache_t;
+
+// Where a closure gets each captured variable from when it is made, a
+// local slot of the enclosing function or one of the enclosing closure's
+// own cells
+typedef struct mel_upvalue {
+    bool local;
+    uint8_t index;
+} mel_upvalue_t;
+
+typedef struct mel_function {
+    mel_object_t obj;
+    int arity;
+    mel_string_t *name;
+    unsigned char *code;
+    int *lines;
+    mel_value_t *constants;
+    mel_cache_t *caches;
+    mel_upvalue_t *upvalues;
+    // Most values a call has on the stack at once, the callee included
+    int slots;
+    int hotness;
+    void *jit;
+} mel_function_t;
+
+// A local variable some closure captured. Only those are boxed, the
+// compiler works out which ones they are
+typedef struct mel_cell {
+    mel_object_t obj;
+    // Queued in gc.remembered, see gc_cell_write
+    bool remembered;
+    mel_value_t value;
+} mel_cell_t;
+
+// Functions that capture nothing are called as they are
+typedef struct mel_closure {
+    mel_object_t obj;
+    mel_function_t *function;
+    int ncells;
+    mel_cell_t *cells[];
+} mel_closure_t;
+
+typedef struct mel_native {
+    mel_object_t obj;
+    const char *name;
+    mel_native_fn fn;
+    int nconstants;
+    mel_value_t *constants;
+} mel_native_t;
+
+// Globals are read and written by slot, the compiler resolves each name
+// once. vm->globals maps names to their slot numbers
+typedef struct mel_global {
+    mel_value_t value;
+    mel_string_t *name;
+    bool defined;
+} mel_global_t;
+
+typedef struct mel_frame {
+    mel_function_t *function;
+    // NULL unless the callee was a closure
+    mel_closure_t *closure;
+    unsigned char *pc;
+    mel_value_t *base;
+    // Where the result goes, the callee's slot. Only differs from base when
+    // the frame had to start a new stack segment
+    mel_value_t *ret;
+} mel_frame_t;
+
+// Values per stack segment, a function that needs more gets a bigger one
+#ifndef MEL_STACK_SEGMENT
+#define MEL_STACK_SEGMENT 8192
+#endif
+
+typedef struct mel_segment {
+    struct mel_segment *prev;
+    struct mel_segment *next;
+    // Where the values in use end while a later segment is current
+    mel_value_t *top;
+    mel_value_t *end;
+    mel_value_t values[];
+} mel_segment_t;
+
+typedef struct mel_stack {
+    mel_value_t *top;
+    mel_value_t *end;
+    mel_segment_t *segment;
+} mel_stack_t;
+
+#ifndef MEL_GC_BUDGET
+#define MEL_GC_BUDGET 1024
+#endif
+#ifndef MEL_GC_PAUSE
+#define MEL_GC_PAUSE 200
+#endif
+#ifndef MEL_GC_MIN
+#define MEL_GC_MIN 1024
+#endif
+// Nursery size in bytes, 0 allocates everything straight into the heap
+#ifndef MEL_GC_NURSERY
+#define MEL_GC_NURSERY (256 * 1024)
+#endif
+
+typedef struct mel_gc_range {
+    mel_value_t *values;
+    int count;
+} mel_gc_range_t;
+
+typedef struct mel_gc {
+    int state;
+    uint32_t epoch;
+    // Tracked objects, a step runs at the next safe point past threshold
+    size_t count;
+    size_t threshold;
+    // Work per step, and how far the heap grows (percent) before a cycle
+    size_t budget;
+    int pause;
+    mel_object_t **gray;
+    mel_object_t *partial;
+    size_t cursor;
+    mel_object_t **sweep;
+    mel_value_t **roots;
+    mel_gc_range_t *ranges;
+    // Bump allocated nursery, survivors are copied out at the next safe
+    // point after it fills up
+    char *nursery;
+    char *top;
+    char *end;
+    bool full;
+    // Old objects that may point into the nursery
+    mel_object_t **remembered;
+    mel_object_t **promoted;
+} mel_gc_t;
+
+struct mel_vm {
     unsigned char *pc;
-    mel_value_t *stack;
+    mel_stack_t stack;
+    mel_frame_t *frames;
+    // Natives being run, compiled code recurses on the C stack
+    int native_depth;
     mel_value_t current;
     mel_value_t previous;
+    // Callee and arguments of a native's mel_tail_call
+    mel_value_t *tail;
     mel_table_t *globals;
-} mel_vm_t;
+    mel_global_t *global_slots;
+    mel_table_t *symbols;
+    mel_object_t *objects;
+    mel_gc_t gc;
+    // Bumped whenever a metatable changes, moves or is freed
+    uint32_t meta_version;
+    mel_allocator_t allocator;
+    bool jit_enabled;
+    struct mel_jit_page *jit_pages;
+};
 
-bool mel_object_is(mel_value_t value, mel_object_type type);
 mel_object_t* mel_obj_new(mel_object_type type, size_t size);
 void mel_obj_destroy(mel_object_t *obj);
-mel_string_t* mel_string_new(const wchar_t *str, int length);
+mel_string_t* mel_string_new(const char *str, int length);
 #define mel_is_string(VAL) (mel_object_is((VAL), MEL_OBJECT_STRING))
 #define mel_as_string(VAL) ((mel_string_t*)mel_as_obj((VAL)))
+// These also take ropes, which are flattened when the text is asked for
+const char* mel_string_utf8(mel_value_t melv);
 const wchar_t* mel_string_cstr(mel_value_t melv);
 int mel_string_length(mel_value_t melv);
+int mel_string_size(mel_value_t melv);
+#define mel_is_rope(VAL) (mel_object_is((VAL), MEL_OBJECT_ROPE))
+#define mel_as_rope(VAL) ((mel_rope_t*)mel_as_obj((VAL)))
+bool mel_rope_append(mel_value_t melv, const char *chars, int length);
 mel_table_t* mel_table_new(void);
 #define mel_is_table(VAL) (mel_object_is((VAL), MEL_OBJECT_TABLE))
 #define mel_as_table(VAL) ((mel_table_t*)mel_as_obj((VAL)))
-int mel_table_set(mel_value_t melv, const wchar_t *key, mel_value_t val);
-mel_value_t* mel_table_get(mel_value_t melv, const wchar_t *key);
-int mel_table_del(mel_value_t melv, const wchar_t *key);
+int mel_table_set(mel_value_t melv, const char *key, mel_value_t val);
+mel_value_t* mel_table_get(mel_value_t melv, const char *key);
+int mel_table_del(mel_value_t melv, const char *key);
 void mel_table_clear(mel_value_t melv);
 int mel_table_count(mel_value_t melv);
+// Steps through the entries, *cursor starts at 0. Keys in the array part
+// come first in order, then the hash part, in insertion order with
+// MEL_TABLE_ORDERED. Keys must not be added or removed while iterating
+bool mel_table_next(mel_value_t melv, size_t *cursor, mel_value_t *key, mel_value_t *value);
+// Keys missing from a table are looked up in its metatable, then in that
+// one's metatable and so on. nil removes it, false means it would loop
+bool mel_table_set_meta(mel_value_t melv, mel_value_t meta);
+mel_value_t mel_table_get_meta(mel_value_t melv);
+mel_value_t* mel_table_lookup(mel_value_t melv, mel_value_t key);
+// Symbol keys must come from mel_intern, they are compared by pointer
+int mel_table_set_symbol(mel_value_t melv, mel_string_t *key, mel_value_t val);
+mel_value_t* mel_table_get_symbol(mel_value_t melv, mel_string_t *key);
+int mel_table_del_symbol(mel_value_t melv, mel_string_t *key);
+// Any value but nil and NaN, strings match by text and other objects by
+// identity. Keys 1..n are kept in an array part
+int mel_table_set_value(mel_value_t melv, mel_value_t key, mel_value_t val);
+mel_value_t* mel_table_get_value(mel_value_t melv, mel_value_t key);
+int mel_table_del_value(mel_value_t melv, mel_value_t key);
+#define mel_is_array(VAL) (mel_object_is((VAL), MEL_OBJECT_ARRAY))
+#define mel_as_array(VAL) ((mel_array_t*)mel_as_obj((VAL)))
+int mel_array_count(mel_value_t melv);
+// Out of range reads give nil, writes and pushes return false
+mel_value_t mel_array_get(mel_value_t melv, int index);
+bool mel_array_set(mel_value_t melv, int index, mel_value_t val);
+bool mel_array_push(mel_value_t melv, mel_value_t val);
+#define mel_is_function(VAL) (mel_object_is((VAL), MEL_OBJECT_FUNCTION))
+#define mel_as_function(VAL) ((mel_function_t*)mel_as_obj((VAL)))
+#define mel_is_native(VAL) (mel_object_is((VAL), MEL_OBJECT_NATIVE))
+#define mel_as_native(VAL) ((mel_native_t*)mel_as_obj((VAL)))
+#define mel_is_closure(VAL) (mel_object_is((VAL), MEL_OBJECT_CLOSURE))
+#define mel_as_closure(VAL) ((mel_closure_t*)mel_as_obj((VAL)))
+#define mel_is_cell(VAL) (mel_object_is((VAL), MEL_OBJECT_CELL))
+#define mel_as_cell(VAL) ((mel_cell_t*)mel_as_obj((VAL)))
 
-mel_value_t mel_nil(void);
-#define X(T, N, TYPE) \
-mel_value_t mel_##N(TYPE v);
-TYPES
-#undef X
-
-typedef enum mel_result {
-    MEL_OK,
-    MEL_COMPILE_ERROR,
-    MEL_RUNTIME_ERROR
-} mel_result;
+bool mel_equal(mel_value_t a, mel_value_t b);
 
 void mel_fprint(FILE *stream, mel_value_t v);
 void mel_print(mel_value_t v);
 
 void mel_init(mel_vm_t *vm);
+// allocator is copied, NULL uses malloc
+void mel_init_with(mel_vm_t *vm, const mel_allocator_t *allocator);
 void mel_destroy(mel_vm_t *vm);
+// Starts over with an empty VM on the same allocator. Natives defined by
+// the host have to be defined again
+void mel_vm_reset(mel_vm_t *vm);
+
+// chunk_size 0 uses MEL_ARENA_CHUNK. The arena has to outlive any VM
+// using it, frees are ignored unless they undo the latest allocation
+void mel_arena_init(mel_arena_t *arena, size_t chunk_size);
+mel_allocator_t mel_arena_allocator(mel_arena_t *arena);
+void mel_arena_free(mel_arena_t *arena);
+
+// Objects from mel_new_* belong to the collector. Values the host holds on
+// to between calls must be rooted with mel_gc_root, mel_gc_push roots a C
+// array until the native that pushed it returns. New strings and tables
+// start out in the nursery and move when they survive it, rooted slots are
+// updated to follow them
+mel_value_t mel_new_string(mel_vm_t *vm, const char *chars, int length);
+mel_value_t mel_new_table(mel_vm_t *vm);
+mel_value_t mel_new_rope(mel_vm_t *vm);
+// Copies count values, or makes an empty array with room for count when
+// values is NULL
+mel_value_t mel_new_array(mel_vm_t *vm, int count, const mel_value_t *values);
+mel_string_t* mel_intern(mel_vm_t *vm, const char *chars, int length);
+// Cells are read through mel_as_cell(cell)->value, but have to be written
+// with mel_cell_set
+mel_value_t mel_new_cell(mel_vm_t *vm, mel_value_t value);
+void mel_cell_set(mel_vm_t *vm, mel_value_t cell, mel_value_t value);
+mel_value_t mel_new_native(mel_vm_t *vm, const char *name, mel_native_fn fn, int nconstants, const mel_value_t *constants);
+
+void mel_define(mel_vm_t *vm, const char *name, mel_value_t value);
+void mel_define_native(mel_vm_t *vm, const char *name, mel_native_fn fn);
+// Pointers into the global slots last until the next new global name
+mel_value_t* mel_lookup(mel_vm_t *vm, const char *name);
+// Slot for a global name, a new name gets an undefined slot
+int mel_global_slot(mel_vm_t *vm, const char *name, int length);
+mel_result mel_call(mel_vm_t *vm, mel_value_t callee, int argc, mel_value_t *argv, mel_value_t *out);
+// Calls the method name from the metatables of argv[0] with argv as the
+// arguments, the receiver included
+mel_result mel_send(mel_vm_t *vm, mel_string_t *name, int argc, mel_value_t *argv, mel_value_t *out);
+// For a native to end with, return mel_tail_call(...). The call is made
+// once the native has returned and its result is the native's
+mel_result mel_tail_call(mel_vm_t *vm, mel_value_t callee, int argc, mel_value_t *argv);
+mel_result mel_tail_send(mel_vm_t *vm, mel_string_t *name, int argc, mel_value_t *argv);
+mel_result mel_error(mel_vm_t *vm, const char *format, ...);
+void mel_jit_enable(mel_vm_t *vm, bool enable);
+
+// A safe point, steps the collector when it is due. Everything live has to
+// be rooted by then
+void mel_gc_check(mel_vm_t *vm);
+bool mel_gc_step(mel_vm_t *vm);
+void mel_gc_collect(mel_vm_t *vm);
+void mel_gc_config(mel_vm_t *vm, size_t budget, int pause);
+void mel_gc_root(mel_vm_t *vm, mel_value_t *slot);
+void mel_gc_unroot(mel_vm_t *vm, mel_value_t *slot);
+void mel_gc_push(mel_vm_t *vm, mel_value_t *values, int count);
+void mel_gc_pop(mel_vm_t *vm);
 
-mel_result mel_eval(mel_vm_t *vm, const unsigned char *str, int str_length);
+// Fills buffer with up to size bytes, returns how many were read, 0 at the end
+typedef size_t(*mel_reader_fn)(void *userdata, char *buffer, size_t size);
+
+mel_result mel_eval(mel_vm_t *vm, const unsigned char *str, size_t str_length);
 mel_result mel_eval_file(mel_vm_t *vm, const char *path);
+mel_result mel_eval_stream(mel_vm_t *vm, mel_reader_fn reader, void *userdata);
+mel_result mel_eval_fd(mel_vm_t *vm, int fd);
+mel_result mel_aot(mel_vm_t *vm, const char *path, FILE *out, const char *module);
 
 #ifdef __cplusplus
 }
@@ -122,28 +591,103 @@ mel_result mel_eval_file(mel_vm_t *vm, const char *path);
 #include <locale.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <wctype.h>
+#include <ctype.h>
+#include <errno.h>
+
+#if !defined(MEL_NO_JIT) && defined(__x86_64__) && defined(__linux__)
+#define MEL_JIT
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define MEL_POSIX
+#elif defined(_WIN32)
+#include <io.h>
+#endif
+
+#ifndef MEL_STREAM_CHUNK
+#define MEL_STREAM_CHUNK 65536
+#endif
 
+#include "alloc.inl"
 #include "utils.inl"
 #include "types.inl"
+#include "table.inl"
+#include "stack.inl"
+#include "gc.inl"
+#include "array.inl"
+#include "simd.inl"
 #include "lexer.inl"
+#include "compiler.inl"
+#include "vm.inl"
+#include "jit.inl"
+#include "aot.inl"
 
-void mel_fprint(FILE *stream, mel_value_t v) {
-    switch (v.type) {
+static void print_value(FILE *stream, mel_value_t v) {
+    switch (mel_type_of(v)) {
         case MEL_VALUE_NIL:
-            fprintf(stream, "NIL\n");
+            fprintf(stream, "NIL");
             break;
         case MEL_VALUE_BOOLEAN:
-            fprintf(stream, "%s\n", v.as.boolean ? "T" : "NIL");
+            fprintf(stream, "%s", mel_as_boolean(v) ? "T" : "NIL");
             break;
         case MEL_VALUE_NUMBER:
-            fprintf(stream, "%g\n", v.as.number);
+            fprintf(stream, "%.14g", mel_as_number(v));
             break;
         case MEL_VALUE_OBJECT: {
             mel_object_t *obj = mel_as_obj(v);
             switch (obj->type) {
                 case MEL_OBJECT_STRING: {
                     mel_string_t *str = (mel_string_t*)obj;
-                    fwprintf(stream, L"%.*ls\n", str->length, str->chars);
+                    fprintf(stream, "%.*s", str->length, str->chars);
+                    break;
+                }
+                case MEL_OBJECT_TABLE:
+                    fprintf(stream, "#<TABLE %p>", (void*)obj);
+                    break;
+                case MEL_OBJECT_ROPE:
+                    // Straight from the chunks, nothing is flattened
+                    for (mel_rope_chunk_t *chunk = ((mel_rope_t*)obj)->first; chunk; chunk = chunk->next)
+                        fwrite(chunk->data, 1, chunk->used, stream);
+                    break;
+                case MEL_OBJECT_FUNCTION: {
+                    mel_function_t *function = (mel_function_t*)obj;
+                    if (function->name)
+                        fprintf(stream, "#<FUNCTION %s>", function->name->chars);
+                    else
+                        fprintf(stream, "#<FUNCTION %p>", (void*)obj);
+                    break;
+                }
+                case MEL_OBJECT_NATIVE:
+                    fprintf(stream, "#<NATIVE %s>", ((mel_native_t*)obj)->name);
+                    break;
+                case MEL_OBJECT_CLOSURE: {
+                    mel_function_t *function = ((mel_closure_t*)obj)->function;
+                    if (function->name)
+                        fprintf(stream, "#<FUNCTION %s>", function->name->chars);
+                    else
+                        fprintf(stream, "#<FUNCTION %p>", (void*)obj);
+                    break;
+                }
+                case MEL_OBJECT_CELL:
+                    print_value(stream, ((mel_cell_t*)obj)->value);
+                    break;
+                case MEL_OBJECT_ARRAY: {
+                    mel_array_t *array = (mel_array_t*)obj;
+                    fputc('[', stream);
+                    for (int i = 0; i < array->count; i++) {
+                        if (i)
+                            fputc(' ', stream);
+                        if (array->packed)
+                            fprintf(stream, "%.14g", array->numbers[i]);
+                        else
+                            print_value(stream, array->values[i]);
+                    }
+                    fputc(']', stream);
                     break;
                 }
                 default:
@@ -156,11 +700,20 @@ void mel_fprint(FILE *stream, mel_value_t v) {
     }
 }
 
+void mel_fprint(FILE *stream, mel_value_t v) {
+    print_value(stream, v);
+    fputc('\n', stream);
+}
+
 void mel_print(mel_value_t v) {
     mel_fprint(stdout, v);
 }
 
 void mel_init(mel_vm_t *vm) {
+    mel_init_with(vm, NULL);
+}
+
+void mel_init_with(mel_vm_t *vm, const mel_allocator_t *allocator) {
 #ifdef __APPLE__
     // XCode won't print wprintf otherwise...
     setlocale(LC_ALL, "en_US.UTF-8");
@@ -168,43 +721,324 @@ void mel_init(mel_vm_t *vm) {
     setlocale(LC_ALL, "");
 #endif
     memset(vm, 0, sizeof(mel_vm_t));
+    vm->allocator = allocator ? *allocator : mel_default_allocator;
+    stack_init(vm);
+    garry_with(vm->frames, &vm->allocator);
+    garry_with(vm->tail, &vm->allocator);
+    gc_init(vm);
+    vm->current = vm->previous = mel_nil();
+    vm->meta_version = 1;
+    vm->globals = table_new(&vm->allocator, 16);
+    vm->globals->vm = vm;
+    garry_with(vm->global_slots, &vm->allocator);
+    vm->symbols = table_new(&vm->allocator, 16);
+#ifdef MEL_JIT
+    vm->jit_enabled = true;
+#endif
+    define_natives(vm);
 }
 
 void mel_destroy(mel_vm_t *vm) {
-    if (vm->stack)
-        garry_free(vm->stack);
+    mel_object_t *obj = vm->objects;
+    while (obj) {
+        mel_object_t *next = obj->next;
+        obj_destroy(&vm->allocator, obj);
+        obj = next;
+    }
+    vm->objects = NULL;
+    // Young tables still point at the symbols
+    gc_free(vm);
+    if (vm->globals)
+        table_free(vm->globals);
+    vm->globals = NULL;
+    garry_free(vm->global_slots);
+    if (vm->symbols)
+        symbols_free(vm->symbols);
+    vm->symbols = NULL;
+    stack_free(vm);
+    if (vm->frames)
+        garry_free(vm->frames);
+    garry_free(vm->tail);
+#ifdef MEL_JIT
+    jit_free(vm);
+#endif
+}
+
+void mel_vm_reset(mel_vm_t *vm) {
+    mel_allocator_t allocator = vm->allocator;
+    if (allocator.reset) {
+        // Everything lives in the allocator except executable pages
+#ifdef MEL_JIT
+        jit_free(vm);
+#endif
+        allocator.reset(allocator.ud);
+    } else
+        mel_destroy(vm);
+    mel_init_with(vm, &allocator);
+}
+
+void mel_jit_enable(mel_vm_t *vm, bool enable) {
+#ifdef MEL_JIT
+    vm->jit_enabled = enable;
+#else
+    (void)vm;
+    (void)enable;
+#endif
+}
+
+int mel_global_slot(mel_vm_t *vm, const char *name, int length) {
+    mel_string_t *symbol = mel_intern(vm, name, length);
+    mel_value_t *slot = mel_table_get_symbol(mel_obj(vm->globals), symbol);
+    if (slot)
+        return (int)mel_as_number(*slot);
+    int index = garry_count(vm->global_slots);
+    garry_append(vm->global_slots, ((mel_global_t) {
+        .value = mel_nil(),
+        .name = symbol,
+        .defined = false
+    }));
+    mel_table_set_symbol(mel_obj(vm->globals), symbol, mel_number(index));
+    return index;
+}
+
+void mel_define(mel_vm_t *vm, const char *name, mel_value_t value) {
+    // The slot array may grow, so index it only after the call
+    int slot = mel_global_slot(vm, name, (int)strlen(name));
+    mel_global_t *global = &vm->global_slots[slot];
+    global->value = value;
+    global->defined = true;
+}
+
+void mel_define_native(mel_vm_t *vm, const char *name, mel_native_fn fn) {
+    mel_define(vm, name, mel_new_native(vm, name, fn, 0, NULL));
+}
+
+mel_value_t* mel_lookup(mel_vm_t *vm, const char *name) {
+    mel_value_t *slot = mel_table_get(mel_obj(vm->globals), name);
+    if (!slot)
+        return NULL;
+    mel_global_t *global = &vm->global_slots[(int)mel_as_number(*slot)];
+    return global->defined ? &global->value : NULL;
+}
+
+mel_value_t mel_new_string(mel_vm_t *vm, const char *chars, int length) {
+    mel_string_t *str = nursery_alloc(vm, string_size(length));
+    if (str)
+        string_init(str, &vm->allocator, chars, length);
+    else {
+        str = string_new(&vm->allocator, chars, length);
+        track_object(vm, (mel_object_t*)str);
+    }
+    return mel_obj(str);
+}
+
+mel_value_t mel_new_table(mel_vm_t *vm) {
+    mel_table_t *table = nursery_alloc(vm, table_size());
+    if (table && !table_init(table, &vm->allocator, 16)) {
+        // Hand the space back so the nursery stays walkable
+        vm->gc.top = (char*)table;
+        table = NULL;
+    }
+    if (!table) {
+        table = table_new(&vm->allocator, 16);
+        track_object(vm, (mel_object_t*)table);
+    }
+    table->vm = vm;
+    return mel_obj(table);
 }
 
-mel_result mel_eval(mel_vm_t *vm, const unsigned char *str, int str_length) {
+mel_value_t mel_new_rope(mel_vm_t *vm) {
+    mel_rope_t *rope = (mel_rope_t*)obj_new(&vm->allocator, MEL_OBJECT_ROPE, sizeof(mel_rope_t));
+    rope->length = rope->count = 0;
+    rope->first = rope->last = NULL;
+    rope->flat = NULL;
+    rope->allocator = &vm->allocator;
+    track_object(vm, &rope->obj);
+    return mel_obj(rope);
+}
+
+mel_value_t mel_new_cell(mel_vm_t *vm, mel_value_t value) {
+    mel_cell_t *cell = (mel_cell_t*)obj_new(&vm->allocator, MEL_OBJECT_CELL, sizeof(mel_cell_t));
+    cell->remembered = false;
+    cell->value = mel_nil();
+    track_object(vm, &cell->obj);
+    cell_set(vm, cell, value);
+    return mel_obj(cell);
+}
+
+void mel_cell_set(mel_vm_t *vm, mel_value_t cell, mel_value_t value) {
+    assert(mel_is_cell(cell));
+    cell_set(vm, mel_as_cell(cell), value);
+}
+
+mel_string_t* mel_intern(mel_vm_t *vm, const char *chars, int length) {
+    struct lookup key;
+    lookup_string(&key, chars, length, string_hash(chars, length), NULL);
+    struct entry *item = table_find(vm->symbols, &key);
+    if (item)
+        return mel_as_string(item->key);
+    mel_string_t *symbol = string_new(&vm->allocator, chars, length);
+    symbol->hash = key.hash;
+    symbol->interned = true;
+    table_insert(vm->symbols, key.hash, mel_obj(symbol), mel_nil());
+    return symbol;
+}
+
+mel_value_t mel_new_native(mel_vm_t *vm, const char *name, mel_native_fn fn, int nconstants, const mel_value_t *constants) {
+    mel_native_t *native = native_new(&vm->allocator, name, fn);
+    track_object(vm, (mel_object_t*)native);
+    if (nconstants) {
+        native->constants = mem_alloc(&vm->allocator, sizeof(mel_value_t) * nconstants);
+        memcpy(native->constants, constants, sizeof(mel_value_t) * nconstants);
+        native->nconstants = nconstants;
+        // The new native is already marked if a cycle is running
+        if (vm->gc.state == MEL_GC_MARK)
+            gc_mark_values(vm, native->constants, nconstants);
+        for (int i = 0; i < nconstants; i++)
+            if (gc_young_value(vm, constants[i])) {
+                garry_append(vm->gc.remembered, &native->obj);
+                break;
+            }
+    }
+    return mel_obj(native);
+}
+
+// *line carries the line count across calls so streamed chunks report
+// errors against the whole input
+static mel_result eval_source(mel_vm_t *vm, const char *str, size_t str_length, int *line) {
     mel_result ret = MEL_COMPILE_ERROR;
     if (!str || !str_length)
-        goto BAIL;
-    const wchar_t *wstr = to_wide(str, str_length, &str_length);
+        return ret;
     mel_lexer_t lexer;
-    lexer_init(&lexer, wstr, str_length);
+    lexer_init(&lexer, str, str_length);
+    lexer.current_line = *line;
+    mel_parser_t parser = {
+        .vm = vm,
+        .lexer = &lexer,
+        .line = 0,
+        .had_error = false
+    };
+    lexer_consume(&lexer);
+    while (lexer.current.type != MEL_TOKEN_EOF) {
+        mel_function_t *function = compile(&parser);
+        if (!function) {
+            ret = MEL_COMPILE_ERROR;
+            goto BAIL;
+        }
+        vm->previous = vm->current;
+        if ((ret = mel_call(vm, mel_obj(function), 0, NULL, &vm->current)) != MEL_OK)
+            goto BAIL;
+    }
+    ret = MEL_OK;
+BAIL:
+    *line = lexer.current_line;
+    lexer_free(&lexer);
+    return ret;
+}
+
+mel_result mel_eval(mel_vm_t *vm, const unsigned char *str, size_t str_length) {
+    int line = 0;
+    return eval_source(vm, (const char*)str, str_length, &line);
+}
+
+mel_result mel_eval_stream(mel_vm_t *vm, mel_reader_fn reader, void *userdata) {
+    mel_result ret = MEL_OK;
+    mel_form_scanner_t scanner = { .state = FORM_SPACE, .depth = 0 };
+    char *buffer = NULL;
+    size_t size = 0, capacity = 0, scanned = 0;
+    int line = 0;
     for (;;) {
-        lexer_consume(&lexer);
-        switch (lexer.current.type) {
-            case MEL_TOKEN_ERROR:
-            case MEL_TOKEN_EOF:
+        if (capacity - size < MEL_STREAM_CHUNK) {
+            size_t new_capacity = capacity ? capacity * 2 : MEL_STREAM_CHUNK;
+            while (new_capacity - size < MEL_STREAM_CHUNK)
+                new_capacity *= 2;
+            char *new_buffer = mem_realloc(&vm->allocator, buffer, new_capacity);
+            if (!new_buffer) {
+                ret = MEL_RUNTIME_ERROR;
                 goto BAIL;
-            default:
-                print_token(&lexer.current);
-                break;
+            }
+            buffer = new_buffer;
+            capacity = new_capacity;
         }
+        size_t read = reader(userdata, buffer + size, MEL_STREAM_CHUNK);
+        if (!read)
+            break;
+        size += read;
+        // Only complete forms are evaluated, the tail waits for more input
+        size_t end = scan_forms(&scanner, buffer, scanned, size);
+        scanned = size;
+        if (!end)
+            continue;
+        if ((ret = eval_source(vm, buffer, end, &line)) != MEL_OK)
+            goto BAIL;
+        memmove(buffer, buffer + end, size - end);
+        size -= end;
+        scanned -= end;
     }
+    if (size)
+        ret = eval_source(vm, buffer, size, &line);
 BAIL:
-    lexer_free(&lexer);
+    mem_free(&vm->allocator, buffer);
     return ret;
 }
 
+static size_t fd_reader(void *userdata, char *buffer, size_t size) {
+    int fd = *(int*)userdata;
+    for (;;) {
+#ifdef _WIN32
+        int result = _read(fd, buffer, (unsigned)size);
+#else
+        ssize_t result = read(fd, buffer, size);
+        if (result < 0 && errno == EINTR)
+            continue;
+#endif
+        return result > 0 ? (size_t)result : 0;
+    }
+}
+
+mel_result mel_eval_fd(mel_vm_t *vm, int fd) {
+    return mel_eval_stream(vm, fd_reader, &fd);
+}
+
+#ifndef MEL_POSIX
+static size_t file_reader(void *userdata, char *buffer, size_t size) {
+    return fread(buffer, 1, size, (FILE*)userdata);
+}
+#endif
+
 mel_result mel_eval_file(mel_vm_t *vm, const char *path) {
-    int src_length;
-    const unsigned char *src = read_file(path, &src_length);
-    if (!src || !src_length)
-        return MEL_COMPILE_ERROR;
-    mel_result ret = mel_eval(vm, src, src_length);
-    free((void*)src);
+    mel_result ret = MEL_COMPILE_ERROR;
+#ifdef MEL_POSIX
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return ret;
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        // Pipes and the like can't be mapped
+        ret = mel_eval_fd(vm, fd);
+        goto BAIL;
+    }
+    if (!st.st_size)
+        goto BAIL;
+    void *src = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (src == MAP_FAILED) {
+        ret = mel_eval_fd(vm, fd);
+        goto BAIL;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(src, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+    ret = mel_eval(vm, src, (size_t)st.st_size);
+    munmap(src, (size_t)st.st_size);
+BAIL:
+    close(fd);
+#else
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return ret;
+    ret = mel_eval_stream(vm, file_reader, file);
+    fclose(file);
+#endif
     return ret;
 }
 #endif
@@ -0,0 +1,198 @@
+// Entries are appended to a dense array in insertion order, a separate
+// open addressed index maps hashes to positions in it. Index slots are as
+// narrow as the table allows, a deleted entry is left as a hole with a nil
+// key until the next resize compacts the array
+struct slot {
+    struct entry item;
+    uint64_t hash;
+};
+
+// Index slots hold the entry position + 1, 0 is empty
+static inline size_t index_width(size_t nbuckets) {
+    return nbuckets <= 0x100 ? 1 : nbuckets <= 0x10000 ? 2 : 4;
+}
+
+static inline size_t index_get(mel_table_t *table, size_t i) {
+    switch (index_width(table->nbuckets)) {
+        case 1:
+            return table->ctrl[i];
+        case 2:
+            return ((uint16_t*)table->ctrl)[i];
+        default:
+            return ((uint32_t*)table->ctrl)[i];
+    }
+}
+
+static inline void index_set(mel_table_t *table, size_t i, size_t position) {
+    switch (index_width(table->nbuckets)) {
+        case 1:
+            table->ctrl[i] = (uint8_t)position;
+            break;
+        case 2:
+            ((uint16_t*)table->ctrl)[i] = (uint16_t)position;
+            break;
+        default:
+            ((uint32_t*)table->ctrl)[i] = (uint32_t)position;
+            break;
+    }
+}
+
+static inline struct slot* slot_at(mel_table_t *table, size_t position) {
+    return &((struct slot*)table->buckets)[position];
+}
+
+static bool ordered_alloc(mel_table_t *table, size_t nbuckets) {
+    // 2/3 max load, holes included
+    size_t growat = nbuckets - nbuckets / 3;
+    uint8_t *index = mem_calloc(table->allocator, nbuckets, index_width(nbuckets));
+    void *entries = mem_alloc(table->allocator, growat * table->bucketsz);
+    if (!index || !entries) {
+        mem_free(table->allocator, index);
+        mem_free(table->allocator, entries);
+        return false;
+    }
+    table->ctrl = index;
+    table->buckets = entries;
+    table->nbuckets = nbuckets;
+    table->mask = nbuckets - 1;
+    table->deleted = 0;
+    table->growat = growat;
+    table->shrinkat = nbuckets * SHRINK_AT;
+    return true;
+}
+
+static size_t table_size(void) {
+    return sizeof(mel_table_t);
+}
+
+static void table_relocate(mel_table_t *table) {
+    // Nothing points back into the table
+    (void)table;
+}
+
+static bool table_init(mel_table_t *table, const mel_allocator_t *allocator, size_t cap) {
+    memset(table, 0, sizeof(mel_table_t));
+    table->obj.type = MEL_OBJECT_TABLE;
+    table->allocator = allocator;
+    table->bucketsz = sizeof(struct slot);
+    table->cap = cap;
+    table->growpower = 1;
+    return ordered_alloc(table, cap);
+}
+
+static void table_rehash(mel_table_t *table, size_t limit) {
+    // Ordered tables always resize in one go
+    (void)table;
+    (void)limit;
+}
+
+static struct entry* table_find(mel_table_t *table, const struct lookup *key) {
+    for (size_t i = key->hash & table->mask;; i = (i + 1) & table->mask) {
+        size_t position = index_get(table, i);
+        if (!position)
+            return NULL;
+        struct slot *slot = slot_at(table, position - 1);
+        // Holes have a nil key and never match
+        if (slot->hash == key->hash && entry_matches(&slot->item, key))
+            return &slot->item;
+    }
+}
+
+static void table_place(mel_table_t *table, uint64_t hash, mel_value_t key, mel_value_t val) {
+    size_t position = table->count + table->deleted;
+    *slot_at(table, position) = (struct slot) {
+        .item = { .key = key, .value = val },
+        .hash = hash
+    };
+    size_t i = hash & table->mask;
+    while (index_get(table, i))
+        i = (i + 1) & table->mask;
+    index_set(table, i, position + 1);
+}
+
+// Also drops the holes, entries keep their order
+static bool table_resize(mel_table_t *table, size_t new_cap) {
+    uint8_t *index = table->ctrl;
+    struct slot *entries = table->buckets;
+    size_t used = table->count + table->deleted;
+    if (!ordered_alloc(table, new_cap))
+        return false;
+    table->count = 0;
+    for (size_t i = 0; i < used; i++)
+        if (!mel_is_nil(entries[i].item.key)) {
+            table_place(table, entries[i].hash, entries[i].item.key, entries[i].item.value);
+            table->count++;
+        }
+    mem_free(table->allocator, index);
+    mem_free(table->allocator, entries);
+    return true;
+}
+
+static void table_insert(mel_table_t *table, uint64_t hash, mel_value_t key, mel_value_t val) {
+    if (table->count + table->deleted >= table->growat) {
+        // Mostly holes means compacting is enough
+        size_t new_cap = table->count >= table->growat / 2 ?
+            table->nbuckets*(1<<table->growpower) :
+            table->nbuckets;
+        table_resize(table, new_cap);
+    }
+    table_place(table, hash, key, val);
+    table->count++;
+}
+
+static void table_remove(mel_table_t *table, struct entry *item) {
+    // The index still points at the hole, so probes carry on past it
+    item->key = mel_nil();
+    item->value = mel_nil();
+    table->count--;
+    table->deleted++;
+    if (table->nbuckets > table->cap && table->count <= table->shrinkat)
+        table_resize(table, table->nbuckets/2);
+}
+
+static struct entry* table_next(mel_table_t *table, size_t *index) {
+    while (*index < table->count + table->deleted) {
+        struct slot *slot = slot_at(table, (*index)++);
+        if (!mel_is_nil(slot->item.key))
+            return &slot->item;
+    }
+    return NULL;
+}
+
+// Hashes keys that hash by address again after they have moved. The
+// entries stay where they are, so the order is kept
+static void table_reindex(mel_table_t *table) {
+    size_t used = table->count + table->deleted;
+    for (size_t i = 0; i < used; i++) {
+        struct slot *slot = slot_at(table, i);
+        if (!mel_is_nil(slot->item.key) && !mel_is_string(slot->item.key))
+            slot->hash = value_hash(slot->item.key);
+    }
+    if (!table_resize(table, table->nbuckets)) {
+        memset(table->ctrl, 0, table->nbuckets * index_width(table->nbuckets));
+        for (size_t i = 0; i < used; i++) {
+            size_t j = slot_at(table, i)->hash & table->mask;
+            while (index_get(table, j))
+                j = (j + 1) & table->mask;
+            index_set(table, j, i + 1);
+        }
+    }
+}
+
+static void table_reset(mel_table_t *table) {
+    uint8_t *index = table->ctrl;
+    void *entries = table->buckets;
+    if (ordered_alloc(table, table->cap)) {
+        mem_free(table->allocator, index);
+        mem_free(table->allocator, entries);
+    } else {
+        memset(table->ctrl, 0, table->nbuckets * index_width(table->nbuckets));
+        table->deleted = 0;
+    }
+    table->count = 0;
+}
+
+static void table_dispose(mel_table_t *table) {
+    mem_free(table->allocator, table->ctrl);
+    mem_free(table->allocator, table->buckets);
+}
@@ -4,12 +4,45 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+static int usage(void) {
+    fprintf(stderr, "usage: mel [file]\n");
+    fprintf(stderr, "       mel -c file [-o out.c] [-n module]\n");
+    return 1;
+}
 
 int main(int argc, const char *argv[]) {
+    const char *path = "t/test.lisp", *output = NULL, *module = "main";
+    bool compile = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-c"))
+            compile = true;
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            output = argv[++i];
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            module = argv[++i];
+        else if (argv[i][0] == '-')
+            return usage();
+        else
+            path = argv[i];
+    }
+
     mel_vm_t vm;
     mel_init(&vm);
-    if (mel_eval_file(&vm, "t/test.lisp") != MEL_OK)
-        return 1;
+    mel_result result;
+    if (compile) {
+        FILE *out = output ? fopen(output, "w") : stdout;
+        if (!out) {
+            fprintf(stderr, "failed to open '%s'\n", output);
+            mel_destroy(&vm);
+            return 1;
+        }
+        result = mel_aot(&vm, path, out, module);
+        if (output)
+            fclose(out);
+    } else
+        result = mel_eval_file(&vm, path);
     mel_destroy(&vm);
-    return 0;
+    return result == MEL_OK ? 0 : 1;
 }
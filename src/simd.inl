@@ -0,0 +1,211 @@
+// Kernels over packed number arrays. The widest set the CPU supports is
+// picked the first time one is needed, sums are reassociated across lanes
+// so they can differ from a left to right sum in the last bits
+#if !defined(MEL_NO_SIMD) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define MEL_SIMD
+#include <immintrin.h>
+#endif
+
+typedef void(*mel_binary_kernel)(mel_float *out, const mel_float *a, const mel_float *b, size_t n);
+
+typedef struct mel_kernels {
+    mel_float(*sum)(const mel_float *a, size_t n);
+    mel_float(*dot)(const mel_float *a, const mel_float *b, size_t n);
+    // n must not be 0
+    mel_float(*min)(const mel_float *a, size_t n);
+    mel_float(*max)(const mel_float *a, size_t n);
+    mel_binary_kernel add;
+    mel_binary_kernel sub;
+    mel_binary_kernel mul;
+    mel_binary_kernel div;
+} mel_kernels_t;
+
+#define SIMD_BINARY \
+    X(add, +, add) \
+    X(sub, -, sub) \
+    X(mul, *, mul) \
+    X(div, /, div)
+
+static mel_float scalar_sum(const mel_float *a, size_t n) {
+    mel_float result = 0;
+    for (size_t i = 0; i < n; i++)
+        result += a[i];
+    return result;
+}
+
+static mel_float scalar_dot(const mel_float *a, const mel_float *b, size_t n) {
+    mel_float result = 0;
+    for (size_t i = 0; i < n; i++)
+        result += a[i] * b[i];
+    return result;
+}
+
+static mel_float scalar_min(const mel_float *a, size_t n) {
+    mel_float result = a[0];
+    for (size_t i = 1; i < n; i++)
+        if (a[i] < result)
+            result = a[i];
+    return result;
+}
+
+static mel_float scalar_max(const mel_float *a, size_t n) {
+    mel_float result = a[0];
+    for (size_t i = 1; i < n; i++)
+        if (a[i] > result)
+            result = a[i];
+    return result;
+}
+
+#define X(NAME, OP, _) \
+static void scalar_##NAME(mel_float *out, const mel_float *a, const mel_float *b, size_t n) { \
+    for (size_t i = 0; i < n; i++) \
+        out[i] = a[i] OP b[i]; \
+}
+SIMD_BINARY
+#undef X
+
+#ifndef MEL_SIMD
+static const mel_kernels_t scalar_kernels = {
+    scalar_sum, scalar_dot, scalar_min, scalar_max,
+    scalar_add, scalar_sub, scalar_mul, scalar_div
+};
+#else
+// SSE2 is part of x86-64, so these need no check
+static inline mel_float sse2_hsum(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+static mel_float sse2_sum(const mel_float *a, size_t n) {
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm_add_pd(s0, _mm_loadu_pd(a + i));
+        s1 = _mm_add_pd(s1, _mm_loadu_pd(a + i + 2));
+    }
+    return sse2_hsum(_mm_add_pd(s0, s1)) + scalar_sum(a + i, n - i);
+}
+
+static mel_float sse2_dot(const mel_float *a, const mel_float *b, size_t n) {
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    return sse2_hsum(_mm_add_pd(s0, s1)) + scalar_dot(a + i, b + i, n - i);
+}
+
+#define X(NAME, CMP) \
+static mel_float sse2_##NAME(const mel_float *a, size_t n) { \
+    if (n < 2) \
+        return a[0]; \
+    __m128d m = _mm_loadu_pd(a); \
+    size_t i = 2; \
+    for (; i + 2 <= n; i += 2) \
+        m = _mm_##NAME##_pd(m, _mm_loadu_pd(a + i)); \
+    m = _mm_##NAME##_sd(m, _mm_unpackhi_pd(m, m)); \
+    mel_float result = _mm_cvtsd_f64(m); \
+    for (; i < n; i++) \
+        if (a[i] CMP result) \
+            result = a[i]; \
+    return result; \
+}
+X(min, <)
+X(max, >)
+#undef X
+
+#define X(NAME, OP, INTRINSIC) \
+static void sse2_##NAME(mel_float *out, const mel_float *a, const mel_float *b, size_t n) { \
+    size_t i = 0; \
+    for (; i + 2 <= n; i += 2) \
+        _mm_storeu_pd(out + i, _mm_##INTRINSIC##_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i))); \
+    scalar_##NAME(out + i, a + i, b + i, n - i); \
+}
+SIMD_BINARY
+#undef X
+
+static const mel_kernels_t sse2_kernels = {
+    sse2_sum, sse2_dot, sse2_min, sse2_max,
+    sse2_add, sse2_sub, sse2_mul, sse2_div
+};
+
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 static inline mel_float avx2_hsum(__m256d v) {
+    __m128d lo = _mm256_castpd256_pd128(v), hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+AVX2 static mel_float avx2_sum(const mel_float *a, size_t n) {
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+        s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+    }
+    return avx2_hsum(_mm256_add_pd(s0, s1)) + scalar_sum(a + i, n - i);
+}
+
+AVX2 static mel_float avx2_dot(const mel_float *a, const mel_float *b, size_t n) {
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), s0);
+        s1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4), s1);
+    }
+    return avx2_hsum(_mm256_add_pd(s0, s1)) + scalar_dot(a + i, b + i, n - i);
+}
+
+#define X(NAME, CMP) \
+AVX2 static mel_float avx2_##NAME(const mel_float *a, size_t n) { \
+    if (n < 4) \
+        return scalar_##NAME(a, n); \
+    __m256d m = _mm256_loadu_pd(a); \
+    size_t i = 4; \
+    for (; i + 4 <= n; i += 4) \
+        m = _mm256_##NAME##_pd(m, _mm256_loadu_pd(a + i)); \
+    __m128d h = _mm_##NAME##_pd(_mm256_castpd256_pd128(m), _mm256_extractf128_pd(m, 1)); \
+    h = _mm_##NAME##_sd(h, _mm_unpackhi_pd(h, h)); \
+    mel_float result = _mm_cvtsd_f64(h); \
+    for (; i < n; i++) \
+        if (a[i] CMP result) \
+            result = a[i]; \
+    return result; \
+}
+X(min, <)
+X(max, >)
+#undef X
+
+#define X(NAME, OP, INTRINSIC) \
+AVX2 static void avx2_##NAME(mel_float *out, const mel_float *a, const mel_float *b, size_t n) { \
+    size_t i = 0; \
+    for (; i + 4 <= n; i += 4) \
+        _mm256_storeu_pd(out + i, _mm256_##INTRINSIC##_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i))); \
+    scalar_##NAME(out + i, a + i, b + i, n - i); \
+}
+SIMD_BINARY
+#undef X
+
+static const mel_kernels_t avx2_kernels = {
+    avx2_sum, avx2_dot, avx2_min, avx2_max,
+    avx2_add, avx2_sub, avx2_mul, avx2_div
+};
+#undef AVX2
+#endif
+
+static const mel_kernels_t* simd_kernels(void) {
+    static const mel_kernels_t *kernels = NULL;
+    if (!kernels) {
+#ifdef MEL_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            kernels = &avx2_kernels;
+        else
+            kernels = &sse2_kernels;
+#else
+        kernels = &scalar_kernels;
+#endif
+    }
+    return kernels;
+}
@@ -0,0 +1,89 @@
+// The value stack is a chain of segments. A frame never spans two of them,
+// its room is checked once when it is entered against the most values the
+// function ever has on the stack, so pushes and pops inside it are plain
+// pointer bumps. A frame that doesn't fit takes its callee and arguments
+// over to the next segment, nothing already on the stack moves. Segments
+// are kept around once made, returning and calling again across the same
+// boundary doesn't allocate
+static mel_segment_t* segment_new(mel_vm_t *vm, int size) {
+    mel_segment_t *segment = mem_alloc(&vm->allocator, sizeof(mel_segment_t) + sizeof(mel_value_t) * size);
+    if (!segment)
+        return NULL;
+    segment->prev = segment->next = NULL;
+    segment->top = segment->values;
+    segment->end = segment->values + size;
+    return segment;
+}
+
+static void segments_free(mel_vm_t *vm, mel_segment_t *segment) {
+    while (segment) {
+        mel_segment_t *next = segment->next;
+        mem_free(&vm->allocator, segment);
+        segment = next;
+    }
+}
+
+static void stack_init(mel_vm_t *vm) {
+    mel_segment_t *segment = segment_new(vm, MEL_STACK_SEGMENT);
+    vm->stack.segment = segment;
+    vm->stack.top = segment ? segment->values : NULL;
+    vm->stack.end = segment ? segment->end : NULL;
+}
+
+static void stack_free(mel_vm_t *vm) {
+    mel_segment_t *first = vm->stack.segment;
+    while (first && first->prev)
+        first = first->prev;
+    segments_free(vm, first);
+    memset(&vm->stack, 0, sizeof(mel_stack_t));
+}
+
+// Values in use in segment, the current one or one below it
+static inline int segment_count(mel_vm_t *vm, mel_segment_t *segment) {
+    return (int)((segment == vm->stack.segment ? vm->stack.top : segment->top) - segment->values);
+}
+
+// Carries on in the next segment, with room for at least size values. The
+// count values from on are moved over, they are left behind for good
+static mel_value_t* stack_grow(mel_vm_t *vm, mel_value_t *from, int count, int size) {
+    mel_segment_t *current = vm->stack.segment;
+    mel_segment_t *next = current->next;
+    if (next && next->end - next->values < size) {
+        segments_free(vm, next);
+        current->next = next = NULL;
+    }
+    if (!next) {
+        if (!(next = segment_new(vm, size > MEL_STACK_SEGMENT ? size : MEL_STACK_SEGMENT)))
+            return NULL;
+        next->prev = current;
+        current->next = next;
+    }
+    memcpy(next->values, from, sizeof(mel_value_t) * count);
+    current->top = from;
+    vm->stack.segment = next;
+    vm->stack.top = next->values + count;
+    vm->stack.end = next->end;
+    return next->values;
+}
+
+// Room for count more values pushed from C, false when out of memory
+static inline bool stack_reserve(mel_vm_t *vm, int count) {
+    return vm->stack.end - vm->stack.top >= count || stack_grow(vm, vm->stack.top, 0, count);
+}
+
+// Where a frame for the callee under the top argc values starts, with room
+// for slots values. NULL when out of memory
+static inline mel_value_t* stack_frame(mel_vm_t *vm, int argc, int slots) {
+    mel_value_t *base = vm->stack.top - argc - 1;
+    return vm->stack.end - base >= slots ? base : stack_grow(vm, base, argc + 1, slots);
+}
+
+// Drops everything from top on, top may be in an earlier segment
+static inline void stack_unwind(mel_vm_t *vm, mel_value_t *top) {
+    mel_segment_t *segment = vm->stack.segment;
+    while (top < segment->values || top > segment->end)
+        segment = segment->prev;
+    vm->stack.segment = segment;
+    vm->stack.top = top;
+    vm->stack.end = segment->end;
+}
@@ -0,0 +1,203 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Control bytes live in their own array, one per slot. Full slots store
+// the low 7 bits of the hash so a 16 slot group is filtered with a single
+// compare before any key is touched
+#define SWISS_GROUP 16
+#define SWISS_EMPTY 0x80
+#define SWISS_DELETED 0xFE
+
+static uint32_t group_match(const uint8_t *ctrl, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < SWISS_GROUP; i++)
+        if (ctrl[i] == byte)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+// Empty and deleted slots both have the high bit set
+static uint32_t group_match_free(const uint8_t *ctrl) {
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < SWISS_GROUP; i++)
+        if (ctrl[i] & 0x80)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+static int group_first(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+// Only the control byte is kept, resizing hashes the keys again
+static uint64_t key_hash(mel_value_t key) {
+    return mel_is_string(key) ? mel_as_string(key)->hash : value_hash(key);
+}
+
+static bool swiss_alloc(mel_table_t *table, size_t nbuckets) {
+    if (nbuckets < SWISS_GROUP)
+        nbuckets = SWISS_GROUP;
+    uint8_t *ctrl = mem_alloc(table->allocator, nbuckets);
+    void *buckets = mem_alloc(table->allocator, nbuckets * table->bucketsz);
+    if (!ctrl || !buckets) {
+        mem_free(table->allocator, ctrl);
+        mem_free(table->allocator, buckets);
+        return false;
+    }
+    memset(ctrl, SWISS_EMPTY, nbuckets);
+    table->ctrl = ctrl;
+    table->buckets = buckets;
+    table->nbuckets = nbuckets;
+    table->mask = nbuckets / SWISS_GROUP - 1;
+    table->deleted = 0;
+    // 7/8 max load, tombstones included
+    table->growat = nbuckets - nbuckets / 8;
+    table->shrinkat = nbuckets * SHRINK_AT;
+    return true;
+}
+
+static size_t table_size(void) {
+    return sizeof(mel_table_t);
+}
+
+static void table_relocate(mel_table_t *table) {
+    // Nothing points back into the table
+    (void)table;
+}
+
+static bool table_init(mel_table_t *table, const mel_allocator_t *allocator, size_t cap) {
+    memset(table, 0, sizeof(mel_table_t));
+    table->obj.type = MEL_OBJECT_TABLE;
+    table->allocator = allocator;
+    table->bucketsz = sizeof(struct entry);
+    table->cap = cap;
+    table->growpower = 1;
+    return swiss_alloc(table, cap);
+}
+
+static void table_rehash(mel_table_t *table, size_t limit) {
+    // Swiss tables always resize in one go
+    (void)table;
+    (void)limit;
+}
+
+static struct entry* table_find(mel_table_t *table, const struct lookup *key) {
+    struct entry *entries = table->buckets;
+    uint8_t h2 = key->hash & 0x7F;
+    size_t group = (key->hash >> 7) & table->mask;
+    for (size_t step = 1;; step++) {
+        const uint8_t *ctrl = table->ctrl + group * SWISS_GROUP;
+        for (uint32_t match = group_match(ctrl, h2); match; match &= match - 1) {
+            struct entry *item = &entries[group * SWISS_GROUP + group_first(match)];
+            if (entry_matches(item, key))
+                return item;
+        }
+        if (group_match(ctrl, SWISS_EMPTY))
+            return NULL;
+        group = (group + step) & table->mask;
+    }
+}
+
+static void table_place(mel_table_t *table, uint64_t hash, mel_value_t key, mel_value_t val) {
+    size_t group = (hash >> 7) & table->mask;
+    for (size_t step = 1;; step++) {
+        uint32_t match = group_match_free(table->ctrl + group * SWISS_GROUP);
+        if (match) {
+            size_t i = group * SWISS_GROUP + group_first(match);
+            if (table->ctrl[i] == SWISS_DELETED)
+                table->deleted--;
+            table->ctrl[i] = hash & 0x7F;
+            ((struct entry*)table->buckets)[i] = (struct entry) {
+                .key = key,
+                .value = val
+            };
+            return;
+        }
+        group = (group + step) & table->mask;
+    }
+}
+
+static bool table_resize(mel_table_t *table, size_t new_cap) {
+    uint8_t *ctrl = table->ctrl;
+    struct entry *entries = table->buckets;
+    size_t nbuckets = table->nbuckets;
+    if (!swiss_alloc(table, new_cap))
+        return false;
+    for (size_t i = 0; i < nbuckets; i++)
+        if (!(ctrl[i] & 0x80))
+            table_place(table, key_hash(entries[i].key), entries[i].key, entries[i].value);
+    mem_free(table->allocator, ctrl);
+    mem_free(table->allocator, entries);
+    return true;
+}
+
+static void table_insert(mel_table_t *table, uint64_t hash, mel_value_t key, mel_value_t val) {
+    if (table->count + table->deleted >= table->growat) {
+        // Mostly tombstones means a same size rehash is enough
+        size_t new_cap = table->count >= table->growat / 2 ?
+            table->nbuckets*(1<<table->growpower) :
+            table->nbuckets;
+        table_resize(table, new_cap);
+    }
+    table_place(table, hash, key, val);
+    table->count++;
+}
+
+static void table_remove(mel_table_t *table, struct entry *item) {
+    size_t i = item - (struct entry*)table->buckets;
+    // No probe ever continued past a group that still has an empty slot
+    if (group_match(table->ctrl + (i / SWISS_GROUP) * SWISS_GROUP, SWISS_EMPTY))
+        table->ctrl[i] = SWISS_EMPTY;
+    else {
+        table->ctrl[i] = SWISS_DELETED;
+        table->deleted++;
+    }
+    table->count--;
+    if (table->nbuckets > table->cap && table->count <= table->shrinkat)
+        table_resize(table, table->nbuckets/2);
+}
+
+static struct entry* table_next(mel_table_t *table, size_t *index) {
+    while (*index < table->nbuckets) {
+        size_t i = (*index)++;
+        if (!(table->ctrl[i] & 0x80))
+            return &((struct entry*)table->buckets)[i];
+    }
+    return NULL;
+}
+
+static void table_reset(mel_table_t *table) {
+    uint8_t *ctrl = table->ctrl;
+    void *buckets = table->buckets;
+    if (swiss_alloc(table, table->cap)) {
+        mem_free(table->allocator, ctrl);
+        mem_free(table->allocator, buckets);
+    } else
+        memset(table->ctrl, SWISS_EMPTY, table->nbuckets);
+    table->count = 0;
+    table->deleted = 0;
+}
+
+static void table_dispose(mel_table_t *table) {
+    mem_free(table->allocator, table->ctrl);
+    mem_free(table->allocator, table->buckets);
+}
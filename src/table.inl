@@ -0,0 +1,739 @@
+#define GROW_AT   0.60 /* 60% */
+#define SHRINK_AT 0.10 /* 10% */
+
+#ifndef HASHMAP_LOAD_FACTOR
+#define HASHMAP_LOAD_FACTOR GROW_AT
+#endif
+
+// Buckets migrated per table operation with MEL_TABLE_INCREMENTAL
+#ifndef MEL_TABLE_REHASH_STEP
+#define MEL_TABLE_REHASH_STEP 64
+#endif
+
+// Any value but nil and NaN can be a key. Strings match by their text and
+// everything else by value or identity. String keys are interned symbols,
+// collected strings in tables that belong to a VM, or private copies owned
+// by the table otherwise
+struct entry {
+    mel_value_t key;
+    mel_value_t value;
+};
+
+// What a lookup is after. chars is set for strings, value otherwise
+struct lookup {
+    uint64_t hash;
+    const char *chars;
+    int length;
+    mel_string_t *symbol;
+    mel_value_t value;
+};
+
+static void gc_table_write(mel_table_t *table, mel_value_t value);
+
+static uint64_t value_hash(mel_value_t value) {
+    uint64_t bits = 0;
+    switch (mel_type_of(value)) {
+        case MEL_VALUE_NUMBER: {
+            mel_float n = mel_as_number(value);
+            // -0 and 0 are the same key
+            if (n == 0)
+                n = 0;
+            memcpy(&bits, &n, sizeof(bits));
+            break;
+        }
+        case MEL_VALUE_BOOLEAN:
+            bits = mel_as_boolean(value) ? 1 : 2;
+            break;
+        case MEL_VALUE_OBJECT:
+            bits = (uintptr_t)mel_as_obj(value);
+            break;
+        default:
+            break;
+    }
+    bits ^= bits >> 30;
+    bits *= 0xBF58476D1CE4E5B9ull;
+    bits ^= bits >> 27;
+    bits *= 0x94D049BB133111EBull;
+    bits ^= bits >> 31;
+    return bits & 0xFFFFFFFFFFFF;
+}
+
+static bool same_key(mel_value_t a, mel_value_t b) {
+    if (mel_type_of(a) != mel_type_of(b))
+        return false;
+    switch (mel_type_of(a)) {
+        case MEL_VALUE_NUMBER:
+            return mel_as_number(a) == mel_as_number(b);
+        case MEL_VALUE_BOOLEAN:
+            return mel_as_boolean(a) == mel_as_boolean(b);
+        case MEL_VALUE_OBJECT:
+            return mel_as_obj(a) == mel_as_obj(b);
+        default:
+            return true;
+    }
+}
+
+static bool entry_matches(struct entry *item, const struct lookup *key) {
+    if (!key->chars)
+        return !mel_is_string(item->key) && same_key(item->key, key->value);
+    if (!mel_is_string(item->key))
+        return false;
+    mel_string_t *str = mel_as_string(item->key);
+    if (str == key->symbol)
+        return true;
+    // Two different symbols can never match
+    if ((key->symbol && str->interned) || str->hash != key->hash)
+        return false;
+    return str->length == key->length && !memcmp(str->chars, key->chars, key->length);
+}
+
+static inline void lookup_string(struct lookup *key, const char *chars, int length, uint64_t hash, mel_string_t *symbol) {
+    key->hash = hash;
+    key->chars = chars;
+    key->length = length;
+    key->symbol = symbol;
+}
+
+#ifdef MEL_TABLE_SWISS
+#include "swiss.inl"
+#elif defined(MEL_TABLE_ORDERED)
+#include "ordered.inl"
+#else
+static double clamp_load_factor(double factor, double default_factor) {
+    // Check for NaN and clamp between 50% and 90%
+    return factor != factor ? default_factor :
+           factor < 0.50 ? 0.50 :
+           factor > 0.95 ? 0.95 :
+           factor;
+}
+
+struct bucket {
+    uint64_t hash:48;
+    uint64_t dib:16;
+};
+
+static struct bucket *bucket_at0(void *buckets, size_t bucketsz, size_t i) {
+    return (struct bucket*)(((char*)buckets)+(bucketsz*i));
+}
+
+static struct bucket *bucket_at(mel_table_t *map, size_t index) {
+    return bucket_at0(map->buckets, map->bucketsz, index);
+}
+
+static void *bucket_item(struct bucket *entry) {
+    return ((char*)entry)+sizeof(struct bucket);
+}
+
+static size_t bucket_size(void) {
+    size_t bucketsz = sizeof(struct bucket) + sizeof(struct entry);
+    while (bucketsz & (sizeof(uintptr_t)-1))
+        bucketsz++;
+    return bucketsz;
+}
+
+// hashmap + spare + edata
+static size_t table_size(void) {
+    return sizeof(mel_table_t)+bucket_size()*2;
+}
+
+// Points spare and edata back into the table after it has been copied
+static void table_relocate(mel_table_t *table) {
+    table->spare = ((char*)table)+sizeof(mel_table_t);
+    table->edata = (char*)table->spare+table->bucketsz;
+}
+
+static bool table_init(mel_table_t *table, const mel_allocator_t *allocator, size_t cap) {
+    memset(table, 0, sizeof(mel_table_t));
+    table->obj.type = MEL_OBJECT_TABLE;
+    table->allocator = allocator;
+    table->bucketsz = bucket_size();
+    table_relocate(table);
+    table->cap = cap;
+    table->nbuckets = cap;
+    table->mask = table->nbuckets-1;
+    if (!(table->buckets = mem_calloc(allocator, table->nbuckets, table->bucketsz)))
+        return false;
+    table->growpower = 1;
+    table->loadfactor = clamp_load_factor(HASHMAP_LOAD_FACTOR, GROW_AT) * 100;
+    table->growat = table->nbuckets * (table->loadfactor / 100.0);
+    table->shrinkat = table->nbuckets * SHRINK_AT;
+    return true;
+}
+
+static void table_place(mel_table_t *table, struct bucket *entry) {
+    size_t i = entry->hash & table->mask;
+    for (;;) {
+        struct bucket *bucket = bucket_at(table, i);
+        if (bucket->dib == 0) {
+            memcpy(bucket, entry, table->bucketsz);
+            return;
+        }
+        if (bucket->dib < entry->dib) {
+            memcpy(table->spare, bucket, table->bucketsz);
+            memcpy(bucket, entry, table->bucketsz);
+            memcpy(entry, table->spare, table->bucketsz);
+        }
+        i = (i + 1) & table->mask;
+        entry->dib += 1;
+    }
+}
+
+// Moves up to `limit` buckets out of the old array. Drained buckets keep
+// their dib with a NULL key so probes through them still work
+static void table_rehash(mel_table_t *table, size_t limit) {
+    if (!table->oldbuckets)
+        return;
+    // Lookups migrate entries too
+    gc_table_write(table, mel_nil());
+    for (; limit && table->rehashidx < table->noldbuckets; limit--) {
+        struct bucket *bucket = bucket_at0(table->oldbuckets, table->bucketsz, table->rehashidx++);
+        struct entry *item = bucket_item(bucket);
+        if (!bucket->dib || mel_is_nil(item->key))
+            continue;
+        memcpy(table->edata, bucket, table->bucketsz);
+        ((struct bucket*)table->edata)->dib = 1;
+        table_place(table, table->edata);
+        item->key = mel_nil();
+    }
+    if (table->rehashidx == table->noldbuckets) {
+        mem_free(table->allocator, table->oldbuckets);
+        table->oldbuckets = NULL;
+        table->noldbuckets = 0;
+        table->rehashidx = 0;
+    }
+}
+
+static bool table_resize(mel_table_t *table, size_t new_cap) {
+    table_rehash(table, SIZE_MAX);
+    void *buckets = mem_calloc(table->allocator, new_cap, table->bucketsz);
+    if (!buckets)
+        return false;
+    table->oldbuckets = table->buckets;
+    table->noldbuckets = table->nbuckets;
+    table->rehashidx = 0;
+    table->buckets = buckets;
+    table->nbuckets = new_cap;
+    table->mask = new_cap-1;
+    table->growat = new_cap * (table->loadfactor / 100.0);
+    table->shrinkat = new_cap * SHRINK_AT;
+#ifndef MEL_TABLE_INCREMENTAL
+    table_rehash(table, SIZE_MAX);
+#endif
+    return true;
+}
+
+static struct entry* buckets_find(void *buckets, size_t bucketsz, size_t mask, const struct lookup *key) {
+    size_t i = key->hash & mask;
+    for (;;) {
+        struct bucket *bucket = bucket_at0(buckets, bucketsz, i);
+        if (!bucket->dib)
+            return NULL;
+        struct entry *item = bucket_item(bucket);
+        if (bucket->hash == key->hash && !mel_is_nil(item->key) && entry_matches(item, key))
+            return item;
+        i = (i + 1) & mask;
+    }
+}
+
+static struct entry* table_find(mel_table_t *table, const struct lookup *key) {
+    struct entry *item = buckets_find(table->buckets, table->bucketsz, table->mask, key);
+    if (!item && table->oldbuckets)
+        item = buckets_find(table->oldbuckets, table->bucketsz, table->noldbuckets-1, key);
+    return item;
+}
+
+static bool table_is_old(mel_table_t *table, struct bucket *bucket) {
+    return table->oldbuckets &&
+           (char*)bucket >= (char*)table->oldbuckets &&
+           (char*)bucket < (char*)table->oldbuckets + table->noldbuckets*table->bucketsz;
+}
+
+static void table_insert(mel_table_t *table, uint64_t hash, mel_value_t key, mel_value_t val) {
+    if (table->count >= table->growat)
+        table_resize(table, table->nbuckets*(1<<table->growpower));
+    struct bucket *entry = table->edata;
+    entry->hash = hash;
+    entry->dib = 1;
+    struct entry *eitem = bucket_item(entry);
+    eitem->key = key;
+    eitem->value = val;
+    table_place(table, entry);
+    table->count++;
+}
+
+static void table_remove(mel_table_t *table, struct entry *item) {
+    struct bucket *bucket = (struct bucket*)((char*)item - sizeof(struct bucket));
+    table->count--;
+    if (table_is_old(table, bucket)) {
+        // Shifting would move entries behind the rehash cursor
+        item->key = mel_nil();
+        return;
+    }
+    size_t i = ((char*)bucket - (char*)table->buckets) / table->bucketsz;
+    bucket->dib = 0;
+    for (;;) {
+        struct bucket *prev = bucket;
+        i = (i + 1) & table->mask;
+        bucket = bucket_at(table, i);
+        if (bucket->dib <= 1) {
+            prev->dib = 0;
+            break;
+        }
+        memcpy(prev, bucket, table->bucketsz);
+        prev->dib--;
+    }
+    if (!table->oldbuckets && table->nbuckets > table->cap && table->count <= table->shrinkat) {
+        // Ignore the return value. It's ok for the resize operation to
+        // fail to allocate enough memory because a shrink operation
+        // does not change the integrity of the data.
+        table_resize(table, table->nbuckets/2);
+    }
+}
+
+// Walks the live entries of both bucket arrays, *index starts at 0
+static struct entry* table_next(mel_table_t *table, size_t *index) {
+    while (*index < table->nbuckets + table->noldbuckets) {
+        size_t i = (*index)++;
+        struct bucket *bucket = i < table->nbuckets ?
+            bucket_at(table, i) :
+            bucket_at0(table->oldbuckets, table->bucketsz, i - table->nbuckets);
+        struct entry *item = bucket_item(bucket);
+        if (bucket->dib && !mel_is_nil(item->key))
+            return item;
+    }
+    return NULL;
+}
+
+static void table_reset(mel_table_t *table) {
+    table->count = 0;
+    mem_free(table->allocator, table->oldbuckets);
+    table->oldbuckets = NULL;
+    table->noldbuckets = 0;
+    table->rehashidx = 0;
+    void *new_buckets = mem_alloc(table->allocator, table->bucketsz*table->cap);
+    if (new_buckets) {
+        mem_free(table->allocator, table->buckets);
+        table->buckets = new_buckets;
+    }
+    table->nbuckets = table->cap;
+    memset(table->buckets, 0, table->bucketsz*table->nbuckets);
+    table->mask = table->nbuckets-1;
+    table->growat = table->nbuckets * (table->loadfactor / 100.0) ;
+    table->shrinkat = table->nbuckets * SHRINK_AT;
+}
+
+static void table_dispose(mel_table_t *table) {
+    mem_free(table->allocator, table->oldbuckets);
+    mem_free(table->allocator, table->buckets);
+}
+#endif
+
+// The engines only manage the hash part, these handle the table itself and
+// its array part
+static mel_table_t* table_new(const mel_allocator_t *allocator, size_t cap) {
+    mel_table_t *table = mem_alloc(allocator, table_size());
+    if (table && !table_init(table, allocator, cap)) {
+        mem_free(allocator, table);
+        return NULL;
+    }
+    return table;
+}
+
+static void table_discard(mel_table_t *table) {
+    mem_free(table->allocator, table->array);
+    table_dispose(table);
+}
+
+static void table_release(mel_table_t *table) {
+    table_discard(table);
+    mem_free(table->allocator, table);
+}
+
+mel_table_t* mel_table_new(void) {
+    return table_new(&mel_default_allocator, 16);
+}
+
+// Largest array part is 2^MEL_TABLE_ARRAY_BITS
+#ifndef MEL_TABLE_ARRAY_BITS
+#define MEL_TABLE_ARRAY_BITS 26
+#endif
+
+// Integer keys from 1 up, and which power of two bucket they count towards
+static bool array_key(mel_value_t key, size_t *index) {
+    if (!mel_is_number(key))
+        return false;
+    mel_float n = mel_as_number(key);
+    if (n < 1 || n > (mel_float)((size_t)1 << MEL_TABLE_ARRAY_BITS) || n != (mel_float)(size_t)n)
+        return false;
+    *index = (size_t)n - 1;
+    return true;
+}
+
+static mel_value_t* array_slot(mel_table_t *table, mel_value_t key) {
+    size_t index;
+    return array_key(key, &index) && index < table->asize ? &table->array[index] : NULL;
+}
+
+static void count_key(size_t *nums, size_t index) {
+    int bits = 0;
+    while (((size_t)1 << bits) < index + 1)
+        bits++;
+    nums[bits]++;
+}
+
+static struct entry* table_find_value(mel_table_t *table, mel_value_t key) {
+    struct lookup lookup = { .hash = value_hash(key), .chars = NULL, .value = key };
+    return table_find(table, &lookup);
+}
+
+static bool table_resize_array(mel_table_t *table, size_t size) {
+    size_t old = table->asize;
+    if (size > old) {
+        mel_value_t *array = mem_realloc(table->allocator, table->array, sizeof(mel_value_t) * size);
+        if (!array)
+            return false;
+        for (size_t i = old; i < size; i++)
+            array[i] = mel_nil();
+        table->array = array;
+        table->asize = size;
+        // Keys that now fit are moved over, found again one by one since
+        // removing from the hash part moves other entries around
+        mel_value_t *keys;
+        garry_with(keys, table->allocator);
+        size_t i = 0, index;
+        struct entry *item;
+        while ((item = table_next(table, &i)))
+            if (array_key(item->key, &index) && index >= old && index < size)
+                garry_append(keys, item->key);
+        for (int k = 0; k < garry_count(keys); k++) {
+            if (!array_key(keys[k], &index) || !(item = table_find_value(table, keys[k])))
+                continue;
+            array[index] = item->value;
+            table->acount++;
+            table_remove(table, item);
+        }
+        garry_free(keys);
+        return true;
+    }
+    for (size_t i = size; i < old; i++)
+        if (!mel_is_nil(table->array[i])) {
+            mel_value_t key = mel_number((mel_float)(i + 1));
+            table_insert(table, value_hash(key), key, table->array[i]);
+            table->acount--;
+        }
+    table->asize = size;
+    if (!size) {
+        mem_free(table->allocator, table->array);
+        table->array = NULL;
+    } else {
+        mel_value_t *array = mem_realloc(table->allocator, table->array, sizeof(mel_value_t) * size);
+        if (array)
+            table->array = array;
+    }
+    return true;
+}
+
+// Called when the hash part is full. Like Lua, the array part becomes the
+// largest power of two n with more than n/2 of the keys 1..n in use
+static void table_rebalance(mel_table_t *table, mel_value_t extra) {
+    size_t nums[MEL_TABLE_ARRAY_BITS + 1] = {0};
+    size_t total = 0, index;
+    for (size_t i = 0; i < table->asize; i++)
+        if (!mel_is_nil(table->array[i])) {
+            count_key(nums, i);
+            total++;
+        }
+    size_t i = 0;
+    struct entry *item;
+    while ((item = table_next(table, &i)))
+        if (array_key(item->key, &index)) {
+            count_key(nums, index);
+            total++;
+        }
+    if (array_key(extra, &index)) {
+        count_key(nums, index);
+        total++;
+    }
+    size_t size = 0, used = 0;
+    for (int bits = 0; bits <= MEL_TABLE_ARRAY_BITS && ((size_t)1 << bits) / 2 < total; bits++) {
+        used += nums[bits];
+        if (used > ((size_t)1 << bits) / 2)
+            size = (size_t)1 << bits;
+    }
+    if (size != table->asize) {
+        // Values are about to move between the parts
+        gc_table_write(table, mel_nil());
+        table_resize_array(table, size);
+    }
+}
+
+// Method lookups cached on the old contents are stale
+static inline void table_changed(mel_table_t *table) {
+    if (table->ismeta && table->vm)
+        table->vm->meta_version++;
+}
+
+static int table_set(mel_table_t *table, const struct lookup *key, mel_value_t val) {
+    gc_table_write(table, val);
+    table_changed(table);
+    mel_value_t *slot = key->chars ? NULL : array_slot(table, key->value);
+    if (slot) {
+        bool existed = !mel_is_nil(*slot);
+        // A nil slot is an absent key
+        table->acount += !mel_is_nil(val) - existed;
+        *slot = val;
+        return existed;
+    }
+    table_rehash(table, MEL_TABLE_REHASH_STEP);
+    struct entry *item = table_find(table, key);
+    if (item) {
+        item->value = val;
+        return 1;
+    }
+    mel_value_t stored;
+    if (key->chars) {
+        mel_string_t *str = key->symbol;
+        if (!str) {
+            if (table->vm)
+                str = mel_as_string(mel_new_string(table->vm, key->chars, key->length));
+            else if (!(str = string_new(table->allocator, key->chars, key->length)))
+                return -1;
+            str->hash = key->hash;
+        }
+        stored = mel_obj(str);
+    } else {
+        if (table->count + table->deleted >= table->growat) {
+            table_rebalance(table, key->value);
+            if ((slot = array_slot(table, key->value))) {
+                table->acount += !mel_is_nil(val);
+                *slot = val;
+                return 0;
+            }
+        }
+        stored = key->value;
+    }
+    gc_table_write(table, stored);
+    table_insert(table, key->hash, stored, val);
+    return 0;
+}
+
+static mel_value_t* table_get(mel_table_t *table, const struct lookup *key) {
+    mel_value_t *slot = key->chars ? NULL : array_slot(table, key->value);
+    if (slot)
+        return mel_is_nil(*slot) ? NULL : slot;
+    table_rehash(table, MEL_TABLE_REHASH_STEP);
+    struct entry *item = table_find(table, key);
+    return item ? &item->value : NULL;
+}
+
+static int table_del(mel_table_t *table, const struct lookup *key) {
+    gc_table_write(table, mel_nil());
+    table_changed(table);
+    mel_value_t *slot = key->chars ? NULL : array_slot(table, key->value);
+    if (slot) {
+        if (mel_is_nil(*slot))
+            return 0;
+        *slot = mel_nil();
+        table->acount--;
+        return 1;
+    }
+    table_rehash(table, MEL_TABLE_REHASH_STEP);
+    struct entry *item = table_find(table, key);
+    if (!item)
+        return 0;
+    if (!table->vm && mel_is_string(item->key) && !mel_as_string(item->key)->interned)
+        obj_destroy(table->allocator, mel_as_obj(item->key));
+    table_remove(table, item);
+    return 1;
+}
+
+// Strings are looked up by their text, NaN and nil can't be keys
+static bool lookup_value(struct lookup *key, mel_value_t value) {
+    if (mel_is_string(value)) {
+        mel_string_t *str = mel_as_string(value);
+        if (!str->hash)
+            str->hash = string_hash(str->chars, str->length);
+        lookup_string(key, str->chars, str->length, str->hash, str->interned ? str : NULL);
+        return true;
+    }
+    if (mel_is_nil(value) || (mel_is_number(value) && mel_as_number(value) != mel_as_number(value)))
+        return false;
+    key->hash = value_hash(value);
+    key->chars = NULL;
+    key->value = value;
+    return true;
+}
+
+int mel_table_set(mel_value_t obj, const char *key, mel_value_t val) {
+    assert(mel_is_table(obj));
+    struct lookup lookup;
+    int length = (int)strlen(key);
+    lookup_string(&lookup, key, length, string_hash(key, length), NULL);
+    return table_set(mel_as_table(obj), &lookup, val);
+}
+
+mel_value_t* mel_table_get(mel_value_t obj, const char *key) {
+    assert(mel_is_table(obj));
+    struct lookup lookup;
+    int length = (int)strlen(key);
+    lookup_string(&lookup, key, length, string_hash(key, length), NULL);
+    return table_get(mel_as_table(obj), &lookup);
+}
+
+int mel_table_del(mel_value_t obj, const char *key) {
+    assert(mel_is_table(obj));
+    struct lookup lookup;
+    int length = (int)strlen(key);
+    lookup_string(&lookup, key, length, string_hash(key, length), NULL);
+    return table_del(mel_as_table(obj), &lookup);
+}
+
+int mel_table_set_symbol(mel_value_t obj, mel_string_t *key, mel_value_t val) {
+    assert(mel_is_table(obj) && key->interned);
+    struct lookup lookup;
+    lookup_string(&lookup, key->chars, key->length, key->hash, key);
+    return table_set(mel_as_table(obj), &lookup, val);
+}
+
+mel_value_t* mel_table_get_symbol(mel_value_t obj, mel_string_t *key) {
+    assert(mel_is_table(obj) && key->interned);
+    struct lookup lookup;
+    lookup_string(&lookup, key->chars, key->length, key->hash, key);
+    return table_get(mel_as_table(obj), &lookup);
+}
+
+int mel_table_del_symbol(mel_value_t obj, mel_string_t *key) {
+    assert(mel_is_table(obj) && key->interned);
+    struct lookup lookup;
+    lookup_string(&lookup, key->chars, key->length, key->hash, key);
+    return table_del(mel_as_table(obj), &lookup);
+}
+
+int mel_table_set_value(mel_value_t obj, mel_value_t key, mel_value_t val) {
+    assert(mel_is_table(obj));
+    struct lookup lookup;
+    if (!lookup_value(&lookup, key))
+        return -1;
+    return table_set(mel_as_table(obj), &lookup, val);
+}
+
+mel_value_t* mel_table_get_value(mel_value_t obj, mel_value_t key) {
+    assert(mel_is_table(obj));
+    struct lookup lookup;
+    if (!lookup_value(&lookup, key))
+        return NULL;
+    return table_get(mel_as_table(obj), &lookup);
+}
+
+int mel_table_del_value(mel_value_t obj, mel_value_t key) {
+    assert(mel_is_table(obj));
+    struct lookup lookup;
+    if (!lookup_value(&lookup, key))
+        return 0;
+    return table_del(mel_as_table(obj), &lookup);
+}
+
+// Keys of tables in a VM belong to the collector, and may already be gone
+// when the table is freed
+static void free_table_keys(mel_table_t *table, bool symbols) {
+    if (table->vm && !symbols)
+        return;
+    size_t i = 0;
+    struct entry *item;
+    while ((item = table_next(table, &i))) {
+        if (!mel_is_string(item->key))
+            continue;
+        mel_string_t *key = mel_as_string(item->key);
+        if (symbols || !key->interned)
+            obj_destroy(table->allocator, &key->obj);
+    }
+}
+
+static void table_free(mel_table_t *table) {
+    free_table_keys(table, false);
+    table_release(table);
+}
+
+static void symbols_free(mel_table_t *symbols) {
+    free_table_keys(symbols, true);
+    table_release(symbols);
+}
+
+void mel_table_clear(mel_value_t obj) {
+    assert(mel_is_table(obj));
+    mel_table_t *table = mel_as_table(obj);
+    gc_table_write(table, mel_nil());
+    table_changed(table);
+    free_table_keys(table, false);
+    table_reset(table);
+    mem_free(table->allocator, table->array);
+    table->array = NULL;
+    table->asize = table->acount = 0;
+}
+
+bool mel_table_next(mel_value_t obj, size_t *cursor, mel_value_t *key, mel_value_t *value) {
+    assert(mel_is_table(obj));
+    mel_table_t *table = mel_as_table(obj);
+    // Lookups would move entries between the bucket arrays otherwise
+    if (!*cursor)
+        table_rehash(table, SIZE_MAX);
+    for (; *cursor < table->asize; (*cursor)++)
+        if (!mel_is_nil(table->array[*cursor])) {
+            if (key)
+                *key = mel_number((mel_float)(*cursor + 1));
+            if (value)
+                *value = table->array[*cursor];
+            (*cursor)++;
+            return true;
+        }
+    size_t i = *cursor - table->asize;
+    struct entry *item = table_next(table, &i);
+    *cursor = table->asize + i;
+    if (!item)
+        return false;
+    if (key)
+        *key = item->key;
+    if (value)
+        *value = item->value;
+    return true;
+}
+
+bool mel_table_set_meta(mel_value_t obj, mel_value_t meta) {
+    assert(mel_is_table(obj) && (mel_is_nil(meta) || mel_is_table(meta)));
+    mel_table_t *table = mel_as_table(obj);
+    mel_table_t *parent = mel_is_nil(meta) ? NULL : mel_as_table(meta);
+    for (mel_table_t *m = parent; m; m = m->meta)
+        if (m == table)
+            return false;
+    gc_table_write(table, meta);
+    table_changed(table);
+    table->meta = parent;
+    if (parent)
+        parent->ismeta = true;
+    return true;
+}
+
+mel_value_t mel_table_get_meta(mel_value_t obj) {
+    assert(mel_is_table(obj));
+    mel_table_t *table = mel_as_table(obj);
+    return table->meta ? mel_obj(table->meta) : mel_nil();
+}
+
+mel_value_t* mel_table_lookup(mel_value_t obj, mel_value_t key) {
+    assert(mel_is_table(obj));
+    struct lookup lookup;
+    if (!lookup_value(&lookup, key))
+        return NULL;
+    for (mel_table_t *table = mel_as_table(obj); table; table = table->meta) {
+        mel_value_t *value = table_get(table, &lookup);
+        if (value)
+            return value;
+    }
+    return NULL;
+}
+
+int mel_table_count(mel_value_t obj) {
+    assert(mel_is_table(obj));
+    mel_table_t *table = mel_as_table(obj);
+    return (int)(table->count + table->acount);
+}
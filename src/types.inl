@@ -1,78 +1,284 @@
-mel_value_t mel_nil(void) {
-    return (mel_value_t) {
-        .type = MEL_VALUE_NIL
-    };
+bool mel_equal(mel_value_t a, mel_value_t b) {
+    if (mel_type_of(a) != mel_type_of(b))
+        return false;
+    switch (mel_type_of(a)) {
+        case MEL_VALUE_NIL:
+            return true;
+        case MEL_VALUE_BOOLEAN:
+            return mel_as_boolean(a) == mel_as_boolean(b);
+        case MEL_VALUE_NUMBER:
+            return mel_as_number(a) == mel_as_number(b);
+        case MEL_VALUE_OBJECT:
+            if (mel_as_obj(a) == mel_as_obj(b))
+                return true;
+            if (mel_is_string(a) && mel_is_string(b)) {
+                mel_string_t *sa = mel_as_string(a);
+                mel_string_t *sb = mel_as_string(b);
+                if (sa->hash && sb->hash && sa->hash != sb->hash)
+                    return false;
+                return sa->length == sb->length && !memcmp(sa->chars, sb->chars, sa->length);
+            }
+            // Ropes compare by their text, against each other or strings
+            if ((mel_is_rope(a) || mel_is_string(a)) && (mel_is_rope(b) || mel_is_string(b))) {
+                if (mel_string_size(a) != mel_string_size(b))
+                    return false;
+                const char *ca = mel_string_utf8(a), *cb = mel_string_utf8(b);
+                return ca && cb && !memcmp(ca, cb, mel_string_size(a));
+            }
+            return false;
+    }
+    return false;
 }
 
-#define X(T, N, TYPE) \
-mel_value_t mel_##N(TYPE v) { \
-    return (mel_value_t) { \
-        .type = MEL_VALUE_##T, \
-        .as.N = v \
-    }; \
-} \
-bool mel_is_##N(mel_value_t v) { \
-    return v.type == MEL_VALUE_##T; \
-} \
-TYPE mel_as_##N(mel_value_t v) { \
-    return (TYPE)v.as.N; \
-}
-TYPES
-#undef X
+static void rope_clear(mel_rope_t *rope);
 
-bool mel_object_is(mel_value_t value, mel_object_type type) {
-    return mel_is_obj(value) && ((mel_object_t*)mel_as_obj(value))->type == type;
+static mel_object_t* obj_new(const mel_allocator_t *allocator, mel_object_type type, size_t size) {
+    mel_object_t *result = mem_alloc(allocator, size);
+    result->type = type;
+    result->mark = 0;
+    result->next = NULL;
+    return result;
 }
 
 mel_object_t* mel_obj_new(mel_object_type type, size_t size) {
-    mel_object_t *result = malloc(size);
-    result->type = type;
-    return result;
+    return obj_new(&mel_default_allocator, type, size);
 }
 
-static void free_table_elements(mel_table_t *table);
+static void table_free(mel_table_t *table);
+#ifdef MEL_JIT
+static void jit_release(const mel_allocator_t *allocator, void *jit);
+#endif
 
-void mel_obj_destroy(mel_object_t *obj) {
+// Strings, tables, ropes and arrays know their allocator, everything else
+// is freed with the one passed in
+static void obj_destroy(const mel_allocator_t *allocator, mel_object_t *obj) {
     switch (obj->type) {
         case MEL_OBJECT_STRING: {
             mel_string_t* string = (mel_string_t*)obj;
-            free((void*)string->chars);
-            free(string);
+            mem_free(string->allocator, string->wide);
+            mem_free(string->allocator, string);
             break;
         }
         case MEL_OBJECT_TABLE: {
-            mel_table_t* table = (mel_table_t*)obj;
-            free_table_elements(table);
-            free(table);
+            table_free((mel_table_t*)obj);
+            break;
+        }
+        case MEL_OBJECT_FUNCTION: {
+            mel_function_t *function = (mel_function_t*)obj;
+            garry_free(function->code);
+            garry_free(function->lines);
+            garry_free(function->constants);
+            garry_free(function->caches);
+            garry_free(function->upvalues);
+#ifdef MEL_JIT
+            if (function->jit)
+                jit_release(allocator, function->jit);
+#endif
+            mem_free(allocator, function);
+            break;
+        }
+        case MEL_OBJECT_NATIVE:
+            mem_free(allocator, ((mel_native_t*)obj)->constants);
+            mem_free(allocator, obj);
+            break;
+        case MEL_OBJECT_CELL:
+        case MEL_OBJECT_CLOSURE:
+            mem_free(allocator, obj);
+            break;
+        case MEL_OBJECT_ROPE: {
+            mel_rope_t *rope = (mel_rope_t*)obj;
+            rope_clear(rope);
+            mem_free(rope->allocator, rope);
+            break;
+        }
+        case MEL_OBJECT_ARRAY: {
+            mel_array_t *array = (mel_array_t*)obj;
+            mem_free(array->allocator, array->values);
+            mem_free(array->allocator, array);
             break;
         }
     }
 }
 
-mel_string_t* mel_string_new(const wchar_t *chars, int length) {
-    mel_string_t *result = malloc(sizeof(mel_string_t));
-    if (!result)
-        return NULL;
+void mel_obj_destroy(mel_object_t *obj) {
+    obj_destroy(&mel_default_allocator, obj);
+}
+
+static uint64_t murmur(const void *data, size_t len, uint32_t seed);
+
+static uint64_t string_hash(const char *chars, int length) {
+    return murmur(chars, length, 0);
+}
+
+static int utf8_count(const char *chars, int length) {
+    int count = 0;
+    for (int i = 0; i < length; i++)
+        count += ((unsigned char)chars[i] & 0xC0) != 0x80;
+    return count;
+}
+
+static inline size_t string_size(int length) {
+    return sizeof(mel_string_t) + length + 1;
+}
+
+// result must have room for string_size(length) bytes
+static void string_init(mel_string_t *result, const mel_allocator_t *allocator, const char *chars, int length) {
     result->obj.type = MEL_OBJECT_STRING;
+    result->obj.mark = 0;
+    result->obj.next = NULL;
     result->length = length;
-    if (!(result->chars = malloc(sizeof(wchar_t) * (length + 1)))) {
-        free(result);
+    result->count = utf8_count(chars, length);
+    result->hash = 0;
+    result->wide = NULL;
+    result->allocator = allocator;
+    result->interned = false;
+    memcpy(result->chars, chars, length);
+    result->chars[length] = '\0';
+}
+
+static mel_string_t* string_new(const mel_allocator_t *allocator, const char *chars, int length) {
+    mel_string_t *result = mem_alloc(allocator, string_size(length));
+    if (result)
+        string_init(result, allocator, chars, length);
+    return result;
+}
+
+mel_string_t* mel_string_new(const char *chars, int length) {
+    return string_new(&mel_default_allocator, chars, length);
+}
+
+#ifndef MEL_ROPE_CHUNK
+#define MEL_ROPE_CHUNK 64
+#endif
+
+static void rope_clear(mel_rope_t *rope) {
+    mel_rope_chunk_t *chunk = rope->first;
+    while (chunk) {
+        mel_rope_chunk_t *next = chunk->next;
+        mem_free(rope->allocator, chunk);
+        chunk = next;
+    }
+    rope->first = rope->last = NULL;
+    if (rope->flat)
+        obj_destroy(rope->allocator, &rope->flat->obj);
+    rope->flat = NULL;
+}
+
+static mel_string_t* rope_flatten(mel_rope_t *rope) {
+    if (rope->flat)
+        return rope->flat;
+    mel_string_t *flat = mem_alloc(rope->allocator, string_size(rope->length));
+    if (!flat)
         return NULL;
+    string_init(flat, rope->allocator, "", 0);
+    char *cursor = flat->chars;
+    for (mel_rope_chunk_t *chunk = rope->first; chunk; chunk = chunk->next) {
+        memcpy(cursor, chunk->data, chunk->used);
+        cursor += chunk->used;
     }
-    memcpy(result->chars, chars, length * sizeof(wchar_t));
-    result->chars[length] = L'\0';
-    return result;
+    *cursor = '\0';
+    flat->length = rope->length;
+    flat->count = rope->count;
+    return rope->flat = flat;
 }
 
-const wchar_t* mel_string_cstr(mel_value_t melv) {
+bool mel_rope_append(mel_value_t melv, const char *chars, int length) {
+    assert(mel_is_rope(melv));
+    mel_rope_t *rope = mel_as_rope(melv);
+    if (rope->flat) {
+        obj_destroy(rope->allocator, &rope->flat->obj);
+        rope->flat = NULL;
+    }
+    rope->length += length;
+    rope->count += utf8_count(chars, length);
+    while (length) {
+        mel_rope_chunk_t *chunk = rope->last;
+        if (!chunk || chunk->used == chunk->size) {
+            int size = chunk ? chunk->size * 2 : MEL_ROPE_CHUNK;
+            if (size < length)
+                size = length;
+            if (!(chunk = mem_alloc(rope->allocator, sizeof(mel_rope_chunk_t) + size)))
+                return false;
+            chunk->next = NULL;
+            chunk->size = size;
+            chunk->used = 0;
+            if (rope->last)
+                rope->last->next = chunk;
+            else
+                rope->first = chunk;
+            rope->last = chunk;
+        }
+        int n = chunk->size - chunk->used;
+        if (n > length)
+            n = length;
+        memcpy(chunk->data + chunk->used, chars, n);
+        chunk->used += n;
+        chars += n;
+        length -= n;
+    }
+    return true;
+}
+
+static mel_string_t* string_of(mel_value_t melv) {
+    if (mel_is_rope(melv))
+        return rope_flatten(mel_as_rope(melv));
     assert(mel_is_string(melv));
-    return mel_as_string(melv)->chars;
+    return mel_as_string(melv);
 }
+
+const char* mel_string_utf8(mel_value_t melv) {
+    mel_string_t *str = string_of(melv);
+    return str ? str->chars : NULL;
+}
+
+const wchar_t* mel_string_cstr(mel_value_t melv) {
+    mel_string_t *str = string_of(melv);
+    if (!str)
+        return NULL;
+    // Wide copy is only made for callers that ask for it
+    if (!str->wide)
+        str->wide = to_wide(str->allocator, (const unsigned char*)str->chars, str->count, NULL);
+    return str->wide;
+}
+
 int mel_string_length(mel_value_t melv) {
+    if (mel_is_rope(melv))
+        return mel_as_rope(melv)->count;
+    assert(mel_is_string(melv));
+    return mel_as_string(melv)->count;
+}
+
+int mel_string_size(mel_value_t melv) {
+    if (mel_is_rope(melv))
+        return mel_as_rope(melv)->length;
     assert(mel_is_string(melv));
     return mel_as_string(melv)->length;
 }
 
+static mel_function_t* function_new(const mel_allocator_t *allocator, mel_string_t *name) {
+    mel_function_t *result = (mel_function_t*)obj_new(allocator, MEL_OBJECT_FUNCTION, sizeof(mel_function_t));
+    result->arity = 0;
+    result->name = name;
+    garry_with(result->code, allocator);
+    garry_with(result->lines, allocator);
+    garry_with(result->constants, allocator);
+    garry_with(result->caches, allocator);
+    garry_with(result->upvalues, allocator);
+    result->slots = 0;
+    result->hotness = 0;
+    result->jit = NULL;
+    return result;
+}
+
+static mel_native_t* native_new(const mel_allocator_t *allocator, const char *name, mel_native_fn fn) {
+    mel_native_t *result = (mel_native_t*)obj_new(allocator, MEL_OBJECT_NATIVE, sizeof(mel_native_t));
+    result->name = name;
+    result->fn = fn;
+    result->nconstants = 0;
+    result->constants = NULL;
+    return result;
+}
+
 static void MM86128(const void *key, const int len, uint32_t seed, void *out) {
 #define ROTL32(x, r) ((x << r) | (x >> (32 - r)))
 #define FMIX32(h) h^=h>>16; h*=0x85ebca6b; h^=h>>13; h*=0xc2b2ae35; h^=h>>16;
@@ -115,7 +321,7 @@ static void MM86128(const void *key, const int len, uint32_t seed, void *out) {
             k4 ^= tail[12] << 0;
             k4 *= c4; k4  = ROTL32(k4,18); k4 *= c1; h4 ^= k4;
         case 12:
-            k3 ^= tail[11] << 24;
+            k3 ^= (uint32_t)tail[11] << 24;
         case 11:
             k3 ^= tail[10] << 16;
         case 10:
@@ -124,7 +330,7 @@ static void MM86128(const void *key, const int len, uint32_t seed, void *out) {
             k3 ^= tail[ 8] << 0;
             k3 *= c3; k3  = ROTL32(k3,17); k3 *= c4; h3 ^= k3;
         case 8:
-            k2 ^= tail[ 7] << 24;
+            k2 ^= (uint32_t)tail[ 7] << 24;
         case 7:
             k2 ^= tail[ 6] << 16;
         case 6:
@@ -133,7 +339,7 @@ static void MM86128(const void *key, const int len, uint32_t seed, void *out) {
             k2 ^= tail[ 4] << 0;
             k2 *= c2; k2  = ROTL32(k2,16); k2 *= c3; h2 ^= k2;
         case 4:
-            k1 ^= tail[ 3] << 24;
+            k1 ^= (uint32_t)tail[ 3] << 24;
         case 3:
             k1 ^= tail[ 2] << 16;
         case 2:
@@ -159,227 +365,3 @@ static uint64_t murmur(const void *data, size_t len, uint32_t seed) {
     MM86128(data, (int)len, (uint32_t)seed, &out);
     return *(uint64_t*)out & 0xFFFFFFFFFFFF;
 }
-
-#define GROW_AT   0.60 /* 60% */
-#define SHRINK_AT 0.10 /* 10% */
-
-#ifndef HASHMAP_LOAD_FACTOR
-#define HASHMAP_LOAD_FACTOR GROW_AT
-#endif
-
-struct bucket {
-    uint64_t hash:48;
-    uint64_t dib:16;
-};
-
-static double clamp_load_factor(double factor, double default_factor) {
-    // Check for NaN and clamp between 50% and 90%
-    return factor != factor ? default_factor :
-           factor < 0.50 ? 0.50 :
-           factor > 0.95 ? 0.95 :
-           factor;
-}
-
-static struct bucket *bucket_at0(void *buckets, size_t bucketsz, size_t i) {
-    return (struct bucket*)(((char*)buckets)+(bucketsz*i));
-}
-
-static struct bucket *bucket_at(mel_table_t *map, size_t index) {
-    return bucket_at0(map->buckets, map->bucketsz, index);
-}
-
-static void *bucket_item(struct bucket *entry) {
-    return ((char*)entry)+sizeof(struct bucket);
-}
-
-mel_table_t* mel_table_new(void) {
-    size_t cap = 16;
-    size_t bucketsz = sizeof(struct bucket) + sizeof(mel_value_t);
-    while (bucketsz & (sizeof(uintptr_t)-1))
-        bucketsz++;
-    // hashmap + spare + edata
-    size_t size = sizeof(mel_table_t)+bucketsz*2;
-    mel_table_t *table = malloc(size);
-    if (!table)
-        return NULL;
-    memset(table, 0, sizeof(mel_table_t));
-    table->obj.type = MEL_OBJECT_TABLE;
-    table->bucketsz = bucketsz;
-    table->spare = ((char*)table)+sizeof(mel_table_t);
-    table->edata = (char*)table->spare+bucketsz;
-    table->cap = cap;
-    table->nbuckets = cap;
-    table->mask = table->nbuckets-1;
-    table->buckets = malloc(table->bucketsz*table->nbuckets);
-    if (!table->buckets) {
-        free(table);
-        return NULL;
-    }
-    memset(table->buckets, 0, table->bucketsz*table->nbuckets);
-    table->growpower = 1;
-    table->loadfactor = clamp_load_factor(HASHMAP_LOAD_FACTOR, GROW_AT) * 100;
-    table->growat = table->nbuckets * (table->loadfactor / 100.0);
-    table->shrinkat = table->nbuckets * SHRINK_AT;
-    return table;
-}
-
-static bool table_resize(mel_table_t *table, size_t new_cap) {
-    mel_table_t *map2 = mel_table_new();
-    if (!map2)
-        abort();
-    for (size_t i = 0; i < table->nbuckets; i++) {
-        struct bucket *entry = bucket_at(table, i);
-        if (!entry->dib)
-            continue;
-        entry->dib = 1;
-        size_t j = entry->hash & map2->mask;
-        for (;;) {
-            struct bucket *bucket = bucket_at(map2, j);
-            if (bucket->dib == 0) {
-                memcpy(bucket, entry, table->bucketsz);
-                break;
-            }
-            if (bucket->dib < entry->dib) {
-                memcpy(map2->spare, bucket, table->bucketsz);
-                memcpy(bucket, entry, table->bucketsz);
-                memcpy(entry, map2->spare, table->bucketsz);
-            }
-            j = (j + 1) & map2->mask;
-            entry->dib += 1;
-        }
-    }
-    free(table->buckets);
-    table->buckets = map2->buckets;
-    table->nbuckets = map2->nbuckets;
-    table->mask = map2->mask;
-    table->growat = map2->growat;
-    table->shrinkat = map2->shrinkat;
-    free(map2);
-    return true;
-}
-
-int mel_table_set(mel_value_t obj, const wchar_t *key, mel_value_t val) {
-    assert(mel_is_table(obj));
-    mel_table_t *table = mel_as_table(obj);
-    if (table->count >= table->growat)
-        if (!table_resize(table, table->nbuckets*(1<<table->growpower)))
-            return -1;
-    
-    struct bucket *entry = table->edata;
-    uint64_t hash = murmur((void*)key, wcslen(key) * 4, 0);
-    entry->hash = hash;
-    entry->dib = 1;
-    void *eitem = bucket_item(entry);
-    memcpy(eitem, &val, sizeof(mel_value_t));
-    
-    void *bitem;
-    size_t i = entry->hash & table->mask;
-    for (;;) {
-        struct bucket *bucket = bucket_at(table, i);
-        if (bucket->dib == 0) {
-            memcpy(bucket, entry, table->bucketsz);
-            table->count++;
-            return 0;
-        }
-        bitem = bucket_item(bucket);
-        if (entry->hash == bucket->hash) {
-            memcpy(table->spare, bitem, sizeof(mel_value_t));
-            memcpy(bitem, eitem, sizeof(mel_value_t));
-            return 1;
-        }
-        if (bucket->dib < entry->dib) {
-            memcpy(table->spare, bucket, table->bucketsz);
-            memcpy(bucket, entry, table->bucketsz);
-            memcpy(entry, table->spare, table->bucketsz);
-            eitem = bucket_item(entry);
-        }
-        i = (i + 1) & table->mask;
-        entry->dib += 1;
-    }
-}
-
-mel_value_t* mel_table_get(mel_value_t obj, const wchar_t *key) {
-    assert(mel_is_table(obj));
-    mel_table_t *table = mel_as_table(obj);
-    uint64_t hash = murmur((void*)key, wcslen(key) * 4, 0);
-    size_t i = hash & table->mask;
-    while(1) {
-        struct bucket *bucket = bucket_at(table, i);
-        if (!bucket->dib)
-            return NULL;
-        if (bucket->hash == hash)
-            return bucket_item(bucket);
-        i = (i + 1) & table->mask;
-    }
-    return NULL;
-}
-
-int mel_table_del(mel_value_t obj, const wchar_t *key) {
-    assert(mel_is_table(obj));
-    mel_table_t *table = mel_as_table(obj);
-    uint64_t hash = murmur((void*)key, wcslen(key) * 4, 0);
-    size_t i = hash & table->mask;
-    while(1) {
-        struct bucket *bucket = bucket_at(table, i);
-        if (!bucket->dib)
-            return 0;
-        void *bitem = bucket_item(bucket);
-        if (bucket->hash == hash) {
-            memcpy(table->spare, bitem, sizeof(mel_value_t));
-            bucket->dib = 0;
-            while(1) {
-                struct bucket *prev = bucket;
-                i = (i + 1) & table->mask;
-                bucket = bucket_at(table, i);
-                if (bucket->dib <= 1) {
-                    prev->dib = 0;
-                    break;
-                }
-                memcpy(prev, bucket, table->bucketsz);
-                prev->dib--;
-            }
-            table->count--;
-            if (table->nbuckets > table->cap && table->count <= table->shrinkat) {
-                // Ignore the return value. It's ok for the resize operation to
-                // fail to allocate enough memory because a shrink operation
-                // does not change the integrity of the data.
-                table_resize(table, table->nbuckets/2);
-            }
-            return 1;
-        }
-        i = (i + 1) & table->mask;
-    }
-}
-
-static void free_table_elements(mel_table_t *table) {
-    for (size_t i = 0; i < table->nbuckets; i++) {
-        struct bucket *bucket = bucket_at(table, i);
-        if (bucket->dib) {
-            mel_value_t *value = bucket_item(bucket);
-            if (mel_is_obj(*value))
-                mel_obj_destroy(mel_as_obj(*value));
-        }
-    }
-}
-
-void mel_table_clear(mel_value_t obj) {
-    assert(mel_is_table(obj));
-    mel_table_t *table = mel_as_table(obj);
-    table->count = 0;
-    free_table_elements(table);
-    void *new_buckets = malloc(table->bucketsz*table->cap);
-    if (new_buckets) {
-        free(table->buckets);
-        table->buckets = new_buckets;
-    }
-    table->nbuckets = table->cap;
-    memset(table->buckets, 0, table->bucketsz*table->nbuckets);
-    table->mask = table->nbuckets-1;
-    table->growat = table->nbuckets * (table->loadfactor / 100.0) ;
-    table->shrinkat = table->nbuckets * SHRINK_AT;
-}
-
-int mel_table_count(mel_value_t obj) {
-    assert(mel_is_table(obj));
-    return (int)mel_as_table(obj)->count;
-}
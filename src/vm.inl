@@ -0,0 +1,1050 @@
+#ifndef MEL_MAX_FRAMES
+#define MEL_MAX_FRAMES 4096
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MEL_COMPUTED_GOTO
+#endif
+
+#ifdef MEL_JIT
+static bool jit_hot(mel_vm_t *vm, mel_function_t *function);
+static mel_result jit_enter(mel_vm_t *vm, mel_function_t *function, unsigned char *pc);
+#endif
+static mel_result vm_execute(mel_vm_t *vm, mel_value_t *height, int depth, mel_value_t *out);
+
+static mel_result vruntime_error(mel_vm_t *vm, const char *format, va_list args) {
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    int count = garry_count(vm->frames);
+    for (int i = count - 1; i >= 0; i--) {
+        if (i == count - 11 && i > 10) {
+            fprintf(stderr, "... %d more frames ...\n", i - 9);
+            i = 10;
+        }
+        mel_frame_t *frame = &vm->frames[i];
+        mel_function_t *function = frame->function;
+        int instruction = (int)(frame->pc - function->code) - 1;
+        fprintf(stderr, "[line %d] in %s\n", function->lines[instruction] + 1,
+                function->name ? function->name->chars : "toplevel");
+    }
+    return MEL_RUNTIME_ERROR;
+}
+
+static mel_result runtime_error(mel_vm_t *vm, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    mel_result ret = vruntime_error(vm, format, args);
+    va_end(args);
+    return ret;
+}
+
+mel_result mel_error(mel_vm_t *vm, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    mel_result ret = vruntime_error(vm, format, args);
+    va_end(args);
+    return ret;
+}
+
+// Frames are given room for everything they push when they are entered,
+// see stack_frame
+static inline void vm_push(mel_vm_t *vm, mel_value_t value) {
+    *vm->stack.top++ = value;
+}
+
+static inline mel_value_t vm_pop(mel_vm_t *vm) {
+    return *--vm->stack.top;
+}
+
+// Drops the values above top, which is in the current segment
+static inline void vm_truncate(mel_vm_t *vm, mel_value_t *top) {
+    vm->stack.top = top;
+}
+
+static mel_result call_value(mel_vm_t *vm, int argc) {
+CALL:
+    // Safe point, the callee and its arguments are all on the stack
+    gc_check(vm);
+    mel_value_t *base = vm->stack.top - argc - 1;
+    mel_value_t callee = *base;
+    if (mel_is_obj(callee))
+        switch (((mel_object_t*)mel_as_obj(callee))->type) {
+            case MEL_OBJECT_FUNCTION:
+            case MEL_OBJECT_CLOSURE: {
+                mel_closure_t *closure = mel_is_closure(callee) ? mel_as_closure(callee) : NULL;
+                mel_function_t *function = closure ? closure->function : mel_as_function(callee);
+                if (argc != function->arity)
+                    return runtime_error(vm, "expected %d arguments but got %d", function->arity, argc);
+                mel_value_t *slots;
+                if (garry_count(vm->frames) == MEL_MAX_FRAMES || !(slots = stack_frame(vm, argc, function->slots)))
+                    return runtime_error(vm, "stack overflow");
+                garry_append(vm->frames, ((mel_frame_t) {
+                    .function = function,
+                    .closure = closure,
+                    .pc = function->code,
+                    .base = slots,
+                    .ret = base
+                }));
+                return MEL_OK;
+            }
+            case MEL_OBJECT_NATIVE: {
+                mel_value_t result = mel_nil();
+                int ranges = garry_count(vm->gc.ranges);
+                if (vm->native_depth == MEL_MAX_FRAMES)
+                    return runtime_error(vm, "stack overflow");
+                vm->native_depth++;
+                mel_result ret = mel_as_native(callee)->fn(vm, argc, base + 1, &result);
+                vm->native_depth--;
+                __garry_n(vm->gc.ranges) = ranges;
+                if (ret != MEL_OK) {
+                    __garry_n(vm->tail) = 0;
+                    return ret;
+                }
+                vm_truncate(vm, base);
+                if (garry_count(vm->tail)) {
+                    // The native's tail call takes its place, natives handing
+                    // over to each other don't pile up C frames
+                    argc = garry_count(vm->tail) - 1;
+                    bool nest = vm->stack.end - base <= argc;
+                    int depth = garry_count(vm->frames);
+                    // No room for it where the native was, it runs nested
+                    if (nest && !stack_reserve(vm, argc + 1)) {
+                        __garry_n(vm->tail) = 0;
+                        return runtime_error(vm, "stack overflow");
+                    }
+                    for (int i = 0; i <= argc; i++)
+                        vm_push(vm, vm->tail[i]);
+                    __garry_n(vm->tail) = 0;
+                    if (!nest)
+                        goto CALL;
+                    if ((ret = call_value(vm, argc)) == MEL_OK)
+                        ret = vm_execute(vm, base, depth, &result);
+                    else
+                        stack_unwind(vm, base);
+                    if (ret != MEL_OK)
+                        return ret;
+                }
+                vm_push(vm, result);
+                return MEL_OK;
+            }
+            default:
+                break;
+        }
+    return runtime_error(vm, "attempt to call a non-function value");
+}
+
+static inline void cell_set(mel_vm_t *vm, mel_cell_t *cell, mel_value_t value) {
+    gc_cell_write(vm, cell, value);
+    cell->value = value;
+}
+
+// Captured locals of frame already hold their cells, see MEL_OP_BOX
+static mel_value_t make_closure(mel_vm_t *vm, mel_function_t *function, mel_frame_t *frame) {
+    int count = garry_count(function->upvalues);
+    mel_closure_t *closure = (mel_closure_t*)obj_new(&vm->allocator, MEL_OBJECT_CLOSURE,
+                                                     sizeof(mel_closure_t) + sizeof(mel_cell_t*) * count);
+    closure->function = function;
+    closure->ncells = count;
+    for (int i = 0; i < count; i++) {
+        mel_upvalue_t upvalue = function->upvalues[i];
+        closure->cells[i] = upvalue.local ?
+            mel_as_cell(frame->base[upvalue.index]) :
+            frame->closure->cells[upvalue.index];
+    }
+    track_object(vm, &closure->obj);
+    // It starts out marked if a cycle is running, so is what it points at
+    if (vm->gc.state == MEL_GC_MARK) {
+        gc_mark_object(vm, &function->obj);
+        for (int i = 0; i < count; i++)
+            gc_mark_object(vm, &closure->cells[i]->obj);
+    }
+    return mel_obj(closure);
+}
+
+// Hands the current frame over to the callee, which is moved down with its
+// arguments to the frame's base. Only functions need a frame, anything else
+// is called as usual and the caller carries on
+static mel_result tail_call(mel_vm_t *vm, int argc) {
+    mel_value_t *top = vm->stack.top - argc - 1;
+    if (!mel_is_function(*top) && !mel_is_closure(*top))
+        return call_value(vm, argc);
+    gc_check(vm);
+    mel_value_t callee = *top;
+    mel_closure_t *closure = mel_is_closure(callee) ? mel_as_closure(callee) : NULL;
+    mel_function_t *function = closure ? closure->function : mel_as_function(callee);
+    if (argc != function->arity)
+        return runtime_error(vm, "expected %d arguments but got %d", function->arity, argc);
+    mel_frame_t *frame = garry_last(vm->frames);
+    memmove(frame->base, top, sizeof(mel_value_t) * (argc + 1));
+    vm_truncate(vm, frame->base + argc + 1);
+    if (!(frame->base = stack_frame(vm, argc, function->slots)))
+        return runtime_error(vm, "stack overflow");
+    frame->function = function;
+    frame->closure = closure;
+    frame->pc = function->code;
+    return MEL_OK;
+}
+
+// Builds a table from count values on top of the stack, keys and values
+// alternating
+static mel_result table_literal(mel_vm_t *vm, int count) {
+    mel_value_t *top = vm->stack.top - count;
+    mel_value_t table = mel_new_table(vm);
+    for (int i = 0; i < count; i += 2)
+        if (mel_table_set_value(table, top[i], top[i + 1]) < 0)
+            return runtime_error(vm, "table keys cannot be nil or NaN");
+    vm_truncate(vm, top);
+    vm_push(vm, table);
+    return MEL_OK;
+}
+
+// Methods come from the metatables of the receiver, never the receiver
+// itself, so a cache only has to remember which metatable it saw
+static mel_result find_method(mel_vm_t *vm, mel_value_t receiver, mel_string_t *name, mel_cache_t *cache, mel_value_t *out) {
+    mel_table_t *meta = mel_is_table(receiver) ? mel_as_table(receiver)->meta : NULL;
+    if (!meta)
+        return runtime_error(vm, "cannot send '%s' to a value without a metatable", name->chars);
+    if (cache) {
+        if (cache->version != vm->meta_version) {
+            memset(cache->metas, 0, sizeof(cache->metas));
+            cache->version = vm->meta_version;
+        }
+        for (int i = 0; i < MEL_CACHE_WAYS; i++)
+            if (cache->metas[i] == meta) {
+                *out = cache->methods[i];
+                return MEL_OK;
+            }
+    }
+    mel_value_t *method = NULL;
+    for (mel_table_t *m = meta; m && !method; m = m->meta)
+        method = mel_table_get_symbol(mel_obj(m), name);
+    if (!method)
+        return runtime_error(vm, "undefined method '%s'", name->chars);
+    if (cache) {
+        cache->metas[cache->next] = meta;
+        cache->methods[cache->next] = *method;
+        cache->next = (cache->next + 1) % MEL_CACHE_WAYS;
+    }
+    *out = *method;
+    return MEL_OK;
+}
+
+static mel_result vm_run(mel_vm_t *vm, int exit_depth) {
+    mel_frame_t *frame;
+    unsigned char *pc;
+    mel_value_t *constants;
+    mel_value_t *base;
+    mel_value_t a, b;
+#define READ_BYTE() (*pc++)
+#define READ_SHORT() (pc += 2, (uint16_t)((pc[-2] << 8) | pc[-1]))
+#define READ_CONSTANT() (constants[READ_SHORT()])
+#define PUSH(V) \
+    do { \
+        mel_value_t _v = (V); \
+        *vm->stack.top++ = _v; \
+    } while (0)
+#define POP() vm_pop(vm)
+#define PEEK(N) (vm->stack.top[-1 - (N)])
+#define SAVE_FRAME() (frame->pc = vm->pc = pc)
+#define LOAD_FRAME() \
+    do { \
+        frame = garry_last(vm->frames); \
+        pc = frame->pc; \
+        constants = frame->function->constants; \
+        base = frame->base; \
+    } while (0)
+#define ERROR(...) \
+    do { \
+        SAVE_FRAME(); \
+        return runtime_error(vm, __VA_ARGS__); \
+    } while (0)
+#define NUMBERS() \
+    do { \
+        if (!mel_is_number(PEEK(0)) || !mel_is_number(PEEK(1))) \
+            ERROR("operands must be numbers"); \
+        b = POP(); \
+        a = PEEK(0); \
+    } while (0)
+#define ARITHMETIC(OP) \
+    do { \
+        NUMBERS(); \
+        PEEK(0) = mel_number(mel_as_number(a) OP mel_as_number(b)); \
+    } while (0)
+#define COMPARE(OP) \
+    do { \
+        NUMBERS(); \
+        PEEK(0) = mel_boolean(mel_as_number(a) OP mel_as_number(b)); \
+    } while (0)
+#define OPERAND(B, OP, RESULT) \
+    do { \
+        b = (B); \
+        if (!mel_is_number(PEEK(0)) || !mel_is_number(b)) \
+            ERROR("operands must be numbers"); \
+        PEEK(0) = RESULT(mel_as_number(PEEK(0)) OP mel_as_number(b)); \
+    } while (0)
+#ifdef MEL_COMPUTED_GOTO
+    static void *dispatch[] = {
+#define X(OP, ...) &&OP_##OP,
+        OPCODES
+#undef X
+    };
+#define DISPATCH() goto *dispatch[READ_BYTE()]
+#define VM_CASE(OP) OP_##OP:
+#define VM_LOOP DISPATCH();
+#define VM_END
+#else
+#define DISPATCH() continue
+#define VM_CASE(OP) case MEL_OP_##OP:
+#define VM_LOOP for (;;) switch (READ_BYTE()) {
+#define VM_END default: ERROR("unknown opcode"); }
+#endif
+#ifdef MEL_JIT
+// Compiled code leaves a frame that hasn't started yet behind when it
+// makes a tail call, that one gets its chance to run compiled too
+#define ENTER_JIT() \
+    do { \
+        mel_result _ret = jit_enter(vm, frame->function, pc); \
+        if (_ret != MEL_OK) \
+            return _ret; \
+        if (garry_count(vm->frames) == exit_depth) \
+            return MEL_OK; \
+        LOAD_FRAME(); \
+    } while (pc == frame->function->code && vm->jit_enabled && jit_hot(vm, frame->function))
+#define TRY_JIT() \
+    do { \
+        if (vm->jit_enabled && jit_hot(vm, frame->function)) \
+            ENTER_JIT(); \
+    } while (0)
+#else
+#define TRY_JIT() do {} while (0)
+#endif
+
+    LOAD_FRAME();
+    if (pc == frame->function->code)
+        TRY_JIT();
+    VM_LOOP
+        VM_CASE(CONSTANT) {
+            PUSH(READ_CONSTANT());
+            DISPATCH();
+        }
+        VM_CASE(NIL) {
+            PUSH(mel_nil());
+            DISPATCH();
+        }
+        VM_CASE(TRUE) {
+            PUSH(mel_boolean(true));
+            DISPATCH();
+        }
+        VM_CASE(POP) {
+            POP();
+            DISPATCH();
+        }
+        VM_CASE(LEAVE) {
+            int n = READ_BYTE();
+            a = POP();
+            vm_truncate(vm, vm->stack.top - n);
+            PUSH(a);
+            DISPATCH();
+        }
+        VM_CASE(GET_LOCAL) {
+            PUSH(base[READ_BYTE()]);
+            DISPATCH();
+        }
+        VM_CASE(SET_LOCAL) {
+            base[READ_BYTE()] = PEEK(0);
+            DISPATCH();
+        }
+        VM_CASE(STORE_LOCAL) {
+            base[READ_BYTE()] = POP();
+            DISPATCH();
+        }
+        VM_CASE(BOX) {
+            mel_value_t *slot = &base[READ_BYTE()];
+            *slot = mel_new_cell(vm, *slot);
+            DISPATCH();
+        }
+        VM_CASE(GET_CELL) {
+            PUSH(mel_as_cell(base[READ_BYTE()])->value);
+            DISPATCH();
+        }
+        VM_CASE(SET_CELL) {
+            cell_set(vm, mel_as_cell(base[READ_BYTE()]), PEEK(0));
+            DISPATCH();
+        }
+        VM_CASE(GET_UPVALUE) {
+            PUSH(frame->closure->cells[READ_BYTE()]->value);
+            DISPATCH();
+        }
+        VM_CASE(SET_UPVALUE) {
+            cell_set(vm, frame->closure->cells[READ_BYTE()], PEEK(0));
+            DISPATCH();
+        }
+        VM_CASE(GET_GLOBAL) {
+            mel_global_t *global = &vm->global_slots[READ_SHORT()];
+            if (!global->defined)
+                ERROR("undefined variable '%s'", global->name->chars);
+            PUSH(global->value);
+            DISPATCH();
+        }
+        VM_CASE(SET_GLOBAL) {
+            mel_global_t *global = &vm->global_slots[READ_SHORT()];
+            global->value = PEEK(0);
+            global->defined = true;
+            DISPATCH();
+        }
+        VM_CASE(ADD) {
+            ARITHMETIC(+);
+            DISPATCH();
+        }
+        VM_CASE(SUB) {
+            ARITHMETIC(-);
+            DISPATCH();
+        }
+        VM_CASE(MUL) {
+            ARITHMETIC(*);
+            DISPATCH();
+        }
+        VM_CASE(DIV) {
+            ARITHMETIC(/);
+            DISPATCH();
+        }
+        VM_CASE(NEGATE) {
+            if (!mel_is_number(PEEK(0)))
+                ERROR("operand must be a number");
+            PEEK(0) = mel_number(-mel_as_number(PEEK(0)));
+            DISPATCH();
+        }
+        VM_CASE(NOT) {
+            PEEK(0) = mel_boolean(mel_is_falsey(PEEK(0)));
+            DISPATCH();
+        }
+        VM_CASE(EQUAL) {
+            b = POP();
+            PEEK(0) = mel_boolean(mel_equal(PEEK(0), b));
+            DISPATCH();
+        }
+        VM_CASE(LESS) {
+            COMPARE(<);
+            DISPATCH();
+        }
+        VM_CASE(GREATER) {
+            COMPARE(>);
+            DISPATCH();
+        }
+        VM_CASE(LESS_EQUAL) {
+            COMPARE(<=);
+            DISPATCH();
+        }
+        VM_CASE(GREATER_EQUAL) {
+            COMPARE(>=);
+            DISPATCH();
+        }
+#define X(OP, _, SYMBOL, RESULT) \
+        VM_CASE(OP##_LOCAL) { \
+            OPERAND(base[READ_BYTE()], SYMBOL, RESULT); \
+            DISPATCH(); \
+        } \
+        VM_CASE(OP##_CONSTANT) { \
+            OPERAND(READ_CONSTANT(), SYMBOL, RESULT); \
+            DISPATCH(); \
+        }
+        FUSED_OPS
+#undef X
+        VM_CASE(JUMP) {
+            uint16_t offset = READ_SHORT();
+            pc += offset;
+            DISPATCH();
+        }
+        VM_CASE(JUMP_IF_FALSE) {
+            uint16_t offset = READ_SHORT();
+            if (mel_is_falsey(POP()))
+                pc += offset;
+            DISPATCH();
+        }
+        VM_CASE(JUMP_IF_FALSE_OR_POP) {
+            uint16_t offset = READ_SHORT();
+            if (mel_is_falsey(PEEK(0)))
+                pc += offset;
+            else
+                POP();
+            DISPATCH();
+        }
+        VM_CASE(JUMP_IF_TRUE_OR_POP) {
+            uint16_t offset = READ_SHORT();
+            if (!mel_is_falsey(PEEK(0)))
+                pc += offset;
+            else
+                POP();
+            DISPATCH();
+        }
+        VM_CASE(LOOP) {
+            uint16_t offset = READ_SHORT();
+            pc -= offset;
+            // Safe point, a loop may allocate without ever making a call
+            gc_check(vm);
+            TRY_JIT();
+            DISPATCH();
+        }
+        VM_CASE(ARRAY) {
+            int count = READ_SHORT();
+            mel_value_t *top = vm->stack.top - count;
+            a = mel_new_array(vm, count, top);
+            vm_truncate(vm, top);
+            PUSH(a);
+            DISPATCH();
+        }
+        VM_CASE(TABLE) {
+            int count = READ_SHORT();
+            SAVE_FRAME();
+            mel_result ret = table_literal(vm, count);
+            if (ret != MEL_OK)
+                return ret;
+            DISPATCH();
+        }
+        VM_CASE(CLOSURE) {
+            a = make_closure(vm, mel_as_function(READ_CONSTANT()), frame);
+            PUSH(a);
+            DISPATCH();
+        }
+        VM_CASE(CALL) {
+            int argc = READ_BYTE();
+            int depth = garry_count(vm->frames);
+            SAVE_FRAME();
+            mel_result ret = call_value(vm, argc);
+            if (ret != MEL_OK)
+                return ret;
+            LOAD_FRAME();
+            if (garry_count(vm->frames) > depth)
+                TRY_JIT();
+            DISPATCH();
+        }
+        VM_CASE(SEND) {
+            mel_string_t *name = mel_as_string(READ_CONSTANT());
+            int argc = READ_BYTE();
+            mel_cache_t *cache = &frame->function->caches[READ_SHORT()];
+            int depth = garry_count(vm->frames);
+            SAVE_FRAME();
+            mel_result ret = find_method(vm, PEEK(argc - 1), name, cache, &PEEK(argc));
+            if (ret != MEL_OK)
+                return ret;
+            ret = call_value(vm, argc);
+            if (ret != MEL_OK)
+                return ret;
+            LOAD_FRAME();
+            if (garry_count(vm->frames) > depth)
+                TRY_JIT();
+            DISPATCH();
+        }
+        VM_CASE(TAIL_CALL) {
+            int argc = READ_BYTE();
+            SAVE_FRAME();
+            mel_result ret = tail_call(vm, argc);
+            if (ret != MEL_OK)
+                return ret;
+            LOAD_FRAME();
+            if (pc == frame->function->code)
+                TRY_JIT();
+            DISPATCH();
+        }
+        VM_CASE(TAIL_SEND) {
+            mel_string_t *name = mel_as_string(READ_CONSTANT());
+            int argc = READ_BYTE();
+            mel_cache_t *cache = &frame->function->caches[READ_SHORT()];
+            SAVE_FRAME();
+            mel_result ret = find_method(vm, PEEK(argc - 1), name, cache, &PEEK(argc));
+            if (ret != MEL_OK)
+                return ret;
+            ret = tail_call(vm, argc);
+            if (ret != MEL_OK)
+                return ret;
+            LOAD_FRAME();
+            if (pc == frame->function->code)
+                TRY_JIT();
+            DISPATCH();
+        }
+        VM_CASE(RETURN) {
+            a = POP();
+            stack_unwind(vm, frame->ret);
+            garry_pop(vm->frames);
+            PUSH(a);
+            if (garry_count(vm->frames) == exit_depth)
+                return MEL_OK;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+    VM_END
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef SAVE_FRAME
+#undef LOAD_FRAME
+#undef ERROR
+#undef NUMBERS
+#undef ARITHMETIC
+#undef COMPARE
+#undef OPERAND
+#undef DISPATCH
+#undef VM_CASE
+#undef VM_LOOP
+#undef VM_END
+#undef ENTER_JIT
+#undef TRY_JIT
+    return MEL_RUNTIME_ERROR;
+}
+
+static mel_result vm_execute(mel_vm_t *vm, mel_value_t *height, int depth, mel_value_t *out) {
+    mel_result ret = garry_count(vm->frames) > depth ? vm_run(vm, depth) : MEL_OK;
+    if (ret == MEL_OK) {
+        if (out)
+            *out = vm->stack.top[-1];
+    } else if (vm->frames)
+        __garry_n(vm->frames) = depth;
+    stack_unwind(vm, height);
+    return ret;
+}
+
+mel_result mel_call(mel_vm_t *vm, mel_value_t callee, int argc, mel_value_t *argv, mel_value_t *out) {
+    mel_value_t *height = vm->stack.top;
+    int depth = garry_count(vm->frames);
+    if (!stack_reserve(vm, argc + 1))
+        return runtime_error(vm, "stack overflow");
+    vm_push(vm, callee);
+    for (int i = 0; i < argc; i++)
+        vm_push(vm, argv[i]);
+    mel_result ret = call_value(vm, argc);
+    if (ret != MEL_OK) {
+        stack_unwind(vm, height);
+        return ret;
+    }
+    return vm_execute(vm, height, depth, out);
+}
+
+mel_result mel_send(mel_vm_t *vm, mel_string_t *name, int argc, mel_value_t *argv, mel_value_t *out) {
+    mel_value_t method;
+    if (argc < 1)
+        return runtime_error(vm, "send needs a receiver");
+    mel_result ret = find_method(vm, argv[0], name, NULL, &method);
+    return ret != MEL_OK ? ret : mel_call(vm, method, argc, argv, out);
+}
+
+mel_result mel_tail_call(mel_vm_t *vm, mel_value_t callee, int argc, mel_value_t *argv) {
+    __garry_n(vm->tail) = 0;
+    garry_append(vm->tail, callee);
+    for (int i = 0; i < argc; i++)
+        garry_append(vm->tail, argv[i]);
+    return MEL_OK;
+}
+
+mel_result mel_tail_send(mel_vm_t *vm, mel_string_t *name, int argc, mel_value_t *argv) {
+    mel_value_t method;
+    if (argc < 1)
+        return runtime_error(vm, "send needs a receiver");
+    mel_result ret = find_method(vm, argv[0], name, NULL, &method);
+    return ret != MEL_OK ? ret : mel_tail_call(vm, method, argc, argv);
+}
+
+static mel_result native_print(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    (void)vm;
+    for (int i = 0; i < argc; i++)
+        mel_print(argv[i]);
+    *out = argc ? argv[argc - 1] : mel_nil();
+    return MEL_OK;
+}
+
+#define ARITHMETIC \
+    X(add, "+", +, 0) \
+    X(sub, "-", -, 0) \
+    X(mul, "*", *, 1) \
+    X(div, "/", /, 1)
+
+#define X(NAME, _, OP, IDENTITY) \
+static mel_result native_##NAME(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) { \
+    mel_float result = IDENTITY; \
+    for (int i = 0; i < argc; i++) { \
+        if (!mel_is_number(argv[i])) \
+            return runtime_error(vm, "operands must be numbers"); \
+        mel_float n = mel_as_number(argv[i]); \
+        result = !i && argc > 1 ? n : result OP n; \
+    } \
+    *out = mel_number(result); \
+    return MEL_OK; \
+}
+ARITHMETIC
+#undef X
+
+#define COMPARISONS \
+    X(less, "<", <) \
+    X(greater, ">", >) \
+    X(less_equal, "<=", <=) \
+    X(greater_equal, ">=", >=)
+
+#define X(NAME, _, OP) \
+static mel_result native_##NAME(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) { \
+    for (int i = 0; i < argc; i++) \
+        if (!mel_is_number(argv[i])) \
+            return runtime_error(vm, "operands must be numbers"); \
+    bool result = true; \
+    for (int i = 1; i < argc && result; i++) \
+        result = mel_as_number(argv[i - 1]) OP mel_as_number(argv[i]); \
+    *out = mel_boolean(result); \
+    return MEL_OK; \
+}
+COMPARISONS
+#undef X
+
+static mel_result native_equal(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    (void)vm;
+    bool result = true;
+    for (int i = 1; i < argc && result; i++)
+        result = mel_equal(argv[i - 1], argv[i]);
+    *out = mel_boolean(result);
+    return MEL_OK;
+}
+
+static mel_result native_not(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    if (argc != 1)
+        return runtime_error(vm, "expected 1 argument but got %d", argc);
+    *out = mel_boolean(mel_is_falsey(argv[0]));
+    return MEL_OK;
+}
+
+// Appends the text of a string, rope or number
+static mel_result rope_append_value(mel_vm_t *vm, mel_value_t rope, mel_value_t value) {
+    if (mel_is_number(value)) {
+        char buf[32];
+        int length = snprintf(buf, sizeof(buf), "%.14g", mel_as_number(value));
+        return mel_rope_append(rope, buf, length) ? MEL_OK : runtime_error(vm, "out of memory");
+    }
+    if (!mel_is_string(value) && !mel_is_rope(value))
+        return runtime_error(vm, "can only append strings, ropes and numbers");
+    if (mel_is_rope(value)) {
+        // Copied chunk by chunk so appending a rope never flattens it. The
+        // end is fixed up front in case a rope is appended to itself
+        mel_rope_t *src = mel_as_rope(value);
+        mel_rope_chunk_t *chunk = src->first, *last = src->last;
+        int tail = last ? last->used : 0;
+        for (; chunk; chunk = chunk->next) {
+            if (!mel_rope_append(rope, chunk->data, chunk == last ? tail : chunk->used))
+                return runtime_error(vm, "out of memory");
+            if (chunk == last)
+                break;
+        }
+        return MEL_OK;
+    }
+    mel_string_t *str = mel_as_string(value);
+    return mel_rope_append(rope, str->chars, str->length) ? MEL_OK : runtime_error(vm, "out of memory");
+}
+
+static mel_result native_rope(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    mel_value_t rope = mel_new_rope(vm);
+    for (int i = 0; i < argc; i++) {
+        mel_result ret = rope_append_value(vm, rope, argv[i]);
+        if (ret != MEL_OK)
+            return ret;
+    }
+    *out = rope;
+    return MEL_OK;
+}
+
+static mel_result native_append(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    if (!argc || !mel_is_rope(argv[0]))
+        return runtime_error(vm, "first argument must be a rope");
+    for (int i = 1; i < argc; i++) {
+        mel_result ret = rope_append_value(vm, argv[0], argv[i]);
+        if (ret != MEL_OK)
+            return ret;
+    }
+    *out = argv[0];
+    return MEL_OK;
+}
+
+static mel_result array_index(mel_vm_t *vm, mel_value_t array, mel_value_t index, int *out) {
+    if (!mel_is_array(array))
+        return runtime_error(vm, "first argument must be an array");
+    if (!mel_is_number(index))
+        return runtime_error(vm, "index must be a number");
+    mel_float n = mel_as_number(index);
+    // Range first, so NaN and huge values never reach the cast
+    if (!(n >= 0 && n < mel_as_array(array)->count) || n != (int)n)
+        return runtime_error(vm, "index %.14g out of range", n);
+    *out = (int)n;
+    return MEL_OK;
+}
+
+static mel_result native_aref(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    if (argc != 2)
+        return runtime_error(vm, "expected 2 arguments but got %d", argc);
+    int index;
+    mel_result ret = array_index(vm, argv[0], argv[1], &index);
+    if (ret != MEL_OK)
+        return ret;
+    *out = mel_array_get(argv[0], index);
+    return MEL_OK;
+}
+
+static mel_result native_aset(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    if (argc != 3)
+        return runtime_error(vm, "expected 3 arguments but got %d", argc);
+    int index;
+    mel_result ret = array_index(vm, argv[0], argv[1], &index);
+    if (ret != MEL_OK)
+        return ret;
+    if (!mel_array_set(argv[0], index, argv[2]))
+        return runtime_error(vm, "out of memory");
+    *out = argv[2];
+    return MEL_OK;
+}
+
+static mel_result native_push(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    if (!argc || !mel_is_array(argv[0]))
+        return runtime_error(vm, "first argument must be an array");
+    for (int i = 1; i < argc; i++)
+        if (!mel_array_push(argv[0], argv[i]))
+            return runtime_error(vm, "out of memory");
+    *out = argv[0];
+    return MEL_OK;
+}
+
+static mel_result native_length(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    if (argc != 1)
+        return runtime_error(vm, "expected 1 argument but got %d", argc);
+    if (mel_is_array(argv[0]))
+        *out = mel_number(mel_array_count(argv[0]));
+    else if (mel_is_table(argv[0]))
+        *out = mel_number(mel_table_count(argv[0]));
+    else if (mel_is_string(argv[0]) || mel_is_rope(argv[0]))
+        *out = mel_number(mel_string_length(argv[0]));
+    else
+        return runtime_error(vm, "length of a value that is not an array, table or string");
+    return MEL_OK;
+}
+
+// Follows the metatables like a send does
+static mel_result native_get(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    if (argc != 2)
+        return runtime_error(vm, "expected 2 arguments but got %d", argc);
+    if (!mel_is_table(argv[0]))
+        return runtime_error(vm, "first argument must be a table");
+    mel_value_t *value = mel_table_lookup(argv[0], argv[1]);
+    *out = value ? *value : mel_nil();
+    return MEL_OK;
+}
+
+// Setting a key to nil removes it
+static mel_result native_put(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    if (argc != 3)
+        return runtime_error(vm, "expected 3 arguments but got %d", argc);
+    if (!mel_is_table(argv[0]))
+        return runtime_error(vm, "first argument must be a table");
+    if (mel_is_nil(argv[2]))
+        mel_table_del_value(argv[0], argv[1]);
+    else if (mel_table_set_value(argv[0], argv[1], argv[2]) < 0)
+        return runtime_error(vm, "table keys cannot be nil or NaN");
+    *out = argv[2];
+    return MEL_OK;
+}
+
+static mel_result native_setmeta(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    if (argc != 2)
+        return runtime_error(vm, "expected 2 arguments but got %d", argc);
+    if (!mel_is_table(argv[0]) || (!mel_is_nil(argv[1]) && !mel_is_table(argv[1])))
+        return runtime_error(vm, "expected a table and a table or nil");
+    if (!mel_table_set_meta(argv[0], argv[1]))
+        return runtime_error(vm, "metatables cannot form a loop");
+    *out = argv[0];
+    return MEL_OK;
+}
+
+static mel_result native_getmeta(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    if (argc != 1)
+        return runtime_error(vm, "expected 1 argument but got %d", argc);
+    *out = mel_is_table(argv[0]) ? mel_table_get_meta(argv[0]) : mel_nil();
+    return MEL_OK;
+}
+
+static mel_result array_arg(mel_vm_t *vm, mel_value_t value, mel_array_t **out) {
+    if (!mel_is_array(value))
+        return runtime_error(vm, "expected an array");
+    *out = mel_as_array(value);
+    return MEL_OK;
+}
+
+// Unpacked arrays take the scalar path one element at a time
+static mel_result array_number(mel_vm_t *vm, mel_array_t *array, int index, mel_float *out) {
+    if (array->packed) {
+        *out = array->numbers[index];
+        return MEL_OK;
+    }
+    if (!mel_is_number(array->values[index]))
+        return runtime_error(vm, "array elements must be numbers");
+    *out = mel_as_number(array->values[index]);
+    return MEL_OK;
+}
+
+static mel_result native_sum(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    mel_array_t *array = NULL;
+    if (argc != 1)
+        return runtime_error(vm, "expected 1 argument but got %d", argc);
+    mel_result ret = array_arg(vm, argv[0], &array);
+    if (ret != MEL_OK)
+        return ret;
+    if (array->packed) {
+        *out = mel_number(simd_kernels()->sum(array->numbers, array->count));
+        return MEL_OK;
+    }
+    mel_float result = 0, n = 0;
+    for (int i = 0; i < array->count; i++) {
+        if ((ret = array_number(vm, array, i, &n)) != MEL_OK)
+            return ret;
+        result += n;
+    }
+    *out = mel_number(result);
+    return MEL_OK;
+}
+
+static mel_result native_dot(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    mel_array_t *a = NULL, *b = NULL;
+    if (argc != 2)
+        return runtime_error(vm, "expected 2 arguments but got %d", argc);
+    mel_result ret;
+    if ((ret = array_arg(vm, argv[0], &a)) != MEL_OK || (ret = array_arg(vm, argv[1], &b)) != MEL_OK)
+        return ret;
+    if (a->count != b->count)
+        return runtime_error(vm, "arrays must be the same length");
+    if (a->packed && b->packed) {
+        *out = mel_number(simd_kernels()->dot(a->numbers, b->numbers, a->count));
+        return MEL_OK;
+    }
+    mel_float result = 0, x = 0, y = 0;
+    for (int i = 0; i < a->count; i++) {
+        if ((ret = array_number(vm, a, i, &x)) != MEL_OK || (ret = array_number(vm, b, i, &y)) != MEL_OK)
+            return ret;
+        result += x * y;
+    }
+    *out = mel_number(result);
+    return MEL_OK;
+}
+
+#define EXTREMES \
+    X(min, <) \
+    X(max, >)
+
+// Takes either one array or any number of numbers
+#define X(NAME, OP) \
+static mel_result native_##NAME(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) { \
+    mel_float result = 0, n = 0; \
+    mel_result ret; \
+    if (argc == 1 && mel_is_array(argv[0])) { \
+        mel_array_t *array = mel_as_array(argv[0]); \
+        if (!array->count) \
+            return runtime_error(vm, #NAME " of an empty array"); \
+        if (array->packed) { \
+            *out = mel_number(simd_kernels()->NAME(array->numbers, array->count)); \
+            return MEL_OK; \
+        } \
+        for (int i = 0; i < array->count; i++) { \
+            if ((ret = array_number(vm, array, i, &n)) != MEL_OK) \
+                return ret; \
+            if (!i || n OP result) \
+                result = n; \
+        } \
+    } else { \
+        if (!argc) \
+            return runtime_error(vm, "expected at least 1 argument"); \
+        for (int i = 0; i < argc; i++) { \
+            if (!mel_is_number(argv[i])) \
+                return runtime_error(vm, "operands must be numbers"); \
+            n = mel_as_number(argv[i]); \
+            if (!i || n OP result) \
+                result = n; \
+        } \
+    } \
+    *out = mel_number(result); \
+    return MEL_OK; \
+}
+EXTREMES
+#undef X
+
+static mel_binary_kernel map_kernel(mel_value_t fn) {
+    if (!mel_is_native(fn))
+        return NULL;
+    const mel_kernels_t *kernels = simd_kernels();
+#define X(NAME, ...) \
+    if (mel_as_native(fn)->fn == native_##NAME) \
+        return kernels->NAME;
+    SIMD_BINARY
+#undef X
+    return NULL;
+}
+
+static mel_result native_map(mel_vm_t *vm, int argc, mel_value_t *argv, mel_value_t *out) {
+    if (argc < 2)
+        return runtime_error(vm, "expected a function and at least one array");
+    if (argc - 1 > UINT8_MAX)
+        return runtime_error(vm, "too many arrays");
+    mel_value_t fn = argv[0];
+    mel_array_t *arrays[UINT8_MAX];
+    int narrays = argc - 1, count = INT32_MAX;
+    for (int i = 0; i < narrays; i++) {
+        mel_result ret = array_arg(vm, argv[i + 1], &arrays[i]);
+        if (ret != MEL_OK)
+            return ret;
+        if (arrays[i]->count < count)
+            count = arrays[i]->count;
+    }
+    // Arithmetic over two packed arrays is a single kernel
+    mel_binary_kernel kernel = map_kernel(fn);
+    if (kernel && narrays == 2 && arrays[0]->packed && arrays[1]->packed) {
+        mel_value_t result = mel_new_array(vm, count, NULL);
+        mel_array_t *array = mel_as_array(result);
+        if (array->capacity < count)
+            return runtime_error(vm, "out of memory");
+        kernel(array->numbers, arrays[0]->numbers, arrays[1]->numbers, count);
+        array->count = count;
+        *out = result;
+        return MEL_OK;
+    }
+    mel_value_t result = mel_new_array(vm, count, NULL);
+    mel_gc_push(vm, &result, 1);
+    mel_value_t args[UINT8_MAX], value;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < narrays; j++)
+            args[j] = mel_array_get(mel_obj(arrays[j]), i);
+        mel_result ret = mel_call(vm, fn, narrays, args, &value);
+        if (ret != MEL_OK)
+            return ret;
+        if (!mel_array_push(result, value))
+            return runtime_error(vm, "out of memory");
+    }
+    *out = result;
+    return MEL_OK;
+}
+
+static void define_natives(mel_vm_t *vm) {
+    mel_define_native(vm, "print", native_print);
+#define X(NAME, SYMBOL, ...) mel_define_native(vm, SYMBOL, native_##NAME);
+    ARITHMETIC
+    COMPARISONS
+#undef X
+    mel_define_native(vm, "=", native_equal);
+    mel_define_native(vm, "not", native_not);
+    mel_define_native(vm, "rope", native_rope);
+    mel_define_native(vm, "append", native_append);
+    mel_define_native(vm, "aref", native_aref);
+    mel_define_native(vm, "aset", native_aset);
+    mel_define_native(vm, "push", native_push);
+    mel_define_native(vm, "length", native_length);
+    mel_define_native(vm, "get", native_get);
+    mel_define_native(vm, "put", native_put);
+    mel_define_native(vm, "setmeta", native_setmeta);
+    mel_define_native(vm, "getmeta", native_getmeta);
+    mel_define_native(vm, "sum", native_sum);
+    mel_define_native(vm, "dot", native_dot);
+#define X(NAME, ...) mel_define_native(vm, #NAME, native_##NAME);
+    EXTREMES
+#undef X
+    mel_define_native(vm, "map", native_map);
+}
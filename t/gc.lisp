@@ -0,0 +1,47 @@
+; Allocation heavy loops and closures that live through collections. Any
+; mismatch prints FAIL and stops with an error
+(defun check (name got want)
+  (if (= got want)
+      (print name)
+      (progn (print "FAIL" name got want) (fail))))
+
+; Garbage from a loop that never calls anything, back-edges are safe points
+(setq i 0 x nil)
+(while (< i 2000000)
+  (setq x [i i i i])
+  (setq x {"a" i "b" [i]})
+  (setq i (+ i 1)))
+(check "loop garbage" (get x "a") 1999999)
+
+; Survivors mixed in with the garbage
+(setq keep [] i 0 j 0)
+(while (< i 200000)
+  (let ((t1 {"n" i}))
+    (if (= j 1000) (progn (push keep t1) (setq j 0))))
+  (setq i (+ i 1) j (+ j 1)))
+(defun total (a n acc)
+  (if (= n (length a)) acc (total a (+ n 1) (+ acc (get (aref a n) "n")))))
+(check "survivors" (total keep 0 0) 19900000)
+
+; Captured cells are only reachable through the closures
+(defun counter ()
+  (let ((n 0))
+    (lambda () (setq n (+ n 1)))))
+(setq counters [] i 0)
+(while (< i 100)
+  (push counters (counter))
+  (setq i (+ i 1)))
+(setq i 0 j 0)
+(while (< i 300000)
+  (setq x [(rope "garbage") {"k" [i]}])
+  ((aref counters j))
+  (setq i (+ i 1) j (+ j 1))
+  (if (= j 100) (setq j 0)))
+(check "closure cells" ((aref counters 7)) 3001)
+
+; A closure made from young values, collected around while it is held
+(defun pair (a b) (lambda (k) (if (= k 0) a b)))
+(setq p (pair {"x" 1} [2 3]))
+(setq i 0)
+(while (< i 300000) (setq x {"y" i}) (setq i (+ i 1)))
+(check "young captures" (+ (get (p 0) "x") (aref (p 1) 1)) 4)
@@ -0,0 +1,3 @@
+; Has to stop with "[3:23] Error: unexpected character" rather than hang
+; while looking ahead for captured locals
+(defun f (x) (print x : 1))
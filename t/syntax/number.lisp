@@ -0,0 +1,3 @@
+; Has to stop with "[3:11] Error: malformed number" rather than reading
+; the number 1 and then the variable e30x
+(print (+ 1e30x 1))
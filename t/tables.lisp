@@ -0,0 +1,53 @@
+; Run under each table engine (default, MEL_TABLE_SWISS, MEL_TABLE_ORDERED,
+; MEL_TABLE_INCREMENTAL). Any mismatch prints FAIL and stops with an error
+(defun check (name got want)
+  (if (= got want)
+      (print name)
+      (progn (print "FAIL" name got want) (fail))))
+
+; Integer keys fill the array part, the rest hash
+(setq tb {} i 0)
+(while (< i 50000)
+  (put tb i (* i 2))
+  (put tb (+ i 0.5) i)
+  (put tb (- 0 i 1) "neg")
+  (setq i (+ i 1)))
+(check "count" (length tb) 150000)
+(check "array part" (get tb 49999) 99998)
+(check "fractions" (get tb 1234.5) 1234)
+(check "negatives" (get tb -50000) "neg")
+(check "missing" (get tb 50000) nil)
+
+; Deleting every other key shrinks and rehashes
+(setq i 0)
+(while (< i 50000)
+  (put tb (+ i 0.5) nil)
+  (put tb i nil)
+  (setq i (+ i 2)))
+(check "after delete" (length tb) 100000)
+(check "deleted" (get tb 100.5) nil)
+(check "kept" (get tb 101.5) 101)
+(check "kept int" (get tb 101) 202)
+
+; Keys of every kind side by side
+(setq key {} arr [1 2])
+(setq mixed {"s" 1 t 2})
+(check "literal" (length mixed) 2)
+(put mixed key "table")
+(put mixed arr "array")
+(put mixed 1000000000000 "big")
+(check "string" (get mixed "s") 1)
+(check "boolean" (get mixed t) 2)
+(check "table identity" (get mixed key) "table")
+(check "other table" (get mixed {}) nil)
+(check "array identity" (get mixed arr) "array")
+(check "big number" (get mixed 1000000000000) "big")
+
+; Overwrites while growing
+(setq tb {} i 0)
+(while (< i 20000)
+  (put tb "k" i)
+  (put tb (* i 3) i)
+  (setq i (+ i 1)))
+(check "overwrite" (get tb "k") 19999)
+(check "grown" (length tb) 20001)
@@ -0,0 +1,34 @@
+; Tail calls run in constant stack, interpreted, compiled by the JIT and
+; through mel -c. Any mismatch prints FAIL and stops with an error
+(defun check (name got want)
+  (if (= got want)
+      (print name)
+      (progn (print "FAIL" name got want) (fail))))
+
+(defun loop (n acc) (if (= n 0) acc (loop (- n 1) (+ acc 1))))
+(check "self" (loop 1000000 0) 1000000)
+
+(defun ev (n) (if (= n 0) t (od (- n 1))))
+(defun od (n) (if (= n 0) nil (ev (- n 1))))
+(check "mutual" (ev 1000001) nil)
+
+; Through let, and and or
+(defun down (n) (let ((m (- n 1))) (if (< n 1) "done" (down m))))
+(check "let" (down 1000000) "done")
+(defun all (n) (and (> n -1) (or (= n 0) (all (- n 1)))))
+(check "and/or" (all 1000000) t)
+
+; Closures and natives in tail position
+(defun walk (f n) (if (= n 0) (f 0) (walk f (- n 1))))
+(check "closure" (walk (lambda (x) (+ x 7)) 1000000) 7)
+(defun ends (n) (if (= n 0) (max 3 4) (ends (- n 1))))
+(check "native" (ends 1000000) 4)
+
+; Sends
+(setq Counter {"down" (lambda (self n) (if (= n 0) (get self "x") (send self down (- n 1))))})
+(setq c (setmeta {"x" 42} Counter))
+(check "send" (send c down 1000000) 42)
+
+; Garbage made on every trip around
+(defun churn (n x) (if (= n 0) (get x "i") (churn (- n 1) {"i" n "a" [n n]})))
+(check "churn" (churn 1000000 nil) 1)
@@ -0,0 +1,86 @@
+// Generates src/keywords.inl, see `make keywords`
+//
+// Searches for multipliers that give every keyword its own slot when
+// hashed on its length and first and last characters, then writes the
+// keyword list out as an X-macro with the slots filled in
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+static const struct {
+    const char *kind;
+    const char *name;
+} keywords[] = {
+    { "NIL", "nil" },
+    { "T", "t" },
+    { "SETQ", "setq" },
+    { "IF", "if" },
+    { "PROGN", "progn" },
+    { "LET", "let" },
+    { "LET_STAR", "let*" },
+    { "LAMBDA", "lambda" },
+    { "DEFUN", "defun" },
+    { "WHILE", "while" },
+    { "AND", "and" },
+    { "OR", "or" },
+    { "SEND", "send" },
+    { "ADD", "+" },
+    { "SUB", "-" },
+    { "MUL", "*" },
+    { "DIV", "/" },
+    { "EQUAL", "=" },
+    { "LESS", "<" },
+    { "GREATER", ">" },
+    { "LESS_EQUAL", "<=" },
+    { "GREATER_EQUAL", ">=" },
+    { "NOT", "not" }
+};
+
+#define COUNT (sizeof(keywords) / sizeof(keywords[0]))
+#define BITS 6
+
+static unsigned slot(const char *name, unsigned a, unsigned b, unsigned c) {
+    size_t length = strlen(name);
+    uint32_t h = (uint32_t)((unsigned char)name[0] * a + (unsigned char)name[length - 1] * b + length * c);
+    return (h * 0x9E3779B1u) >> (32 - BITS);
+}
+
+static int search(unsigned *a, unsigned *b, unsigned *c) {
+    for (*a = 1; *a < 256; (*a)++)
+        for (*b = 1; *b < 256; (*b)++)
+            for (*c = 1; *c < 256; (*c)++) {
+                uint64_t used = 0;
+                size_t i = 0;
+                for (; i < COUNT; i++) {
+                    uint64_t bit = 1ull << slot(keywords[i].name, *a, *b, *c);
+                    if (used & bit)
+                        break;
+                    used |= bit;
+                }
+                if (i == COUNT)
+                    return 1;
+            }
+    return 0;
+}
+
+int main(void) {
+    unsigned a, b, c;
+    if (!search(&a, &b, &c)) {
+        fprintf(stderr, "no perfect hash found, increase BITS\n");
+        return 1;
+    }
+    size_t longest = 0;
+    for (size_t i = 0; i < COUNT; i++)
+        if (strlen(keywords[i].name) > longest)
+            longest = strlen(keywords[i].name);
+    printf("// Generated by tools/keywords.c, do not edit\n\n");
+    printf("#define KEYWORD_BITS %d\n", BITS);
+    printf("#define KEYWORD_MAX %zu\n", longest);
+    printf("#define KEYWORD_HASH(FIRST, LAST, LENGTH) \\\n");
+    printf("    (((uint32_t)((FIRST) * %uu + (LAST) * %uu + (LENGTH) * %uu) * 0x9E3779B1u) >> (32 - KEYWORD_BITS))\n\n", a, b, c);
+    printf("#define KEYWORDS \\\n");
+    for (size_t i = 0; i < COUNT; i++)
+        printf("    X(%s, \"%s\", %u)%s\n", keywords[i].kind, keywords[i].name,
+               slot(keywords[i].name, a, b, c), i + 1 < COUNT ? " \\" : "");
+    return 0;
+}